@@ -38,12 +38,79 @@
  * in a separated task. To do that, the CTAP library is using prototypes
  * to leave the choice to the global application how APDU/CBOR content
  * is to be passed from one lib to another (IPC, direct access, etc.)
+ *
+ * The resp buffer given to the handlers is owned by the CTAP layer and is
+ * CTAPHID_MAX_PAYLOAD_SIZE (7609) bytes long: the response is written in
+ * place, and is fragmented into HID frames directly from this buffer.
  */
 
 typedef mbed_error_t (*ctap_handle_apdu_t)(uint32_t metadata,
                                            uint8_t *msg_in, uint16_t len_in,
                                            uint8_t *resp, uint16_t *len_out);
 
+/*
+ * Asynchronous variant of the APDU handler: the request is only submitted to
+ * the backend (e.g. through an IPC to the task executing libapdu) and the
+ * function returns immediately. The backend writes its response in resp (up
+ * to resp_maxlen bytes) and then calls ctap_backend_complete(). Until then,
+ * msg_in and resp stay valid and CTAP keeps on handling the other channels.
+ * metadata is the CTAPHID command (e.g. CTAP_MSG) that carried the request.
+ */
+typedef mbed_error_t (*ctap_submit_apdu_t)(uint32_t metadata,
+                                           uint8_t *msg_in, uint16_t len_in,
+                                           uint8_t *resp, uint16_t resp_maxlen);
+
+#if CONFIG_USR_LIB_CTAP_CTAP2
+/*
+ * CTAPHID_CBOR requests handler (FIDO2 authenticator API). msg_in points
+ * directly to the request reassembly buffer, the request content is not
+ * copied. The handler writes its CBOR encoded response in resp, *len_out
+ * being the resp buffer size at call time and the response size at return.
+ * metadata is the CTAPHID command (CTAP_CBOR).
+ */
+typedef mbed_error_t (*ctap_handle_cbor_t)(uint32_t metadata,
+                                           uint8_t *msg_in, uint16_t len_in,
+                                           uint8_t *resp, uint16_t *len_out);
+
+/*
+ * Asynchronous variant of the CBOR handler, with the same semantic as
+ * ctap_submit_apdu_t: completion is notified with ctap_backend_complete().
+ */
+typedef mbed_error_t (*ctap_submit_cbor_t)(uint32_t metadata,
+                                           uint8_t *msg_in, uint16_t len_in,
+                                           uint8_t *resp, uint16_t resp_maxlen);
+#endif
+
+/*
+ * Vendor commands handler (see ctap_declare_vendor()). msg_in points directly
+ * to the channel reassembly buffer, and resp to the TX response buffer (up
+ * to CTAPHID_MAX_PAYLOAD_SIZE bytes) from which the response is sent: none
+ * of them is copied. *len_out is the resp buffer size at call time and the
+ * response size at return. metadata is the vendor command.
+ * Returning MBED_ERROR_INVPARAM answers ERR_INVALID_PAR to the host, any
+ * other error ERR_OTHER.
+ */
+typedef mbed_error_t (*ctap_handle_vendor_t)(uint32_t metadata,
+                                             uint8_t *msg_in, uint16_t len_in,
+                                             uint8_t *resp, uint16_t *len_out);
+
+/*
+ * Status of the asynchronous backend, sent to the host in the
+ * CTAPHID_KEEPALIVE frames while a request is being executed.
+ */
+typedef enum {
+    CTAP_KEEPALIVE_PROCESSING = 1,
+    CTAP_KEEPALIVE_UPNEEDED   = 2, /* waiting for user presence */
+} ctap_keepalive_status_t;
+
+/*
+ * Cancel event: the host has cancelled the request being executed by the
+ * asynchronous backend (CTAPHID_CANCEL). The backend should stop as soon
+ * as possible (e.g. stop waiting for user presence) and call
+ * ctap_backend_complete(), its response being discarded anyway.
+ */
+typedef void (*ctap_handle_cancel_t)(void);
+
 /*
  * Wink event (LEDs, ... for timeout_ms milliseconds).
  */
@@ -79,6 +146,112 @@ typedef mbed_error_t (*ctap_channel_create_t)(uint32_t *newcid);
 typedef mbed_error_t (*ctap_channel_update_t)(uint32_t cid);
 
 
+/************************************************************
+ * About runtime statistics
+ */
+
+/* per command counters index */
+typedef enum {
+    CTAP_STATS_CMD_PING = 0,
+    CTAP_STATS_CMD_MSG,
+    CTAP_STATS_CMD_LOCK,
+    CTAP_STATS_CMD_INIT,
+    CTAP_STATS_CMD_WINK,
+    CTAP_STATS_CMD_CBOR,
+    CTAP_STATS_CMD_CANCEL,
+    CTAP_STATS_CMD_SYNC,
+    CTAP_STATS_CMD_VENDOR,
+    CTAP_STATS_CMD_NUM
+} ctap_stats_cmd_t;
+
+/* backend time histograms index */
+typedef enum {
+    CTAP_STATS_BACKEND_MSG = 0,
+    CTAP_STATS_BACKEND_CBOR,
+    CTAP_STATS_BACKEND_NUM
+} ctap_stats_backend_t;
+
+/* busy rejections (ERR_CHANNEL_BUSY) index, per cause */
+typedef enum {
+    CTAP_STATS_BUSY_POOL = 0, /* no reassembly buffer for the request */
+    CTAP_STATS_BUSY_RESP,     /* TX response buffer held (requests wait for it instead) */
+    CTAP_STATS_BUSY_BACKEND,  /* backend executing another request */
+    CTAP_STATS_BUSY_CHANNEL,  /* request pending or executing on the channel */
+    CTAP_STATS_BUSY_CID,      /* no channel slot left */
+    CTAP_STATS_BUSY_LOCK,     /* another channel holds the lock */
+    CTAP_STATS_BUSY_NUM
+} ctap_stats_busy_t;
+
+/* errors are counted by CTAPHID error code, codes above 0x0b (ERR_OTHER)
+ * being counted together in the last counter */
+#define CTAP_STATS_ERR_NUM      13
+/* log2 histograms: bucket 0 counts null values, bucket i values in
+ * [2^(i-1), 2^i), the last bucket being open ended */
+#define CTAP_STATS_HIST_BUCKETS 24
+
+typedef struct {
+    uint32_t frames_rx;   /* HID reports received */
+    uint32_t frames_tx;   /* HID reports sent */
+    uint32_t rx_stalls;   /* OUT EP left NAK on a full RX ring */
+    uint32_t tx_drops;    /* responses (or frames) dropped on a full TX queue */
+    uint32_t evictions;   /* channels evicted to allocate a new one */
+    uint32_t cid_pool_misses; /* CIDs drawn on the INIT, the CIDs pool being empty */
+    uint32_t cmds[CTAP_STATS_CMD_NUM]; /* requests accepted on their first frame */
+    /* error responses sent, e.g. busy rejections (0x06, ERR_CHANNEL_BUSY)
+     * and transaction timeouts (0x05, ERR_MSG_TIMEOUT) */
+    uint32_t errors[CTAP_STATS_ERR_NUM];
+    /* busy rejections, per cause (their sum is errors[0x06]) */
+    uint32_t busy[CTAP_STATS_BUSY_NUM];
+    /* backend execution time (us), from the request dispatch to the
+     * backend response */
+    uint32_t backend_us[CTAP_STATS_BACKEND_NUM][CTAP_STATS_HIST_BUCKETS];
+} ctap_stats_t;
+
+
+/************************************************************
+ * About HID frames capture
+ */
+
+/*
+ * Capture file format: a header, followed by fixed size records in their
+ * capture order. Both are multiple of 8 bytes and hold no pointer, so
+ * that a capture file can be mapped and its records read in place.
+ * Fields are little endian.
+ */
+#define CTAP_CAPTURE_MAGIC      0x50435443 /* "CTCP" */
+#define CTAP_CAPTURE_VERSION    1
+#define CTAP_CAPTURE_FRAME_LEN  64
+
+typedef enum {
+    CTAP_CAPTURE_OUT = 0,  /* frame received from the host */
+    CTAP_CAPTURE_IN  = 1,  /* frame sent to the host */
+} ctap_capture_dir_t;
+
+typedef struct __packed {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;    /* sizeof(ctap_capture_rec_t) */
+    uint64_t reserved;
+} ctap_capture_hdr_t;
+
+typedef struct __packed {
+    uint64_t ts_us;       /* systick (us) */
+    uint32_t seq;         /* record number, a gap telling records lost */
+    uint8_t  dir;         /* ctap_capture_dir_t */
+    uint8_t  len;         /* frame size, the frame being zero padded */
+    uint16_t reserved;
+    uint8_t  frame[CTAP_CAPTURE_FRAME_LEN];
+} ctap_capture_rec_t;
+
+/*
+ * Capture hook, called for each frame received (from the OUT report
+ * trigger) and sent (when pushed to the IN EP). Being called from ISR
+ * context, it is expected to only copy the record (e.g. in a RAM buffer
+ * or a flash log) and return.
+ */
+typedef void (*ctap_capture_t)(const ctap_capture_rec_t *rec);
+
+
 /************************************************************
  * libCTAP global interface prototypes
  */
@@ -89,6 +262,150 @@ typedef mbed_error_t (*ctap_channel_update_t)(uint32_t cid);
  */
 mbed_error_t ctap_declare(uint8_t usbxdci_handler, ctap_handle_apdu_t apdu_cmd, ctap_handle_wink_t wink_cmd);
 
+/*
+ * Declare CTAP HID interface with an asynchronous APDU backend (see
+ * ctap_submit_apdu_t). Only one request is submitted at a time, requests
+ * received on other channels in the meantime are answered with a busy
+ * channel error.
+ */
+mbed_error_t ctap_declare_async(uint8_t usbxdci_handler, ctap_submit_apdu_t submit_cmd, ctap_handle_wink_t wink_cmd);
+
+#if CONFIG_USR_LIB_CTAP_CTAP2
+/*
+ * Declare the CTAPHID_CBOR requests handler, after ctap_declare() or
+ * ctap_declare_async(). The CBOR capability is then advertised in the
+ * CTAPHID_INIT response. A single request (APDU or CBOR) is executed
+ * at a time.
+ */
+mbed_error_t ctap_declare_cbor(ctap_handle_cbor_t cbor_cmd);
+
+/*
+ * Same as ctap_declare_cbor(), CBOR requests being submitted to an
+ * asynchronous backend.
+ */
+mbed_error_t ctap_declare_cbor_async(ctap_submit_cbor_t submit_cmd);
+#endif
+
+/*
+ * Attach a handler to a vendor command (0x40..0x7f, without bit 7), for
+ * requests of min_len to max_len bytes, checked on their first frame. The
+ * handler is executed by ctap_exec(), from which context (or before
+ * ctap_configure()) this function is to be called. Declaring an already
+ * declared command replaces its handler.
+ * CONFIG_USR_LIB_CTAP_VENDOR_CMDS commands can be declared, the enabled
+ * built-in vendor commands (0x40 statistics, 0x41 throughput test and 0x42
+ * trace) being reserved.
+ * May return:
+ *    - MBED_ERROR_NONE: handler declared
+ *    - MBED_ERROR_INVPARAM: null handler, invalid command or lengths,
+ *      built-in command
+ *    - MBED_ERROR_NOMEM: no more vendor command slot
+ */
+mbed_error_t ctap_declare_vendor(uint8_t cmd, uint16_t min_len, uint16_t max_len, ctap_handle_vendor_t vendor_cmd);
+
+/*
+ * Completion of the request submitted to the asynchronous backend. status
+ * is the backend status, resp_len the length of the response written in
+ * the resp buffer given at submission. May be called from an ISR or from
+ * another thread: the response is sent back by ctap_exec().
+ * May return:
+ *    - MBED_ERROR_NONE: completion taken into account
+ *    - MBED_ERROR_INVSTATE: no request submitted, or already completed
+ */
+mbed_error_t ctap_backend_complete(mbed_error_t status, uint16_t resp_len);
+
+/*
+ * Streamed response: instead of writing its whole response before calling
+ * ctap_backend_complete(), the asynchronous backend may declare the
+ * response length (i.e. the CTAPHID BCNT) with ctap_backend_resp_begin(),
+ * and then push the response by chunks. Each frame is sent as soon as its
+ * payload has been pushed, so that the USB transfer overlaps the response
+ * encoding. chunk may point in the resp buffer given at submission, at
+ * the current offset, in which case it is not copied.
+ * ctap_backend_complete() is called once the whole response is pushed.
+ * Both functions may be called from an ISR or from another thread.
+ * May return:
+ *    - MBED_ERROR_NONE: length declared, chunk taken into account
+ *    - MBED_ERROR_INVPARAM: response too long, chunk beyond the declared length
+ *    - MBED_ERROR_INVSTATE: no request submitted (or cancelled), not started
+ *      or already started stream
+ */
+mbed_error_t ctap_backend_resp_begin(uint16_t resp_len);
+
+mbed_error_t ctap_backend_resp_push(const uint8_t *chunk, uint16_t len);
+
+/*
+ * Declare the asynchronous backend cancel handler. The handler is executed
+ * by ctap_exec() when the CTAPHID_CANCEL frame is received.
+ */
+mbed_error_t ctap_declare_cancel(ctap_handle_cancel_t cancel_cmd);
+
+/*
+ * Return true if the request being executed by the asynchronous backend has
+ * been cancelled by the host, for backends polling for cancellation instead
+ * of declaring a cancel handler.
+ */
+bool ctap_backend_cancelled(void);
+
+/*
+ * Update the status sent in the KEEPALIVE frames while the submitted request
+ * is executed (CTAP_KEEPALIVE_PROCESSING when submitted).
+ * May return:
+ *    - MBED_ERROR_NONE: status updated
+ *    - MBED_ERROR_INVPARAM: unknown status
+ *    - MBED_ERROR_INVSTATE: no request submitted
+ */
+mbed_error_t ctap_backend_set_status(ctap_keepalive_status_t status);
+
+/*
+ * Set the channels timeouts (ms): an in progress (partially received)
+ * request is answered with ERR_MSG_TIMEOUT transaction_ms after its last
+ * frame, and a channel is released idle_ms after its last use (600 ms and
+ * 40 s by default). Both are evaluated by ctap_exec(), from which context
+ * this function is to be called.
+ * May return:
+ *    - MBED_ERROR_NONE: timeouts updated, including for the open channels
+ *    - MBED_ERROR_INVPARAM: null timeout
+ */
+mbed_error_t ctap_set_timeouts(uint32_t transaction_ms, uint32_t idle_ms);
+
+/*
+ * Get a snapshot of the runtime statistics (CONFIG_USR_LIB_CTAP_STATS),
+ * counted since the startup or the last ctap_reset_stats(). The counters
+ * being updated from ctap_exec() and from the USB triggers, the snapshot
+ * is consistent per counter only.
+ * The same counters are sent back to the host on a CTAPHID_VENDOR_STATS
+ * request, for fleet tooling, in a versioned big endian wire format
+ * (see CTAP_STATS_WIRE_VERSION).
+ * May return:
+ *    - MBED_ERROR_NONE: snapshot copied
+ *    - MBED_ERROR_INVPARAM: null stats
+ *    - MBED_ERROR_UNSUPORTED: statistics not enabled
+ */
+mbed_error_t ctap_get_stats(ctap_stats_t *stats);
+
+void ctap_reset_stats(void);
+
+/*
+ * Declare the frames capture hook (CONFIG_USR_LIB_CTAP_CAPTURE), NULL
+ * stopping the capture. Records are numbered from the startup. The
+ * application writes the capture file header (ctap_capture_hdr_t) itself.
+ * May return:
+ *    - MBED_ERROR_NONE: hook declared
+ *    - MBED_ERROR_UNSUPORTED: capture not enabled
+ */
+mbed_error_t ctap_declare_capture(ctap_capture_t capture);
+
+#if CONFIG_USR_LIB_CTAP_TRACE
+/*
+ * Copy the binary trace ring snapshot (header and most recent records, see
+ * ctap_trace.h) in buf, for the application to export it by its own means
+ * (the host can also read it with the CTAPHID_VENDOR_TRACE command).
+ * Return the snapshot size, 0 if buf is too small for the header.
+ */
+uint16_t ctap_trace_snapshot(uint8_t *buf, uint16_t len);
+#endif
+
 /*
  * Configure the overall CTAP and below stack (including HID & USB stack).
  */
@@ -0,0 +1,74 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "ctap_capture.h"
+
+#if CONFIG_USR_LIB_CTAP_CAPTURE
+
+volatile ctap_capture_t ctap_capture_hook = NULL;
+
+/* records numbered since the startup */
+static volatile uint32_t capture_seq = 0;
+
+void ctap_capture_frame(uint8_t dir, const uint8_t *frame, uint8_t len)
+{
+    ctap_capture_t hook = ctap_capture_hook;
+    ctap_capture_rec_t rec;
+    uint64_t ts = 0;
+
+    if (hook == NULL) {
+        return;
+    }
+    if (len > CTAP_CAPTURE_FRAME_LEN) {
+        len = CTAP_CAPTURE_FRAME_LEN;
+    }
+    sys_get_systick(&ts, PREC_MICRO);
+    rec.ts_us = ts;
+    /* the reception trigger may preempt the engine while it sends a frame */
+    rec.seq = __atomic_fetch_add(&capture_seq, 1, __ATOMIC_RELAXED);
+    rec.dir = dir;
+    rec.len = len;
+    rec.reserved = 0;
+    memcpy(rec.frame, frame, len);
+    memset(&rec.frame[len], 0, CTAP_CAPTURE_FRAME_LEN - len);
+    hook(&rec);
+}
+
+#endif
+
+mbed_error_t ctap_declare_capture(ctap_capture_t capture)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+#if CONFIG_USR_LIB_CTAP_CAPTURE
+    ctap_capture_hook = capture;
+#else
+    (void)capture;
+    errcode = MBED_ERROR_UNSUPORTED;
+#endif
+    return errcode;
+}
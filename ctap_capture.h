@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef CTAP_CAPTURE_H_
+#define CTAP_CAPTURE_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libctap.h"
+
+/*
+ * HID frames capture (CONFIG_USR_LIB_CTAP_CAPTURE, see ctap_declare_capture()).
+ *
+ * Frames are captured where they cross the HID layer: at reception, from
+ * the OUT report trigger, and when pushed with usbhid_send_response(). The
+ * capture costs a branch while no hook is declared.
+ */
+
+#if CONFIG_USR_LIB_CTAP_CAPTURE
+
+extern volatile ctap_capture_t ctap_capture_hook;
+
+void ctap_capture_frame(uint8_t dir, const uint8_t *frame, uint8_t len);
+
+# define CTAP_CAPTURE(dir, frame, len) do { \
+    if (ctap_capture_hook != NULL) {        \
+        ctap_capture_frame((dir), (frame), (len)); \
+    }                                       \
+} while (0)
+#else
+# define CTAP_CAPTURE(dir, frame, len) do { } while (0)
+#endif
+
+#endif/*!CTAP_CAPTURE_H_*/
@@ -1,90 +1,416 @@
 #include "ctap_chan.h"
 #include "ctap_control.h"
+#include "ctap_pool.h"
+#include "ctap_stats.h"
+#include "ctap_trace.h"
 #include "libc/random.h"
 #include "libc/sync.h"
 
 chan_ctx_t chans[MAX_CIDS] = { 0 };
 
-chan_ctx_t *ctap_cid_get_chan_ctx(uint32_t cid)
+/*
+ * CID index: CIDs are random 32 bits values, they are hashed (multiplicative
+ * hashing) into CID_BUCKETS buckets, each bucket being a list of chans[]
+ * slots linked through cid_next[]. Free slots are kept in a stack, so that
+ * lookup, insertion and removal are constant time.
+ */
+#define CID_NONE 0xff
+
+static uint8_t cid_bucket[CID_BUCKETS];
+static uint8_t cid_next[MAX_CIDS];
+static uint8_t cid_free[MAX_CIDS];
+static uint8_t cid_free_num = 0;
+static bool    cid_index_ready = false;
+
+static uint8_t cid_done_next[MAX_CIDS];
+static uint8_t cid_done_head = CID_NONE;
+static uint8_t cid_done_tail = CID_NONE;
+static bool    cid_done_queued[MAX_CIDS];
+
+/*
+ * Channels deadlines min-heap, evaluated by the engine: idle channels are
+ * released CID lifetime ms after their last use, in progress commands time
+ * out after the transaction timeout. Channels executed by the backend have
+ * no deadline, and are out of the heap.
+ * The heap arrays have two slots at least: with a single channel, the
+ * compiler could not prove otherwise the sift down children accesses
+ * (bounded by cid_heap_num) valid.
+ */
+#define CID_HEAP_SLOTS ((MAX_CIDS > 1) ? MAX_CIDS : 2)
+static uint8_t  cid_heap[CID_HEAP_SLOTS];
+static uint8_t  cid_heap_pos[CID_HEAP_SLOTS]; /* CID_NONE if not in the heap */
+static uint8_t  cid_heap_num = 0;
+static uint32_t cid_transaction_timeout = CTAP_HID_TRANSACTION_TIMEOUT;
+static uint32_t cid_idle_timeout = CID_LIFETIME;
+
+static inline uint32_t ctap_cid_hash(uint32_t cid)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if(chans[i].busy == true && chans[i].cid == cid){
-            return &(chans[i]);
-        }
+    return ((uint32_t)(cid * 0x9e3779b1U)) >> (32 - CID_HASH_BITS);
+}
+
+static void ctap_cid_index_init(void)
+{
+    for (uint32_t b = 0; b < CID_BUCKETS; ++b) {
+        cid_bucket[b] = CID_NONE;
+    }
+    cid_free_num = 0;
+    cid_done_head = cid_done_tail = CID_NONE;
+    cid_heap_num = 0;
+    /* lower slots are popped first */
+    for (uint8_t i = MAX_CIDS; i > 0; --i) {
+        chans[i - 1].busy = false;
+        cid_next[i - 1] = CID_NONE;
+        cid_done_queued[i - 1] = false;
+        cid_heap_pos[i - 1] = CID_NONE;
+        cid_free[cid_free_num++] = i - 1;
     }
-    return NULL;
+    cid_index_ready = true;
 }
 
-ctap_cmd_t *ctap_cid_get_chan_complete_cmd(void)
+/* return the chans[] slot of an active cid, CID_NONE if not found */
+static inline uint8_t ctap_cid_lookup(uint32_t cid)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if(chans[i].busy == true && chans[i].ctap_cmd_received == CTAP_CMD_COMPLETE){
-            return &(chans[i].ctap_cmd);
+    if (!cid_index_ready) {
+        return CID_NONE;
+    }
+    uint8_t i = cid_bucket[ctap_cid_hash(cid)];
+    while (i != CID_NONE) {
+        if (chans[i].cid == cid) {
+            break;
         }
+        i = cid_next[i];
     }
-    return NULL;
+    return i;
 }
 
-ctap_cmd_t *ctap_cid_get_chan_inprogress_cmd(void)
+static void ctap_cid_index_insert(uint8_t i)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if(chans[i].busy == true && chans[i].ctap_cmd_received == CTAP_CMD_INPROGRESS){
-            return &(chans[i].ctap_cmd);
+    uint32_t b = ctap_cid_hash(chans[i].cid);
+    cid_next[i] = cid_bucket[b];
+    cid_bucket[b] = i;
+}
+
+static void ctap_cid_index_remove(uint8_t i)
+{
+    uint32_t b = ctap_cid_hash(chans[i].cid);
+    uint8_t *link = &cid_bucket[b];
+    while (*link != CID_NONE) {
+        if (*link == i) {
+            *link = cid_next[i];
+            break;
         }
+        link = &cid_next[*link];
     }
-    return NULL;
+    cid_next[i] = CID_NONE;
 }
 
-/* Sanity check that at any time only one channel is in the
- * CTAP_CMD_INPROGRESS state.
- */
-bool ctap_cid_chan_sanity_check(void)
+static void ctap_cid_done_unlink(uint8_t i)
 {
-    unsigned int cnt = 0;
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if(chans[i].busy == true && chans[i].ctap_cmd_received == CTAP_CMD_INPROGRESS){
-            cnt++;
+    uint8_t prev = CID_NONE;
+    uint8_t *link = &cid_done_head;
+
+    if (!cid_done_queued[i]) {
+        return;
+    }
+    /* the unlinked slot is the head in the nominal case */
+    while (*link != CID_NONE) {
+        if (*link == i) {
+            *link = cid_done_next[i];
+            if (cid_done_tail == i) {
+                cid_done_tail = prev;
+            }
+            break;
         }
+        prev = *link;
+        link = &cid_done_next[*link];
     }
-    if(cnt > 1){
-        return false;
+    cid_done_next[i] = CID_NONE;
+    cid_done_queued[i] = false;
+}
+
+static inline void ctap_cid_heap_set(uint8_t pos, uint8_t i)
+{
+    cid_heap[pos] = i;
+    cid_heap_pos[i] = pos;
+}
+
+static void ctap_cid_heap_up(uint8_t pos)
+{
+    uint8_t i = cid_heap[pos];
+    while (pos > 0) {
+        uint8_t parent = (pos - 1) / 2;
+        if (chans[cid_heap[parent]].deadline <= chans[i].deadline) {
+            break;
+        }
+        ctap_cid_heap_set(pos, cid_heap[parent]);
+        pos = parent;
     }
-    return true;
+    ctap_cid_heap_set(pos, i);
 }
 
-ctap_cmd_t *ctap_cid_get_chan_cmd(uint32_t cid)
+static void ctap_cid_heap_down(uint8_t pos)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if(chans[i].busy == true && chans[i].cid == cid){
-            return &(chans[i].ctap_cmd);
+    uint8_t i = cid_heap[pos];
+    while (1) {
+        uint8_t child = 2 * pos + 1;
+        if (child >= cid_heap_num) {
+            break;
+        }
+        if ((child + 1) < cid_heap_num &&
+            chans[cid_heap[child + 1]].deadline < chans[cid_heap[child]].deadline) {
+            child++;
+        }
+        if (chans[i].deadline <= chans[cid_heap[child]].deadline) {
+            break;
         }
+        ctap_cid_heap_set(pos, cid_heap[child]);
+        pos = child;
     }
-    return NULL;
+    ctap_cid_heap_set(pos, i);
 }
 
-mbed_error_t ctap_cid_periodic_clean(void)
+static void ctap_cid_heap_remove(uint8_t i)
+{
+    uint8_t pos = cid_heap_pos[i];
+    uint8_t last;
+
+    if (pos == CID_NONE) {
+        return;
+    }
+    cid_heap_pos[i] = CID_NONE;
+    last = cid_heap[--cid_heap_num];
+    if (last != i) {
+        /* the last entry takes the removed one place */
+        ctap_cid_heap_set(pos, last);
+        ctap_cid_heap_down(pos);
+        ctap_cid_heap_up(cid_heap_pos[last]);
+    }
+}
+
+/* (re)compute the channel deadline from its state and last use */
+static void ctap_cid_schedule(uint8_t i)
+{
+    uint32_t timeout;
+
+    if (!chans[i].busy || chans[i].ctap_cmd_received == CTAP_CMD_EXECUTING) {
+        ctap_cid_heap_remove(i);
+        return;
+    }
+    timeout = (chans[i].ctap_cmd_received == CTAP_CMD_INPROGRESS) ?
+              cid_transaction_timeout : cid_idle_timeout;
+    chans[i].deadline = chans[i].last_used + timeout + 1;
+    if (cid_heap_pos[i] == CID_NONE) {
+        cid_heap_pos[i] = cid_heap_num;
+        cid_heap[cid_heap_num++] = i;
+    }
+    ctap_cid_heap_down(cid_heap_pos[i]);
+    ctap_cid_heap_up(cid_heap_pos[i]);
+}
+
+/* release a slot: unindex it, free its buffer and push it on the free stack */
+static void ctap_cid_release_slot(uint8_t i);
+
+/* give back the reassembly buffer of the channel command, if any */
+static void ctap_cid_release_cmd_data(chan_ctx_t *chan)
+{
+    if (chan->ctap_cmd.data != NULL) {
+        ctap_pool_release(chan->ctap_cmd.data, chan->ctap_cmd_lease);
+        chan->ctap_cmd.data = NULL;
+        chan->ctap_cmd_lease = 0;
+    }
+}
+
+/*
+ * Hand the reassembly buffer of the channel command over to the caller, who
+ * then releases it with ctap_pool_release(). Used when the command is still
+ * read by the backend while the channel is released (cancelled command).
+ */
+uint8_t *ctap_cid_detach_cmd_data(chan_ctx_t *chan, uint16_t *size)
+{
+    uint8_t *data = chan->ctap_cmd.data;
+
+    *size = chan->ctap_cmd_lease;
+    chan->ctap_cmd.data = NULL;
+    chan->ctap_cmd_lease = 0;
+    return data;
+}
+
+/*
+ * Lease the reassembly buffer of the channel command, sized from BCNT
+ * May return:
+ *    - MBED_ERROR_NONE: buffer leased (or not needed for an empty command)
+ *    - MBED_ERROR_NOMEM: no more room in the pool
+ */
+mbed_error_t ctap_cid_lease_cmd_data(chan_ctx_t *chan, uint16_t size)
 {
-    uint64_t ms;
-    uint64_t period;
     mbed_error_t errcode = MBED_ERROR_NONE;
 
-    /* TODO: libstd: implement clock_gettime() abstraction */
-    if (sys_get_systick(&ms, PREC_MILLI) != SYS_E_DONE) {
-        errcode = MBED_ERROR_DENIED;
+    ctap_cid_release_cmd_data(chan);
+    if (size == 0) {
+        goto err;
+    }
+    chan->ctap_cmd.data = ctap_pool_lease(size);
+    if (chan->ctap_cmd.data == NULL) {
+        errcode = MBED_ERROR_NOMEM;
         goto err;
     }
+    chan->ctap_cmd_lease = size;
+err:
+    return errcode;
+}
+
+/* back to the idle state, waiting for a new command */
+static inline void ctap_cid_reset_cmd(uint8_t i)
+{
+    chans[i].ctap_cmd_received = CTAP_CMD_IDLE;
+    chans[i].ctap_cmd_idx = chans[i].ctap_cmd_size = chans[i].ctap_cmd_seq = 0;
+#if CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+    chans[i].ctap_cmd_echo = false;
+    chans[i].ctap_cmd_echoed = 0;
+#endif
+}
+
+static void ctap_cid_release_slot(uint8_t i)
+{
+    ctap_cid_release_cmd_data(&chans[i]);
+    ctap_cid_done_unlink(i);
+    ctap_cid_index_remove(i);
+    chans[i].busy = false;
+    ctap_cid_heap_remove(i);
+    cid_free[cid_free_num++] = i;
+}
+
+chan_ctx_t *ctap_cid_get_chan_ctx(uint32_t cid)
+{
+    uint8_t i = ctap_cid_lookup(cid);
+    if (i == CID_NONE) {
+        return NULL;
+    }
+    return &(chans[i]);
+}
+
+/*
+ * Completed commands are dispatched in the order they have been completed
+ * (FIFO). The queue is a list of chans[] slots linked through cid_done_next[],
+ * a slot leaves the queue when its command is cleared or when it is released.
+ */
+ctap_cmd_t *ctap_cid_get_chan_complete_cmd(void)
+{
+    if (cid_done_head == CID_NONE) {
+        return NULL;
+    }
+    return &(chans[cid_done_head].ctap_cmd);
+}
+
+/*
+ * Handle the passed deadlines: expired idle channels are released, and the
+ * first expired in progress channel is returned, for the caller to answer
+ * the host with a timeout error and to clear its command. *deadline is set
+ * to the nearest deadline left (UINT64_MAX if no channel is open).
+ */
+chan_ctx_t *ctap_cid_get_chan_expired(uint64_t now, uint64_t *deadline)
+{
+    chan_ctx_t *expired = NULL;
+
+    while (cid_heap_num != 0 && chans[cid_heap[0]].deadline <= now) {
+        uint8_t i = cid_heap[0];
+        if (chans[i].ctap_cmd_received == CTAP_CMD_INPROGRESS) {
+            expired = &(chans[i]);
+            break;
+        }
+        log_printf("[CTAPHID] CID 0x%x idle for too long, released\n", chans[i].cid);
+        ctap_cid_release_slot(i);
+    }
+    *deadline = (cid_heap_num != 0) ? chans[cid_heap[0]].deadline : 0xffffffffffffffffULL;
+    return expired;
+}
+
+/* update the timeouts, and the deadlines of the open channels */
+void ctap_cid_set_timeouts(uint32_t transaction_ms, uint32_t idle_ms)
+{
+    cid_transaction_timeout = transaction_ms;
+    cid_idle_timeout = idle_ms;
+    if (!cid_index_ready) {
+        return;
+    }
     for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if (chans[i].busy == true) {
-            period = ms - chans[i].last_used;
-            if (period > CID_LIFETIME) {
-                chans[i].busy = false;
-            }
+        if (chans[i].busy) {
+            ctap_cid_schedule(i);
         }
     }
-err:
+}
+
+ctap_cmd_t *ctap_cid_get_chan_cmd(uint32_t cid)
+{
+    uint8_t i = ctap_cid_lookup(cid);
+    if (i == CID_NONE) {
+        return NULL;
+    }
+    return &(chans[i].ctap_cmd);
+}
+
+/*
+ * Draw a new CID from the TRNG, not used by any active channel. 0 and the
+ * broadcast CID are reserved.
+ */
+static mbed_error_t ctap_cid_draw(uint32_t *cid)
+{
+    mbed_error_t errcode;
+
+    /* we use EwoK TRNG source to get back a random CID 
+     * NOTE: no need for cryptographically secure random here!
+     */
+    do {
+        random_secure = SEC_RANDOM_NONSECURE;
+        errcode = get_random((uint8_t*)cid, sizeof(uint32_t));
+        random_secure = SEC_RANDOM_SECURE;
+        if (errcode != MBED_ERROR_NONE) {
+            break;
+        }
+        /* CID has been randomly seed, yet... check that no active CID
+         * is using the same value */
+    } while (*cid == 0 || *cid == CTAPHID_BROADCAST_CID || ctap_cid_exists(*cid));
+
     return errcode;
 }
 
+#if CONFIG_USR_LIB_CTAP_CID_POOL
+/*
+ * CIDs drawn in advance by the engine while idle (see ctap_cid_pool_refill()),
+ * popped by the broadcast INIT. Pooled CIDs are distinct, and distinct from
+ * the active ones when drawn.
+ */
+static uint32_t cid_pool[CONFIG_USR_LIB_CTAP_CID_POOL];
+static uint8_t  cid_pool_num = 0;
+
+static bool ctap_cid_pool_contains(uint32_t cid)
+{
+    for (uint8_t i = 0; i < cid_pool_num; ++i) {
+        if (cid_pool[i] == cid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ctap_cid_pool_refill(void)
+{
+    uint32_t cid;
+
+    if (cid_pool_num >= CONFIG_USR_LIB_CTAP_CID_POOL) {
+        return false;
+    }
+    do {
+        if (ctap_cid_draw(&cid) != MBED_ERROR_NONE) {
+            /* TRNG not ready, retry on the next idle time */
+            return false;
+        }
+    } while (ctap_cid_pool_contains(cid));
+    cid_pool[cid_pool_num++] = cid;
+    return true;
+}
+#endif
+
 mbed_error_t ctap_cid_generate(uint32_t *cid)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
@@ -93,20 +419,18 @@ mbed_error_t ctap_cid_generate(uint32_t *cid)
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    /* we use EwoK TRNG source to get back a random CID 
-     * NOTE: no need for cryptographically secure random here!
-     */
-rerun:
-    random_secure = SEC_RANDOM_NONSECURE;
-    errcode = get_random((uint8_t*)cid, sizeof(uint32_t));
-    random_secure = SEC_RANDOM_SECURE;
-
-
-    /* CID has been randomly seed, yet... check that no active CID
-     * is using the same value */
-    if (ctap_cid_exists(*cid)) {
-        goto rerun;
+#if CONFIG_USR_LIB_CTAP_CID_POOL
+    while (cid_pool_num > 0) {
+        *cid = cid_pool[--cid_pool_num];
+        /* check again, the active CIDs may have changed since the draw */
+        if (!ctap_cid_exists(*cid)) {
+            goto err;
+        }
     }
+#endif
+    /* pool exhausted (or disabled): draw on the INIT */
+    CTAP_STATS_INC(cid_pool_misses);
+    errcode = ctap_cid_draw(cid);
 
 err:
     return errcode;
@@ -115,44 +439,55 @@ err:
 mbed_error_t ctap_cid_add(uint32_t newcid)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint32_t i = 0;
+    uint8_t i;
 
-    while (chans[i].busy == true) {
-        i++;
-        if(i >= MAX_CIDS){
-            break;
-        }  
+    if (!cid_index_ready) {
+        ctap_cid_index_init();
+    }
+    i = ctap_cid_lookup(newcid);
+    if (i != CID_NONE) {
+        /* already existing CID (e.g. broadcast), only reset it */
+        ctap_cid_release_cmd_data(&chans[i]);
+        ctap_cid_done_unlink(i);
+        goto reset;
     }
     /* No free slot found, now find the oldest CID and replace it */
-    if(i >= MAX_CIDS){
-        i =  0;
+    if (cid_free_num == 0) {
         uint64_t oldest_cid_last_used = 0xffffffffffffffffULL;
-        uint32_t oldest_cid = 0;
-        for(i = 0; i < MAX_CIDS; i++){
-            if(chans[i].last_used < oldest_cid_last_used){
-                oldest_cid_last_used = chans[i].last_used;
-                oldest_cid = i;
+        uint8_t oldest_cid = CID_NONE;
+        for (uint8_t j = 0; j < MAX_CIDS; j++) {
+            if (chans[j].ctap_cmd_received == CTAP_CMD_EXECUTING) {
+                continue;
+            }
+            if (chans[j].last_used < oldest_cid_last_used) {
+                oldest_cid_last_used = chans[j].last_used;
+                oldest_cid = j;
             }
         }
-        i = oldest_cid;
+        if (oldest_cid == CID_NONE) {
+            /* only executing channels */
+            errcode = MBED_ERROR_NOMEM;
+            goto err;
+        }
+        log_printf("[CTAPHID] evicting CID 0x%x\n", chans[oldest_cid].cid);
+        CTAP_STATS_INC(evictions);
+        CTAP_TRACE(CTAP_TRACE_CID_EVICT, chans[oldest_cid].cid, 0, 0);
+        ctap_cid_release_slot(oldest_cid);
     }
+    i = cid_free[--cid_free_num];
     chans[i].busy = true;
     chans[i].cid = newcid;
-    chans[i].ctap_cmd_received = CTAP_CMD_IDLE;
-    chans[i].ctap_cmd_idx = chans[i].ctap_cmd_size = chans[i].ctap_cmd_seq = 0;
+    ctap_cid_index_insert(i);
+reset:
+    ctap_cid_reset_cmd(i);
     ctap_cid_refresh(newcid);
-
+err:
     return errcode;
 }
 
 bool ctap_cid_exists(uint32_t cid)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if ((chans[i].busy == true) && (chans[i].cid == cid)) {
-            return true;
-        }
-    }
-    return false;
+    return (ctap_cid_lookup(cid) != CID_NONE);
 }
 
 mbed_error_t ctap_cid_refresh(uint32_t cid)
@@ -161,14 +496,14 @@ mbed_error_t ctap_cid_refresh(uint32_t cid)
     uint64_t ms;
 
     /* TODO: libstd: implement clock_gettime() abstraction */
-    if (sys_get_systick(&ms, PREC_MILLI) != SYS_E_DONE) {
+    if (ctap_systick_ms(&ms) != SYS_E_DONE) {
         errcode = MBED_ERROR_DENIED;
         goto err;
     }
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if ((chans[i].busy == true) && (chans[i].cid == cid)) {
-            chans[i].last_used = ms;
-        }
+    uint8_t i = ctap_cid_lookup(cid);
+    if (i != CID_NONE) {
+        chans[i].last_used = ms;
+        ctap_cid_schedule(i);
     }
 err:
     return errcode;
@@ -176,21 +511,56 @@ err:
 
 mbed_error_t ctap_cid_remove(uint32_t cid)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if ((chans[i].busy == true) && (chans[i].cid == cid) && (chans[i].ctap_cmd_received == CTAP_CMD_IDLE)) {
-            chans[i].busy = false;
-        }
+    uint8_t i = ctap_cid_lookup(cid);
+    if ((i != CID_NONE) && (chans[i].ctap_cmd_received == CTAP_CMD_IDLE)) {
+        ctap_cid_release_slot(i);
     }
     return MBED_ERROR_NONE;
 }
 
 mbed_error_t ctap_cid_clear_cmd(uint32_t cid)
 {
-    for (uint8_t i = 0; i < MAX_CIDS; ++i) {
-        if ((chans[i].busy == true) && (chans[i].cid == cid)) {
-            chans[i].ctap_cmd_received = CTAP_CMD_IDLE;
-            chans[i].ctap_cmd_idx = chans[i].ctap_cmd_size = chans[i].ctap_cmd_seq = 0;
-        }
+    uint8_t i = ctap_cid_lookup(cid);
+    if (i != CID_NONE) {
+        ctap_cid_release_cmd_data(&chans[i]);
+        ctap_cid_done_unlink(i);
+        ctap_cid_reset_cmd(i);
+        ctap_cid_schedule(i);
     }
     return MBED_ERROR_NONE;
 }
+
+/*
+ * The channel command has been fully reassembled: tag it as complete and
+ * queue it for dispatch.
+ */
+void ctap_cid_complete_cmd(chan_ctx_t *chan)
+{
+    uint8_t i = (uint8_t)(chan - chans);
+
+    chan->ctap_cmd_received = CTAP_CMD_COMPLETE;
+    ctap_cid_schedule(i);
+    if (cid_done_queued[i]) {
+        return;
+    }
+    cid_done_next[i] = CID_NONE;
+    if (cid_done_tail == CID_NONE) {
+        cid_done_head = i;
+    } else {
+        cid_done_next[cid_done_tail] = i;
+    }
+    cid_done_tail = i;
+    cid_done_queued[i] = true;
+}
+
+/*
+ * The channel command has been submitted to the asynchronous backend: it
+ * leaves the dispatch queue, its buffer being kept until the completion.
+ */
+void ctap_cid_execute_cmd(chan_ctx_t *chan)
+{
+    ctap_cid_done_unlink((uint8_t)(chan - chans));
+    chan->ctap_cmd_received = CTAP_CMD_EXECUTING;
+    /* no timeout while executed by the backend */
+    ctap_cid_schedule((uint8_t)(chan - chans));
+}
@@ -6,37 +6,68 @@
 #include "ctap_control.h"
 
 #define MAX_CIDS CONFIG_USR_LIB_CTAP_MAX_CONCURRENT_CIDS
-#define CID_LIFETIME 40000 /* 10 seconds */
+
+/* CID index hash table: 128 buckets, i.e. at most 0.5 load factor */
+#define CID_HASH_BITS 7
+#define CID_BUCKETS   (1 << CID_HASH_BITS)
+/* default timeouts (ms), see ctap_set_timeouts() */
+#define CID_LIFETIME 40000 /* 40 seconds */
+/* 600 ms as a good compromise for transactions timeouts */
+#define CTAP_HID_TRANSACTION_TIMEOUT 600
 
 typedef enum {
     CTAP_CMD_IDLE       = 0,
     CTAP_CMD_INPROGRESS = 1,
     CTAP_CMD_COMPLETE   = 2,
+    CTAP_CMD_EXECUTING  = 3, /* submitted to the asynchronous backend */
 } ctap_cmd_state;
 
 typedef struct {
     uint64_t last_used;
+    uint64_t deadline; /* idle or transaction timeout, from last_used */
     uint32_t cid;
     bool      busy;
     ctap_cmd_state   ctap_cmd_received;
     uint16_t  ctap_cmd_size;
     uint16_t  ctap_cmd_idx;
     uint16_t  ctap_cmd_seq;
+    uint16_t  ctap_cmd_lease; /* size of the buffer leased for ctap_cmd.data */
+#if CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+    bool      ctap_cmd_echo;   /* PING frames echoed as they are received */
+    uint16_t  ctap_cmd_echoed; /* PING bytes echoed before being reassembled */
+#endif
     ctap_cmd_t         ctap_cmd;
 } chan_ctx_t;
 
 chan_ctx_t *ctap_cid_get_chan_ctx(uint32_t cid);
 
-bool ctap_cid_chan_sanity_check(void);
-
 ctap_cmd_t *ctap_cid_get_chan_complete_cmd(void);
 
-ctap_cmd_t *ctap_cid_get_chan_inprogress_cmd(void);
+void ctap_cid_complete_cmd(chan_ctx_t *chan);
+
+void ctap_cid_execute_cmd(chan_ctx_t *chan);
+
+chan_ctx_t *ctap_cid_get_chan_expired(uint64_t now, uint64_t *deadline);
+
+void ctap_cid_set_timeouts(uint32_t transaction_ms, uint32_t idle_ms);
 
 ctap_cmd_t *ctap_cid_get_chan_cmd(uint32_t cid);
 
 mbed_error_t ctap_cid_generate(uint32_t *cid);
 
+#if CONFIG_USR_LIB_CTAP_CID_POOL
+/*
+ * Draw one CID in advance into the pool, executed by the engine while idle.
+ * Return false if the pool is full (or the TRNG failed).
+ */
+bool ctap_cid_pool_refill(void);
+#else
+static inline bool ctap_cid_pool_refill(void)
+{
+    return false;
+}
+#endif
+
 mbed_error_t ctap_cid_add(uint32_t newcid);
 
 bool ctap_cid_exists(uint32_t cid);
@@ -45,10 +76,12 @@ mbed_error_t ctap_cid_refresh(uint32_t cid);
 
 mbed_error_t ctap_cid_remove(uint32_t cid);
 
-mbed_error_t ctap_cid_periodic_clean(void);
-
 mbed_error_t ctap_cid_clear_cmd(uint32_t cid);
 
+mbed_error_t ctap_cid_lease_cmd_data(chan_ctx_t *chan, uint16_t size);
+
+uint8_t *ctap_cid_detach_cmd_data(chan_ctx_t *chan, uint16_t *size);
+
 void ctap_cid_dump(void);
 
 #endif/*!CTAP_CHANNEL_H_*/
@@ -26,14 +26,16 @@
 #include "libc/string.h"
 #include "libc/sync.h"
 #include "libc/time.h"
-#include "libc/signal.h"
-#include "libc/errno.h"
 #include "libusbhid.h"
 #include "api/libctap.h"
 #include "ctap_protocol.h"
 #include "ctap_control.h"
 #include "ctap_hid.h"
 #include "ctap_chan.h"
+#include "ctap_tx.h"
+#include "ctap_stats.h"
+#include "ctap_trace.h"
+#include "ctap_capture.h"
 
 
 #define CTAP_POLL_TIME      5 /* FIDO HID interface definition: Poll-time=5ms */
@@ -43,17 +45,32 @@
 /* fido contexts .data initialization */
 static ctap_context_t ctap_ctx = {
     .ctap_report = NULL,
-    .ctap_report_received = false,
-    .ctap_report_size = false,
-    .idle = false,
     .curr_cid = 0,
     .locked = false,
+    .lock_cid = 0,
+    .lock_deadline = 0,
     .idle_ms = 0,
     .hid_handler = 0,
     .usbxdci_handler = 0,
     .apdu_cmd = NULL,
+    .submit_cmd = NULL,
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    .cbor_cmd = NULL,
+    .cbor_submit_cmd = NULL,
+#endif
+    .backend_busy = false,
+    .backend_done = false,
+    .cancel_cmd = NULL,
+    .backend_cancelled = false,
+    .backend_orphan = NULL,
+    .backend_resp = NULL,
+    .backend_streaming = false,
+    .backend_stream_queued = false,
     .report_sent = true,
-    .recv_buf = { 0 },
+    .rx_ring = { { { 0 }, 0 } },
+    .rx_head = 0,
+    .rx_tail = 0,
+    .rx_armed = false,
 };
 
 
@@ -63,70 +80,263 @@ ctap_context_t *ctap_get_context(void)
     return &ctap_ctx;
 }
 
-/* 600 ms as a good compromise for transactions timeouts */
-#define CTAP_HID_TRANSACTION_TIMEOUT	600
+/*
+ * Arm the OUT EP on the next free slot of the RX ring, if any. When the ring
+ * is full, the EP is left NAK and is rearmed by the engine as soon as it
+ * releases a slot.
+ * This function is called both from the trigger (ISR) and from the engine
+ * but never concurrently: the engine only rearms when the EP is not armed,
+ * in which case no reception (and thus no trigger) can happen. As the engine
+ * publishes rx_tail before checking rx_armed, a trigger finding the ring
+ * full always lets the engine see the EP unarmed.
+ */
+void ctaphid_rx_arm(ctap_context_t *ctx)
+{
+    if(ctaphid_rx_pending(ctx) >= CTAP_RX_SLOTS){
+        CTAP_STATS_INC(rx_stalls);
+        CTAP_TRACE(CTAP_TRACE_RX_STALL, 0, 0, 0);
+        set_bool_with_membarrier(&(ctx->rx_armed), false);
+        return;
+    }
+    set_bool_with_membarrier(&(ctx->rx_armed), true);
+    usbhid_recv_report(ctx->hid_handler, ctx->rx_ring[ctx->rx_head % CTAP_RX_SLOTS].frame, CTAPHID_FRAME_MAXLEN);
+}
+
+/*
+ * Producer side, from usbhid_report_received_trigger(): the frame has been
+ * received in the slot rx_head. Its descriptor is completed before rx_head
+ * is published (barrier), then the OUT EP is rearmed on the next slot.
+ */
+void ctaphid_rx_push(ctap_context_t *ctx, uint16_t size)
+{
+    ctap_rx_desc_t *desc = &(ctx->rx_ring[ctx->rx_head % CTAP_RX_SLOTS]);
+
+    if(size > CTAPHID_FRAME_MAXLEN){
+        size = CTAPHID_FRAME_MAXLEN;
+    }
+    /* no stale byte of a previous frame behind a short one */
+    if(size < CTAPHID_FRAME_MAXLEN){
+        memset(&(desc->frame[size]), 0, CTAPHID_FRAME_MAXLEN - size);
+    }
+    desc->size = size;
+    CTAP_TRACE(CTAP_TRACE_RX_FRAME, ((ctap_init_header_t*)desc->frame)->cid, desc->frame[4], size);
+    CTAP_CAPTURE(CTAP_CAPTURE_OUT, desc->frame, size);
+    set_u32_with_membarrier(&(ctx->rx_head), ctaphid_rx_next(ctx->rx_head));
+    ctaphid_rx_arm(ctx);
+}
+
+/* Consumer side: the oldest received frame, NULL if the ring is empty */
+static ctap_rx_desc_t *ctaphid_rx_peek(ctap_context_t *ctx)
+{
+    if(ctaphid_rx_pending(ctx) == 0){
+        return NULL;
+    }
+    /* the descriptor is read after rx_head (pairs with the producer barrier) */
+    request_data_membarrier();
+    return &(ctx->rx_ring[ctx->rx_tail % CTAP_RX_SLOTS]);
+}
+
+/* Release the oldest RX slot, and rearm the OUT EP if it was NAK because of
+ * a full ring */
+static void ctaphid_rx_release(ctap_context_t *ctx)
+{
+    set_u32_with_membarrier(&(ctx->rx_tail), ctaphid_rx_next(ctx->rx_tail));
+    if(!ctx->rx_armed){
+        ctaphid_rx_arm(ctx);
+    }
+}
+
+/*
+ * CTAPHID_LOCK: is the channel cid rejected because another channel holds
+ * the lock? The lock is released once its deadline is passed.
+ */
+bool ctap_lock_rejects(ctap_context_t *ctx, uint32_t cid, uint64_t now)
+{
+    if(!ctx->locked){
+        return false;
+    }
+    if(now >= ctx->lock_deadline){
+        log_printf("[CTAPHID] lock of CID 0x%x expired\n", ctx->lock_cid);
+        ctx->locked = false;
+        return false;
+    }
+    return (cid != ctx->lock_cid);
+}
+
+#if CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+/*
+ * Cut-through PING: each frame of the request is echoed as soon as received,
+ * the response frames being byte-identical to the request ones (same CID,
+ * CMD, BCNT and SEQ), instead of reassembling the whole payload first.
+ * Frames are never waited for room in the TX queue in the receive path: a
+ * PING whose first frame finds the queue full is reassembled as usual, and
+ * a PING already echoed in part is reassembled from the first frame finding
+ * the queue full on, the rest of the response being sent once complete
+ * (see handle_rq_ping()).
+ */
+static inline bool ctaphid_cut_through(const chan_ctx_t *chan)
+{
+    return chan->ctap_cmd_echo;
+}
+
+/* the cut-through is decided on the initialization frame */
+static inline void ctaphid_cut_through_start(chan_ctx_t *chan)
+{
+    chan->ctap_cmd_echo = (chan->ctap_cmd.cmd == (CTAP_PING | 0x80)) && ctap_tx_has_room();
+    chan->ctap_cmd_echoed = 0;
+}
+
+/* echo the frame, the caller having checked that the TX queue has room */
+static ctap_error_code_t ctaphid_echo_frame(chan_ctx_t *chan, const ctap_rx_desc_t *desc, uint8_t hdr_len, uint16_t max_len)
+{
+    uint16_t chunk = chan->ctap_cmd_size - chan->ctap_cmd_idx;
+
+    if(chunk > max_len){
+        chunk = max_len;
+    }
+    if(ctap_tx_enqueue_frame(desc->frame, hdr_len + chunk) != MBED_ERROR_NONE){
+        ctap_cid_clear_cmd(chan->cid);
+        return U2F_ERR_OTHER;
+    }
+    chan->ctap_cmd_idx += chunk;
+    if(chan->ctap_cmd_idx >= chan->ctap_cmd_size){
+        /* fully echoed, nothing to dispatch */
+        ctap_cid_clear_cmd(chan->cid);
+    }
+    return U2F_ERR_NONE;
+}
+
+/*
+ * No room to echo a continuation frame: the rest of the PING is reassembled,
+ * in a buffer sized for the whole payload (the frames keeping their offset).
+ */
+static ctap_error_code_t ctaphid_echo_fallback(chan_ctx_t *chan)
+{
+    if(ctap_cid_lease_cmd_data(chan, chan->ctap_cmd_size) != MBED_ERROR_NONE){
+        log_printf("[CTAPHID] no reassembly buffer available for %d bytes\n", chan->ctap_cmd_size);
+        ctap_cid_clear_cmd(chan->cid);
+        CTAP_STATS_INC(busy[CTAP_STATS_BUSY_POOL]);
+        return U2F_ERR_CHANNEL_BUSY;
+    }
+    chan->ctap_cmd_echo = false;
+    chan->ctap_cmd_echoed = chan->ctap_cmd_idx;
+    return U2F_ERR_NONE;
+}
+#endif
+
+/* ctaphid_receive_pkt() returns after this time (ms) without any event */
+#define CTAP_HID_RECEIVE_WINDOW	600
+
+/*
+ * A received frame is only handled when its answer, if any, has room in the
+ * TX queue: otherwise it is left in the RX ring until the IN EP drains the
+ * queue (usbhid_report_sent_trigger() awakes the engine).
+ */
+static inline bool ctaphid_rx_ready(const ctap_context_t *ctx)
+{
+    return (ctaphid_rx_pending(ctx) != 0) && ctap_tx_has_room();
+}
+
+/*
+ * Besides the received frames, the engine has to send the asynchronous
+ * backend response (or keepalive), or to dispatch a complete request whose
+ * response TX resources have been released.
+ */
+static inline bool ctaphid_engine_event(const ctap_context_t *ctx)
+{
+    return (ctap_backend_event(ctx) && ctap_tx_has_room()) || ctap_dispatch_ready();
+}
 ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
 {
     ctap_error_code_t error;
+    ctap_rx_desc_t *desc = NULL;
 
-    /* listen on data if necessary */
-    if(ctx->idle){
-        ctx->idle = false;
-        usbhid_recv_report(ctap_ctx.hid_handler, (uint8_t*)&ctap_ctx.recv_buf, CTAPHID_FRAME_MAXLEN);
-    }
-    /* Get the current "in progress" cid */
-    ctap_cmd_t *curr_inprogress = ctap_cid_get_chan_inprogress_cmd();
-    chan_ctx_t *curr_inprogress_chan = NULL;
-    if(curr_inprogress != NULL){
-        curr_inprogress_chan = ctap_cid_get_chan_ctx(curr_inprogress->cid);
-        if(curr_inprogress_chan == NULL){
-            /* This should not happen */
-            error = U2F_ERR_OTHER;
-            goto err;
-        }
-    }
     /* Wait with timeout our USB transfer */
-    uint64_t start, current;
-    if (sys_get_systick(&start, PREC_MILLI) != SYS_E_DONE){
+    uint64_t start, current, deadline;
+    if (ctap_systick_ms(&start) != SYS_E_DONE){
         error = U2F_ERR_OTHER;
         goto err;
     }
-    while(!ctx->ctap_report_received){
-        if (sys_get_systick(&current, PREC_MILLI) != SYS_E_DONE){
-            error = U2F_ERR_OTHER;
+    current = start;
+    while(1){
+        /* Check for the channels deadlines: idle channels are released, in
+         * progress transactions time out */
+        chan_ctx_t *expired = ctap_cid_get_chan_expired(current, &deadline);
+        if(expired != NULL && !ctap_tx_has_room()){
+            /* answered once the IN EP has drained the TX queue */
+            deadline = 0xffffffffffffffffULL;
+        } else if(expired != NULL){
+            /* Clear our timed out CID */
+            log_printf("[CTAPHID] CID 0x%x timed out!\n", expired->cid);
+            ctx->curr_cid = expired->cid;
+            ctap_cid_clear_cmd(expired->cid);
+            /* Set a TIMEOUT error */
+            error = U2F_ERR_MSG_TIMEOUT;
             goto err;
         }
-        /* Check for pending transaction timeout */
-        if((curr_inprogress != NULL) && (curr_inprogress_chan != NULL)){
-            if((current - curr_inprogress_chan->last_used) > CTAP_HID_TRANSACTION_TIMEOUT){
-                /* Clear our timed out CID */
-                log_printf("[CTAPHID] CID 0x%x timed out!\n", curr_inprogress->cid);
-                ctap_cid_clear_cmd(curr_inprogress->cid);
-                /* Set a TIMEOUT error */
-                ctx->curr_cid = curr_inprogress->cid;
-                error = U2F_ERR_MSG_TIMEOUT;
-                goto err;
-            }
+        /* Keep the host waiting for the asynchronous backend informed */
+        uint64_t keepalive = ctap_backend_keepalive(current);
+        if(keepalive < deadline){
+            deadline = keepalive;
+        }
+        if(ctaphid_rx_ready(ctx)){
+            break;
         }
-        if((current - start) > CTAP_HID_TRANSACTION_TIMEOUT){                                
+        if(ctaphid_engine_event(ctx)){
+            /* the backend response is to be sent back, or a request to be
+             * dispatched */
+            error = U2F_ERR_NONE;
+            goto err;
+        }
+        if((current - start) > CTAP_HID_RECEIVE_WINDOW){
             /* Nothing received with timeout */
             error = U2F_ERR_NONE;
             goto err;
         }
+        /* Nothing to handle: draw the next CIDs now, one TRNG request at a
+         * time, so that a received frame waits for one request at most */
+        while((ctaphid_rx_pending(ctx) == 0) && ctap_cid_pool_refill()){
+            continue;
+        }
+#if CONFIG_USR_LIB_CTAP_EVENT_WAIT
+        /* Instead of polling the systick, sleep up to the nearest deadline (receive
+         * timeout or channels deadlines). The USB ISR executing
+         * usbhid_report_received_trigger() awakes us before if a report arrives,
+         * usbhid_report_sent_trigger() if a TX buffer is released.
+         */
+        if((start + CTAP_HID_RECEIVE_WINDOW + 1) < deadline){
+            deadline = start + CTAP_HID_RECEIVE_WINDOW + 1;
+        }
+        /* last chance check, the triggers (or the backend completion) may
+         * have been executed since the loop test */
+        if(!ctaphid_rx_ready(ctx) && !ctaphid_engine_event(ctx) && (deadline > current)){
+            CTAP_TRACE_SLEEP();
+            sys_sleep((uint32_t)(deadline - current), SLEEP_MODE_INTERRUPTIBLE);
+        }
+#endif
+        if (ctap_systick_ms(&current) != SYS_E_DONE){
+            error = U2F_ERR_OTHER;
+            goto err;
+        }
     }
 
-    ctx->idle = true;
-    ctx->ctap_report_received = false;  
-    ctx->ctap_report_size = 0;
-
-    /* Sanity check on the current state of our channels */
-    if(!ctap_cid_chan_sanity_check()){
-        error = U2F_ERR_OTHER;
+    /* Get the oldest received frame, its slot is released once handled */
+    desc = ctaphid_rx_peek(ctx);
+    if(desc == NULL){
+        error = U2F_ERR_NONE;
         goto err;
     }
 
+    CTAP_STATS_INC(frames_rx);
     /* We have a frame, get the CID */
-    ctap_init_cmd_t *init_cmd = (ctap_init_cmd_t*)&ctx->recv_buf[0];
+    ctap_init_cmd_t *init_cmd = (ctap_init_cmd_t*)desc->frame;
+    if(desc->size < sizeof(ctap_seq_header_t) ||
+       ((init_cmd->header.cmd & 0x80) && (desc->size < sizeof(ctap_init_header_t)))){
+        /* Truncated header: ignore the frame */
+        log_printf("[CTAPHID] u2f_hid_receive_frame: short frame (%d bytes) ignored\n", desc->size);
+        error = U2F_ERR_NONE;
+        goto err;
+    }
     ctx->curr_cid = init_cmd->header.cid;
     /* CID = 0 is reserved, using it is an error */
     if(ctx->curr_cid == 0){
@@ -134,23 +344,51 @@ ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
         error = U2F_ERR_INVALID_CHANNEL;
         goto err; 
     }
+    /* Another channel holds the lock: reject the frame on its header, before
+     * taking a channel slot or copying any payload */
+    if(ctap_lock_rejects(ctx, ctx->curr_cid, current)){
+        if(init_cmd->header.cmd & 0x80){
+            log_printf("[CTAPHID] CID 0x%x rejected, CID 0x%x holds the lock\n", ctx->curr_cid, ctx->lock_cid);
+            CTAP_STATS_INC(busy[CTAP_STATS_BUSY_LOCK]);
+            error = U2F_ERR_CHANNEL_BUSY;
+        } else {
+            /* continuation of a transaction started before the lock: it
+             * times out */
+            error = U2F_ERR_NONE;
+        }
+        goto err;
+    }
     /* Check if we are already treating this CID */
     if(!ctap_cid_exists(ctx->curr_cid) && (ctx->curr_cid != CTAPHID_BROADCAST_CID)){
         /* We are not treating the CID, and this is not a CTAPHID_BROADCAST_CID */
         log_printf("[CTAPHID] u2f_hid_receive_frame: error in CID %x: neither existing nor CTAPHID_BROADCAST_CID\n", ctx->curr_cid);
-        error = U2F_ERR_CHANNEL_BUSY;
+        /* the channel has never been allocated, or has been evicted: the
+         * host has to open a new one (a busy answer would be retried forever) */
+        error = U2F_ERR_INVALID_CHANNEL;
         goto err; 
     }
-    /* In case of broadcast, we prepare a special broadcast frame */
-    if(ctx->curr_cid == CTAPHID_BROADCAST_CID){
-        /* Only INIT accepts broadcast frames */
-        if(!(init_cmd->header.cmd & 0x80) || ((init_cmd->header.cmd & 0x7f) != CTAP_INIT)){
-            error = U2F_ERR_INVALID_CHANNEL;
+    if(init_cmd->header.cmd & 0x80){
+        /* Check the request against its command descriptor (length, channel)
+         * on its initialization frame, so that an invalid request fails
+         * before any slot or buffer is taken and its payload is received */
+        error = ctap_cmd_check(ctx->curr_cid, init_cmd->header.cmd,
+                               (init_cmd->header.bcnth << 8) | init_cmd->header.bcntl);
+        if(error != U2F_ERR_NONE){
             goto err;
         }
+        ctap_stats_cmd(init_cmd->header.cmd);
+    } else if(ctx->curr_cid == CTAPHID_BROADCAST_CID){
+        /* Continuation of a broadcast request rejected on its first frame:
+         * ignore it, the host has already been answered */
+        error = U2F_ERR_NONE;
+        goto err;
+    }
+    /* In case of broadcast, we prepare a special broadcast frame */
+    if(ctx->curr_cid == CTAPHID_BROADCAST_CID){
         /* No more slots available ... return an error */
         if(ctap_cid_add(CTAPHID_BROADCAST_CID) != MBED_ERROR_NONE){
             /* The lower layer will respond a "BUSY" channel */
+            CTAP_STATS_INC(busy[CTAP_STATS_BUSY_CID]);
             error = U2F_ERR_CHANNEL_BUSY;
             goto err;
         }
@@ -163,21 +401,30 @@ ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
         error = U2F_ERR_OTHER;
         goto err;
     }
-    /* We should not treat "complete" commands here */
-    if(chan_ctx->ctap_cmd_received == CTAP_CMD_COMPLETE){
-        error = U2F_ERR_OTHER;
+    /* CANCEL is handled as soon as received, whatever the channel state, so
+     * that the backend can be aborted */
+    if(init_cmd->header.cmd == (CTAP_CANCEL | 0x80)){
+        log_printf("[CTAPHID] received CANCEL on CID 0x%x\n", ctx->curr_cid);
+        CTAP_TRACE(CTAP_TRACE_CANCEL, ctx->curr_cid, 0, 0);
+        handle_rq_cancel(ctx->curr_cid);
+        error = U2F_ERR_NONE;
         goto err;
     }
-    if(curr_inprogress != NULL){
-        /* If the CIDs mismatch: this is an error! Only one CID can be "in progress" */
-        if(curr_inprogress->cid != ctx->curr_cid){
-            error = U2F_ERR_CHANNEL_BUSY;
-            goto err;
-        }
+    /* A complete command is waiting for its dispatch, or is being executed
+     * by the backend, on this channel */
+    if((chan_ctx->ctap_cmd_received == CTAP_CMD_COMPLETE) || (chan_ctx->ctap_cmd_received == CTAP_CMD_EXECUTING)){
+        CTAP_STATS_INC(busy[CTAP_STATS_BUSY_CHANNEL]);
+        error = U2F_ERR_CHANNEL_BUSY;
+        goto err;
+    }
+    /* Each channel has its own reassembly state: frames of different CIDs
+     * may be interleaved.
+     */
+    if(chan_ctx->ctap_cmd_received == CTAP_CMD_INPROGRESS){
         /* Do we have a resync frame on an active CID? (through a real SYNC or INIT on CID) */
         if((init_cmd->header.cmd & 0x80) && (((init_cmd->header.cmd & 0x7f) == CTAP_INIT) || ((init_cmd->header.cmd & 0x7f) == CTAP_SYNC))){
             /* Resynchronize by reinitializing the state of or current CID */
-            log_printf("[CTAPHID] received SYNC during transaction in progress (cmd 0x%x)\n", init_cmd->header.cmd);
+            log_printf("[CTAPHID] received SYNC during transaction in progress (cmd 0x%x)\n", init_cmd->header.cmd);
             /* Clear our current channel buffers */
             ctap_cid_clear_cmd(ctx->curr_cid);
             /* Now continue to treat the command as is! */
@@ -185,20 +432,26 @@ ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
         else{
             /* Check for timeout for the asked CID currently in progress */
             uint64_t current_time;
-            if (sys_get_systick(&current_time, PREC_MILLI) != SYS_E_DONE) {
+            if (ctap_systick_ms(&current_time) != SYS_E_DONE) {
                 error = U2F_ERR_OTHER;
                 goto err;
             }
-            if((current_time - chan_ctx->last_used) > CTAP_HID_TRANSACTION_TIMEOUT){
+            if(current_time >= chan_ctx->deadline){
                 /* Clear our timed out CID */
-                log_printf("[CTAPHID] CID 0x%x timed out!\n", curr_inprogress->cid);
-                ctap_cid_clear_cmd(curr_inprogress->cid);
+                log_printf("[CTAPHID] CID 0x%x timed out!\n", ctx->curr_cid);
+                ctap_cid_clear_cmd(ctx->curr_cid);
                 /* Set a TIMEOUT error */
                 error = U2F_ERR_MSG_TIMEOUT;
                 goto err;
             }
         }
     }
+    else if(!(init_cmd->header.cmd & 0x80)){
+        /* Spurious continuation frame on an idle channel: ignore it */
+        log_printf("[CTAPHID] u2f_hid_receive_frame: unexpected SEQ frame on idle CID %x\n", ctx->curr_cid);
+        error = U2F_ERR_NONE;
+        goto err;
+    }
     /* Tag the CID as "in progress" for now (either it was in progress or it becomes in progress) */ 
     chan_ctx->ctap_cmd_received = CTAP_CMD_INPROGRESS;
     /* Refresh the CID timings */
@@ -226,24 +479,42 @@ ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
         chan_ctx->ctap_cmd.cmd = init_cmd->header.cmd;
         chan_ctx->ctap_cmd.bcnth = init_cmd->header.bcnth;
         chan_ctx->ctap_cmd.bcntl = init_cmd->header.bcntl;
+#if CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+        ctaphid_cut_through_start(chan_ctx);
+        if(ctaphid_cut_through(chan_ctx)){
+            /* no reassembly buffer needed */
+            error = ctaphid_echo_frame(chan_ctx, desc, sizeof(ctap_init_header_t), CTAPHID_INIT_DATA_LEN);
+            goto err;
+        }
+#endif
+        /* Lease the reassembly buffer, sized from BCNT */
+        if(ctap_cid_lease_cmd_data(chan_ctx, blen) != MBED_ERROR_NONE){
+            log_printf("[CTAPHID] no reassembly buffer available for %d bytes\n", blen);
+            ctap_cid_clear_cmd(ctx->curr_cid);
+            CTAP_STATS_INC(busy[CTAP_STATS_BUSY_POOL]);
+            error = U2F_ERR_CHANNEL_BUSY;
+            goto err;
+        }
         uint16_t pkt_data_sz = CTAPHID_FRAME_MAXLEN - sizeof(ctap_init_header_t);
         if(blen <= pkt_data_sz){
             pkt_data_sz = blen;
             /* We do not expect more data: tell that we are done! */
-            chan_ctx->ctap_cmd_received = CTAP_CMD_COMPLETE;
+            ctap_cid_complete_cmd(chan_ctx);
         }
         /* Sanity check */ 
-        if(sizeof(chan_ctx->ctap_cmd.data) < pkt_data_sz){
+        if(chan_ctx->ctap_cmd_lease < pkt_data_sz){
             error = U2F_ERR_INVALID_LEN;
             goto err;
         }
         /* Copy the current data and increment our index */
-        memcpy(&(chan_ctx->ctap_cmd.data[0]), &(init_cmd->data[0]), pkt_data_sz);
+        if(pkt_data_sz != 0){
+            memcpy(&(chan_ctx->ctap_cmd.data[0]), &(init_cmd->data[0]), pkt_data_sz);
+        }
         chan_ctx->ctap_cmd_idx += pkt_data_sz;
     }
     else{
         /* We are agregating here, we only expect SEQ packets! */
-        ctap_seq_cmd_t *seq_cmd = (ctap_seq_cmd_t*)&ctx->recv_buf[0];
+        ctap_seq_cmd_t *seq_cmd = (ctap_seq_cmd_t*)desc->frame;
         /* Sanity check on sequence */
         if((seq_cmd->header.seq != chan_ctx->ctap_cmd_seq) || (seq_cmd->header.seq > 0x7f)){
             log_printf("[CTAPHID] u2f_hid_receive_frame: error in SEQ %d != %d or > 0x7f ...\n", seq_cmd->header.seq, chan_ctx->ctap_cmd_seq);
@@ -255,13 +526,26 @@ ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
             error = U2F_ERR_INVALID_LEN;
             goto err;
         } 
+#if CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+        if(ctaphid_cut_through(chan_ctx)){
+            if(ctap_tx_has_room()){
+                chan_ctx->ctap_cmd_seq++;
+                error = ctaphid_echo_frame(chan_ctx, desc, sizeof(ctap_seq_header_t), CTAPHID_SEQ_DATA_LEN);
+                goto err;
+            }
+            error = ctaphid_echo_fallback(chan_ctx);
+            if(error != U2F_ERR_NONE){
+                goto err;
+            }
+        }
+#endif
         /* Aggregate the data */
         uint16_t pkt_data_sz = CTAPHID_FRAME_MAXLEN - sizeof(ctap_seq_header_t);
         if(pkt_data_sz > (chan_ctx->ctap_cmd_size - chan_ctx->ctap_cmd_idx)){
             pkt_data_sz = (chan_ctx->ctap_cmd_size - chan_ctx->ctap_cmd_idx);
         }
         /* Sanity checks */
-        if(sizeof(chan_ctx->ctap_cmd.data) < (chan_ctx->ctap_cmd_idx + pkt_data_sz)){
+        if(chan_ctx->ctap_cmd_lease < (chan_ctx->ctap_cmd_idx + pkt_data_sz)){
             error = U2F_ERR_INVALID_LEN;
             goto err;
         }
@@ -273,12 +557,15 @@ ctap_error_code_t ctaphid_receive_pkt(ctap_context_t *ctx)
         chan_ctx->ctap_cmd_idx += pkt_data_sz;
         /* Are we done? */
         if(chan_ctx->ctap_cmd_idx >= chan_ctx->ctap_cmd_size){
-            chan_ctx->ctap_cmd_received = CTAP_CMD_COMPLETE;
+            ctap_cid_complete_cmd(chan_ctx);
         }
     }
     /* pull down received flag */
     error = U2F_ERR_NONE;
 err:
+    if(desc != NULL){
+        ctaphid_rx_release(ctx);
+    }
     return error;
 
 }
@@ -289,23 +576,17 @@ err:
  * FIDO API
  */
 
-mbed_error_t ctap_declare(uint8_t usbxdci_handler, ctap_handle_apdu_t apdu_handler, ctap_handle_wink_t wink_handler)
+static mbed_error_t ctap_declare_hid(uint8_t usbxdci_handler, ctap_handle_wink_t wink_handler)
 {
     mbed_error_t errcode = MBED_ERROR_UNKNOWN;
     /* first initializing basics of local context */
     ctap_ctx.usbxdci_handler = usbxdci_handler;
     ctap_ctx.ctap_report = ctap_get_report();
-    if (apdu_handler == NULL) {
-        errcode = MBED_ERROR_INVPARAM;
-        log_printf("%s: APDU handler is NULL\n", __func__);
-        goto err;
-    }
     if (wink_handler == NULL) {
         errcode = MBED_ERROR_INVPARAM;
         log_printf("%s: Wink handler is NULL\n", __func__);
         goto err;
     }
-    ctap_ctx.apdu_cmd = apdu_handler;
     ctap_ctx.wink_cmd = wink_handler;
 
     log_printf("[CTAPHID] declare usbhid interface for FIDO CTAP\n");
@@ -313,7 +594,7 @@ mbed_error_t ctap_declare(uint8_t usbxdci_handler, ctap_handle_apdu_t apdu_handl
                              USBHID_SUBCLASS_NONE, USBHID_PROTOCOL_NONE,
                              CTAP_DESCRIPOR_NUM, CTAP_POLL_TIME, true,
                              64, &(ctap_ctx.hid_handler),
-                                 (uint8_t*)&ctap_ctx.recv_buf,
+                                 ctap_ctx.rx_ring[0].frame,
                                  CTAPHID_FRAME_MAXLEN);
     if (errcode != MBED_ERROR_NONE) {
         log_printf("[CTAPHID] failure while declaring FIDO interface: err=%d\n", errcode);
@@ -337,56 +618,197 @@ err:
     return errcode;
 }
 
-/**************
- * About timer: an alarm is executed every second to clear used CID older than 1s
- */
+mbed_error_t ctap_declare(uint8_t usbxdci_handler, ctap_handle_apdu_t apdu_handler, ctap_handle_wink_t wink_handler)
+{
+    mbed_error_t errcode = MBED_ERROR_UNKNOWN;
+    if (apdu_handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        log_printf("%s: APDU handler is NULL\n", __func__);
+        goto err;
+    }
+    ctap_ctx.apdu_cmd = apdu_handler;
+    ctap_ctx.submit_cmd = NULL;
+    errcode = ctap_declare_hid(usbxdci_handler, wink_handler);
+err:
+    return errcode;
+}
 
-void ctap_timer_notify(__sigval_t sig __attribute__((unused))) {
-    ctap_cid_periodic_clean();
+mbed_error_t ctap_declare_async(uint8_t usbxdci_handler, ctap_submit_apdu_t submit_handler, ctap_handle_wink_t wink_handler)
+{
+    mbed_error_t errcode = MBED_ERROR_UNKNOWN;
+    if (submit_handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        log_printf("%s: APDU submit handler is NULL\n", __func__);
+        goto err;
+    }
+    ctap_ctx.apdu_cmd = NULL;
+    ctap_ctx.submit_cmd = submit_handler;
+    errcode = ctap_declare_hid(usbxdci_handler, wink_handler);
+err:
+    return errcode;
 }
 
-static timer_t timerid;
-static struct sigevent sevp = { 0 };
-static struct itimerspec its = { 0 };
+#if CONFIG_USR_LIB_CTAP_CTAP2
+mbed_error_t ctap_declare_cbor(ctap_handle_cbor_t cbor_handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (cbor_handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        log_printf("%s: CBOR handler is NULL\n", __func__);
+        goto err;
+    }
+    ctap_ctx.cbor_cmd = cbor_handler;
+    ctap_ctx.cbor_submit_cmd = NULL;
+err:
+    return errcode;
+}
 
+mbed_error_t ctap_declare_cbor_async(ctap_submit_cbor_t submit_handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (submit_handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        log_printf("%s: CBOR submit handler is NULL\n", __func__);
+        goto err;
+    }
+    ctap_ctx.cbor_cmd = NULL;
+    ctap_ctx.cbor_submit_cmd = submit_handler;
+err:
+    return errcode;
+}
+#endif
 
-mbed_error_t ctap_configure(void)
+mbed_error_t ctap_declare_vendor(uint8_t cmd, uint16_t min_len, uint16_t max_len, ctap_handle_vendor_t vendor_handler)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    /* in that case, any Set_Report (DATA OUT) is pushed to dedicated OUT EP instead
-     * of EP0. This avoid using control plane for DATA content. Althgouh,
-     * we have to configure this EP in order to be ready to receive the report */
-    usbhid_recv_report(ctap_ctx.hid_handler, ctap_ctx.recv_buf, CTAPHID_FRAME_MAXLEN);
+    if (vendor_handler == NULL || cmd < CTAPHID_VENDOR_FIRST || cmd > CTAPHID_VENDOR_LAST ||
+        min_len > max_len || max_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        errcode = MBED_ERROR_INVPARAM;
+        log_printf("%s: invalid vendor command 0x%x\n", __func__, cmd);
+        goto err;
+    }
+    errcode = ctap_cmd_register_vendor(cmd, min_len, max_len, vendor_handler);
+err:
+    return errcode;
+}
 
-    /* let's start Channel ID auto-cleaner */
-    sevp.sigev_notify_function = ctap_timer_notify;
-    sevp.sigev_value.sival_ptr = &timerid;
-    sevp.sigev_signo = 0;
-    sevp.sigev_notify = SIGEV_THREAD;
+mbed_error_t ctap_backend_complete(mbed_error_t status, uint16_t resp_len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (!ctap_ctx.backend_busy || ctap_ctx.backend_done) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    ctap_ctx.backend_status = status;
+    ctap_ctx.backend_resp_len = resp_len;
+    /* published to the engine, that sends the response */
+    set_bool_with_membarrier(&(ctap_ctx.backend_done), true);
+err:
+    return errcode;
+}
+
+mbed_error_t ctap_set_timeouts(uint32_t transaction_ms, uint32_t idle_ms)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (transaction_ms == 0 || idle_ms == 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ctap_cid_set_timeouts(transaction_ms, idle_ms);
+err:
+    return errcode;
+}
 
-    memset(&its, 0x0, sizeof(struct itimerspec));
-    its.it_interval.tv_sec = 1; /* CID clean every 1 sec */
-    its.it_interval.tv_nsec = 0;
+mbed_error_t ctap_backend_resp_begin(uint16_t resp_len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (!ctap_ctx.backend_busy || ctap_ctx.backend_done ||
+        ctap_ctx.backend_cancelled || ctap_ctx.backend_streaming) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ctap_ctx.backend_stream_len = resp_len;
+    /* published to the engine, that queues the response */
+    set_bool_with_membarrier(&(ctap_ctx.backend_streaming), true);
+err:
+    return errcode;
+}
 
-    its.it_value.tv_sec = 1; /* CID clean first step: 1 sec */
-    its.it_value.tv_nsec = 0;
+mbed_error_t ctap_backend_resp_push(const uint8_t *chunk, uint16_t len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint16_t avail;
+    if (!ctap_ctx.backend_busy || ctap_ctx.backend_done ||
+        ctap_ctx.backend_cancelled || !ctap_ctx.backend_streaming) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    avail = ctap_tx_resp_produced_len();
+    if ((chunk == NULL && len != 0) || (len > (ctap_ctx.backend_stream_len - avail))) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* chunks produced in place are not copied */
+    if (len != 0 && chunk != &(ctap_ctx.backend_resp[avail])) {
+        memcpy(&(ctap_ctx.backend_resp[avail]), chunk, len);
+    }
+    /* the frames now complete are sent */
+    ctap_tx_resp_produced(avail + len);
+err:
+    return errcode;
+}
 
-    if (timer_create(CLOCK_MONOTONIC, &sevp, &timerid) == -1) {
-        log_printf("[CTAP] periodic timer create failed with errno %d\n", errno);
-        errcode = MBED_ERROR_UNKNOWN;
+mbed_error_t ctap_declare_cancel(ctap_handle_cancel_t cancel_handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if (cancel_handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        log_printf("%s: cancel handler is NULL\n", __func__);
         goto err;
-    } else {
-        if (timer_settime(timerid, 0, &its, NULL) == -1) {
-            printf("[CTAP] periodic timer settime failed with errno %d\n", errno);
-            errcode = MBED_ERROR_UNKNOWN;
-            goto err;
-        }
     }
+    ctap_ctx.cancel_cmd = cancel_handler;
+err:
+    return errcode;
+}
 
+bool ctap_backend_cancelled(void)
+{
+    return ctap_ctx.backend_busy && ctap_ctx.backend_cancelled;
+}
+
+mbed_error_t ctap_backend_set_status(ctap_keepalive_status_t status)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    if ((status != CTAP_KEEPALIVE_PROCESSING) && (status != CTAP_KEEPALIVE_UPNEEDED)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (!ctap_ctx.backend_busy) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    ctap_ctx.backend_keepalive_status = status;
 err:
     return errcode;
 }
 
+mbed_error_t ctap_configure(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    /* in that case, any Set_Report (DATA OUT) is pushed to dedicated OUT EP instead
+     * of EP0. This avoid using control plane for DATA content. Althgouh,
+     * we have to configure this EP in order to be ready to receive the report */
+    ctaphid_rx_arm(&ctap_ctx);
+
+    /* channels timeouts are handled by the engine (see ctaphid_receive_pkt()),
+     * no periodic timer is needed */
+    return errcode;
+}
+
 /* we initialize our OUT EP to be ready to receive, if needed. */
 /*
  * Executing a single loop:
@@ -406,39 +828,58 @@ mbed_error_t ctap_exec(void)
         errcode = MBED_ERROR_INVSTATE;
         goto err;
     }
-    /* the Get_Report() request should be transmitted before starting
-     * to send periodic reports */
-    if (ctx->report_sent == false) {
-        /* wait for previous report to be sent first */
-        goto err;
-    }
-    ctap_error_code_t ctaphid_receive_err = ctaphid_receive_pkt(ctx);
-    uint32_t cid = ctx->curr_cid;
-    
-    switch (ctaphid_receive_err) {
-        case U2F_ERR_NONE: {
-            /* Parse all the channels to check if we have a complete command, and if yes execute it! */
-            ctap_cmd_t *cmd = ctap_cid_get_chan_complete_cmd();
-            if(cmd != NULL){
-                log_printf("[CTAPHID] ! Executing completed command, CMD=0x%x / CID=0x%x / Length=%d\n", cmd->cmd, cmd->cid, (uint16_t)((cmd->bcnth) << 8) | cmd->bcntl);
-                /* Execute our command */
-                errcode = ctap_handle_request(cmd);
-                /* Remove any broadcast command */
-                ctap_cid_remove(CTAPHID_BROADCAST_CID);
-                /* Mark the commands associated to CID as non treated 
-                 * since we are ready to treat a new one, and clear its
-                 * buffer states!
-                 */
-                ctap_cid_clear_cmd(cmd->cid);
-            }
-            /* Else, continue our receive loop! */
-            break;
-        }
-        default: {
+    /* push the pending responses frames, if the IN EP is ready. Their
+     * transmission then progresses on each report sent event, while
+     * we keep on handling the received frames */
+    ctap_tx_pump();
+    /* Handle the received frames, draining the RX ring: frames received
+     * while dispatching a command are handled in the same loop */
+    do {
+        ctap_error_code_t ctaphid_receive_err = ctaphid_receive_pkt(ctx);
+        uint32_t cid = ctx->curr_cid;
+
+        if(ctaphid_receive_err != U2F_ERR_NONE){
+            /* answered first: the frame has been handled with room in the
+             * TX queue for its answer (see ctaphid_rx_ready()) */
             errcode = handle_rq_error(cid, ctaphid_receive_err);
-            break;
         }
-    }
+        /* send back the asynchronous backend response, if completed */
+        ctap_backend_handle_completion();
+
+        switch (ctaphid_receive_err) {
+            case U2F_ERR_NONE: {
+                /* Execute the complete commands, in their completion order.
+                 * A request whose response cannot be queued yet is left
+                 * complete, and the following ones behind it: they are
+                 * dispatched on a next loop, once the IN EP has sent the
+                 * previous responses, instead of waiting here */
+                ctap_cmd_t *cmd;
+                while((cmd = ctap_cid_get_chan_complete_cmd()) != NULL && ctap_request_ready(cmd)){
+                    CTAP_TRACE(CTAP_TRACE_DISPATCH, cmd->cid, cmd->cmd, (cmd->bcnth << 8) | cmd->bcntl);
+                    /* Execute our command */
+                    uint32_t cmd_cid = cmd->cid;
+                    errcode = ctap_handle_request(cmd);
+                    /* Mark the commands associated to CID as non treated 
+                     * since we are ready to treat a new one, and clear its
+                     * buffer states! (unless submitted to the asynchronous
+                     * backend, in which case this is done at completion)
+                     */
+                    chan_ctx_t *chan = ctap_cid_get_chan_ctx(cmd_cid);
+                    if((chan == NULL) || (chan->ctap_cmd_received != CTAP_CMD_EXECUTING)){
+                        ctap_cid_clear_cmd(cmd_cid);
+                    }
+                    /* Remove any broadcast command (now idle) */
+                    ctap_cid_remove(CTAPHID_BROADCAST_CID);
+                }
+                /* Else, continue our receive loop! */
+                break;
+            }
+            default: {
+                /* already answered, see above */
+                break;
+            }
+        }
+    } while(ctaphid_rx_pending(ctx) != 0);
 err:
     return errcode;
 }
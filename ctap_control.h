@@ -35,6 +35,21 @@
 # define log_printf(...)
 #endif
 
+/*
+ * Number of OUT frames that can be received while the engine is still
+ * handling previous ones (see usbhid_report_received_trigger()).
+ */
+#define CTAP_RX_SLOTS CONFIG_USR_LIB_CTAP_RX_SLOTS
+/* rx_head and rx_tail run modulo twice the number of slots, so that a full
+ * ring is told apart from an empty one, whatever the number of slots */
+#define CTAP_RX_WRAP  (2 * CTAP_RX_SLOTS)
+
+/* RX ring descriptor: a received frame (zero padded) and its length */
+typedef struct {
+    uint8_t                       frame[CTAPHID_FRAME_MAXLEN];
+    uint16_t                      size;
+} ctap_rx_desc_t;
+
 typedef enum {
     CTAP_CMD_BUFFER_STATE_EMPTY,
     CTAP_CMD_BUFFER_STATE_BUFFERING,
@@ -45,10 +60,10 @@ typedef enum {
 /* the current FIDO CTAP context */
 typedef struct {
     usbhid_report_infos_t        *ctap_report;
-    volatile bool                 ctap_report_received;
-    uint16_t                      ctap_report_size;
-    volatile bool                 idle;
+    /* CTAPHID_LOCK: lock_cid holds the lock up to lock_deadline (ms) */
     bool                          locked;
+    uint32_t                      lock_cid;
+    uint64_t                      lock_deadline;
     uint32_t                      curr_cid;
     uint8_t                       idle_ms;
     /* below stacks handlers (not cb, but references) */
@@ -57,9 +72,47 @@ typedef struct {
     /* upper stack callback */
     ctap_handle_apdu_t            apdu_cmd;
     ctap_handle_wink_t            wink_cmd;
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    /* CTAP2 CBOR requests handler (synchronous or asynchronous) */
+    ctap_handle_cbor_t            cbor_cmd;
+    ctap_submit_cbor_t            cbor_submit_cmd;
+#endif
+    /* asynchronous backend: set by the engine when submitting a request,
+     * backend_done being set by ctap_backend_complete() */
+    ctap_submit_apdu_t            submit_cmd;
+    volatile bool                 backend_busy;
+    volatile bool                 backend_done;
+    volatile mbed_error_t         backend_status;
+    volatile uint16_t             backend_resp_len;
+    uint32_t                      backend_cid;
+    uint8_t                       backend_cmd;
+    volatile uint8_t              backend_keepalive_status;
+    uint64_t                      backend_keepalive_ms;
+    uint64_t                      backend_start_us; /* dispatch time (statistics) */
+    /* cancelled request: the channel is released, its buffer being kept
+     * until the backend completion */
+    ctap_handle_cancel_t          cancel_cmd;
+    volatile bool                 backend_cancelled;
+    uint8_t                      *backend_orphan;
+    uint16_t                      backend_orphan_size;
+    /* streamed response: the backend has declared its length, and the
+     * engine has queued it for transmission */
+    uint8_t                      *backend_resp;
+    volatile bool                 backend_streaming;
+    bool                          backend_stream_queued;
+    uint16_t                      backend_stream_len;
     /* CTAP commands */
     volatile bool                 report_sent;
-    uint8_t                       recv_buf[CTAPHID_FRAME_MAXLEN];
+    /* RX frames ring, single producer (the OUT trigger, which fills the
+     * slot rx_head and immediately rearms the OUT EP on the next free slot)
+     * and single consumer (the engine, which handles the slot rx_tail).
+     * rx_head is only written by the producer, rx_tail by the consumer.
+     * A full ring leaves the OUT EP NAK (rx_stalls statistic): frames are
+     * held by the host, never dropped. */
+    ctap_rx_desc_t                rx_ring[CTAP_RX_SLOTS];
+    volatile uint32_t             rx_head;
+    volatile uint32_t             rx_tail;
+    volatile bool                 rx_armed;
 } ctap_context_t;
 
 
@@ -67,4 +120,26 @@ uint8_t ctap_get_usbhid_handler(void);
 
 ctap_context_t *ctap_get_context(void);
 
+void ctaphid_rx_arm(ctap_context_t *ctx);
+
+void ctaphid_rx_push(ctap_context_t *ctx, uint16_t size);
+
+bool ctap_lock_rejects(ctap_context_t *ctx, uint32_t cid, uint64_t now);
+
+/* the engine has to handle an asynchronous backend event */
+static inline bool ctap_backend_event(const ctap_context_t *ctx)
+{
+    return ctx->backend_done || (ctx->backend_streaming && !ctx->backend_stream_queued);
+}
+
+static inline uint32_t ctaphid_rx_next(uint32_t idx)
+{
+    return (idx + 1) % CTAP_RX_WRAP;
+}
+
+static inline uint32_t ctaphid_rx_pending(const ctap_context_t *ctx)
+{
+    return (ctx->rx_head + CTAP_RX_WRAP - ctx->rx_tail) % CTAP_RX_WRAP;
+}
+
 #endif /*!CTAP_CONTROL_H_*/
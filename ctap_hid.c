@@ -1,6 +1,8 @@
 #include "libc/sync.h"
 #include "ctap_control.h"
 #include "libusbhid.h"
+#include "ctap_tx.h"
+#include "ctap_trace.h"
 
 /* Some USAGE attributes are not HID level defines but 'vendor specific'. This is the case for
  * the FIDO usage page, which is a vendor specific usage page, defining its own, cusom USAGE tag values */
@@ -57,11 +59,10 @@ mbed_error_t usbhid_report_received_trigger(uint8_t hid_handler, uint16_t size)
 {
     ctap_context_t *ctx = ctap_get_context();
 
-    log_printf("[CTAPHID] Received FIDO cmd (size %d)\n", size);
-    //set_bool_with_membarrier(&(ctx->ctap_cmd_received), true);
-    ctx->ctap_report_received = true;
-    ctx->ctap_report_size = size;
-    /* nothing more to do, as the received  command is already set in .ctap_cmd field */
+    /* the frame has been received in the slot rx_head of the RX ring: publish
+     * it, and rearm the OUT EP right now on the next free slot, so that the
+     * host is not NAKed while the engine handles the previous frames */
+    ctaphid_rx_push(ctx, size);
     hid_handler = hid_handler; /* XXX to use ?*/
     return MBED_ERROR_NONE;
 }
@@ -75,7 +76,6 @@ mbed_error_t           usbhid_set_idle(uint8_t hid_handler, uint8_t idle)
     hid_handler = hid_handler;
     log_printf("[CTAPHID] triggered on Set_Idle\n");
     ctx->idle_ms = idle;
-    ctx->idle = true;
     log_printf("[CTAPHID] set idle time to %d ms\n", idle);
     return MBED_ERROR_NONE;
 }
@@ -103,10 +103,12 @@ usbhid_report_infos_t *usbhid_get_report(uint8_t hid_handler, uint8_t index)
 void usbhid_report_sent_trigger(uint8_t hid_handler, uint8_t index)
 {
     ctap_context_t *ctx = ctap_get_context();
-    log_printf("[CTAPHID] report sent!\n");
+    CTAP_TRACE(CTAP_TRACE_TX_SENT, 0, 0, 0);
     hid_handler = hid_handler;
     index = index;
-    ctx->report_sent = true;
+    set_bool_with_membarrier(&(ctx->report_sent), true);
+    /* push the next frame of the pending responses, if any */
+    ctap_tx_pump();
 }
 
 
@@ -0,0 +1,119 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/sync.h"
+#include "ctap_control.h"
+#include "ctap_pool.h"
+
+#define CTAP_POOL_WORDS ((CTAP_POOL_BLOCKS + 31) / 32)
+
+static struct {
+    uint8_t           arena[CTAP_POOL_BLOCKS * CTAP_POOL_BLOCK_SIZE];
+    uint32_t          used[CTAP_POOL_WORDS];  /* one bit per block */
+    uint32_t          used_blocks;
+    volatile uint32_t lock;
+} pool = { 0 };
+
+
+static inline bool ctap_pool_block_used(uint32_t block)
+{
+    return (pool.used[block / 32] & (1UL << (block % 32))) != 0;
+}
+
+static inline void ctap_pool_mark(uint32_t first, uint32_t num, bool used)
+{
+    for (uint32_t b = first; b < first + num; ++b) {
+        if (used) {
+            pool.used[b / 32] |= (1UL << (b % 32));
+        } else {
+            pool.used[b / 32] &= ~(1UL << (b % 32));
+        }
+    }
+}
+
+/*
+ * Lease a buffer of at least size bytes (first fit). Returns NULL if there
+ * is no contiguous run of free blocks large enough.
+ */
+uint8_t *ctap_pool_lease(uint16_t size)
+{
+    uint8_t *buf = NULL;
+    uint32_t num = (size + CTAP_POOL_BLOCK_SIZE - 1) / CTAP_POOL_BLOCK_SIZE;
+    uint32_t run = 0;
+
+    if (size == 0) {
+        goto err;
+    }
+    mutex_lock(&pool.lock);
+    if (num > (CTAP_POOL_BLOCKS - pool.used_blocks)) {
+        goto unlock;
+    }
+    for (uint32_t b = 0; b < CTAP_POOL_BLOCKS; ++b) {
+        /* skip fully used words at once */
+        if ((b % 32) == 0 && pool.used[b / 32] == 0xffffffffUL) {
+            run = 0;
+            b += 31;
+            continue;
+        }
+        if (ctap_pool_block_used(b)) {
+            run = 0;
+            continue;
+        }
+        run++;
+        if (run == num) {
+            uint32_t first = b + 1 - num;
+            ctap_pool_mark(first, num, true);
+            pool.used_blocks += num;
+            buf = &pool.arena[first * CTAP_POOL_BLOCK_SIZE];
+            break;
+        }
+    }
+unlock:
+    mutex_unlock(&pool.lock);
+    if (buf == NULL) {
+        log_printf("[CTAP] pool: no room for %d bytes\n", size);
+    }
+err:
+    return buf;
+}
+
+void ctap_pool_release(uint8_t *buf, uint16_t size)
+{
+    uint32_t num = (size + CTAP_POOL_BLOCK_SIZE - 1) / CTAP_POOL_BLOCK_SIZE;
+
+    if (buf == NULL || size == 0 || buf < &pool.arena[0] ||
+        buf >= &pool.arena[CTAP_POOL_BLOCKS * CTAP_POOL_BLOCK_SIZE]) {
+        return;
+    }
+    mutex_lock(&pool.lock);
+    ctap_pool_mark((uint32_t)(buf - &pool.arena[0]) / CTAP_POOL_BLOCK_SIZE, num, false);
+    pool.used_blocks -= num;
+    mutex_unlock(&pool.lock);
+}
+
+uint32_t ctap_pool_free_blocks(void)
+{
+    return CTAP_POOL_BLOCKS - pool.used_blocks;
+}
@@ -0,0 +1,50 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef CTAP_POOL_H_
+#define CTAP_POOL_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+
+/*
+ * Reassembly buffers pool.
+ *
+ * Instead of embedding a full CTAPHID_MAX_PAYLOAD_SIZE buffer in each
+ * channel, a channel leases on its initialization frame a buffer sized from
+ * the command BCNT, and gives it back when the command is cleared.
+ * The pool is made of CTAP_POOL_BLOCK_SIZE bytes blocks, a lease being a
+ * contiguous run of blocks.
+ */
+
+#define CTAP_POOL_SIZE       CONFIG_USR_LIB_CTAP_RX_POOL_SIZE
+#define CTAP_POOL_BLOCK_SIZE 64
+#define CTAP_POOL_BLOCKS     (CTAP_POOL_SIZE / CTAP_POOL_BLOCK_SIZE)
+
+uint8_t *ctap_pool_lease(uint16_t size);
+
+void ctap_pool_release(uint8_t *buf, uint16_t size);
+
+uint32_t ctap_pool_free_blocks(void);
+
+#endif/*!CTAP_POOL_H_*/
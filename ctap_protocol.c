@@ -3,7 +3,11 @@
 #include "libusbhid.h"
 #include "ctap_control.h"
 #include "ctap_chan.h"
+#include "ctap_pool.h"
 #include "ctap_protocol.h"
+#include "ctap_tx.h"
+#include "ctap_stats.h"
+#include "ctap_trace.h"
 
 
 typedef union {
@@ -21,104 +25,30 @@ typedef union {
 
 /*
  * A CTAP response may be bigger than the CTAP Out endpoint MPSize.
- * If it does, this function is responsible for fragmenting the response
- * into successive blocks to which a ctap_resp_msg_t header is added,
- * and then pushed to the endpoint. The first frame sent is always a CTAP INIT
+ * If it does, it is fragmented into successive blocks to which a header is
+ * added, and then pushed to the endpoint. The first frame sent is always a CTAP INIT
  * frame (with CID, cmd, bcnt). Others successive ones are CTAP CONT
  * (cid and sequence identifier, no cmd, no bcnt - i.e. bcnt is flow global)
+ *
+ * The fragmentation is handled by the TX queue (see ctap_tx.c), the frames
+ * being sent one by one as the IN endpoint acknowledges them. This function
+ * returns as soon as the response is queued.
  */
-static mbed_error_t ctaphid_send_response(uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd)
+mbed_error_t ctaphid_send_response(const uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint8_t sequence = 0;
     /* sanitize first */
     if (resp == NULL && resp_len != 0) {
         log_printf("[CTAP] invalid response buf %x\n", resp);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    log_printf("[CTAPHID] CID 0x%x: 0x%x (%d) bytes to send\n", cid, resp_len, resp_len);
-    /* we know that the effective response buffer is upto ctap_resp_header_t + 256 bytes
-     * (defined in the FIDO U2F standard). Finally, we can only push upto 64 bytes at a time.
-     */
-    /* total response content to handle */
-    uint32_t offset = 0;
-    uint32_t max_resp_len = 0;
-    uint32_t idx = 0;
-    bool new_seq = true;
-    do {
-        uint32_t len = 0;
-        offset = 0;
-        ctap_init_cmd_t full_init_resp = { 0 };
-        ctap_seq_cmd_t full_seq_resp = { 0 };
-        if (new_seq == true) {
-        /* cleaning potential previous frames */
-            log_printf("[CTAP] first response chunk\n");
-            /* first pass */
-            full_init_resp.header.cid = cid;
-            full_init_resp.header.cmd = cmd;
-            full_init_resp.header.bcnth = (resp_len & 0xff00) >> 8;
-            full_init_resp.header.bcntl = (resp_len & 0xff);
-            max_resp_len = CTAPHID_FRAME_MAXLEN - sizeof(ctap_init_header_t);
-        } else {
-            log_printf("[CTAP] sequence response chunk\n");
-            full_seq_resp.header.cid = cid;
-            full_seq_resp.header.seq = sequence;
-            max_resp_len = CTAPHID_FRAME_MAXLEN - sizeof(ctap_seq_header_t);
-            sequence++;
-        }
-        /* remaining size in frame for data (after header) */
-
-        /*now copy effective response content to current chunk */
-        if (new_seq == true) {
-            /* if resp is NULL, resp_len is 0, while is not executed */
-            while (idx < resp_len && offset < max_resp_len) {
-                full_init_resp.data[offset] = resp[idx];
-                offset++;
-                idx++;
-            }
-        } else {
-            /* if resp is NULL, resp_len is 0, while is not executed */
-            while (idx < resp_len && offset < max_resp_len) {
-                full_seq_resp.data[offset] = resp[idx];
-                offset++;
-                idx++;
-            }
-        }
-        /* here, full_resp is ready to be sent. Its size can be 64 bytes length
-         * or less (offset value). We send the current report chunk here. */
-
-        if (new_seq == true) {
-            /* amount to send */
-            len = offset + sizeof(ctap_init_header_t);
-            log_printf("[CTAP] Sending response first chunk headersize:%d; data:%d (len %d)\n", sizeof(ctap_init_header_t), offset, len);
-            if (len < CTAPHID_FRAME_MAXLEN) {
-                /* padding to mpsize */
-                len = CTAPHID_FRAME_MAXLEN;
-            }
-            usbhid_send_response(ctap_get_usbhid_handler(), (uint8_t*)&full_init_resp, len);
-        } else {
-            len = offset + sizeof(ctap_seq_header_t);
-            log_printf("[CTAP] Sending resp seq chunk headersize:%d; data:%d (len %d)\n", sizeof(ctap_seq_header_t), offset, len);
-            if (len < CTAPHID_FRAME_MAXLEN) {
-                /* padding to mpsize */
-                len = CTAPHID_FRAME_MAXLEN;
-            }
-            usbhid_send_response(ctap_get_usbhid_handler(), (uint8_t*)&full_seq_resp, len);
-        }
-        /* updated pushed_bytes count */
-        log_printf("[CTAP] sending %d bytes on %d\n", idx, resp_len);
-        /* the first time we get here, we have send the first chunk. Each other times are consecutive
-         * chunks */
-        new_seq = false;
-    } while (idx < resp_len);
-
-    /* here, all chunk(s) has been sent. All are upto CTAPHID_FRAME_MAXLEN. The total length
-     * is defined by resp_len and set in the first chunk header. */
-    /* finishing with ZLP */
-    //usb_backend_drv_send_zlp(epid);
-    usbhid_response_done(ctap_get_usbhid_handler());
-
+    if (resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        log_printf("[CTAP] response too long (%d bytes)\n", resp_len);
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = ctap_tx_enqueue(resp, resp_len, cid, cmd);
 err:
     return errcode;
 }
@@ -136,6 +66,8 @@ mbed_error_t handle_rq_error(uint32_t cid, uint8_t error)
 	/* Prepare our frame */
         ctap_init_cmd_t frame;
 	memset(&frame, 0, sizeof(frame));
+	ctap_stats_error(error);
+	CTAP_TRACE(CTAP_TRACE_ERROR, cid, error, 0);
 
 	/* Send the frame on the line */
 	if(ctaphid_send_response((uint8_t*)&error, 1, cid, CTAP_ERROR | 0x80)) {
@@ -150,119 +82,446 @@ err:
 }
 
 /*
- * Handling CTAPHID_MSG command
+ * Backend execution time statistics: from the request dispatch to the
+ * backend response (or completion)
  */
-static mbed_error_t handle_rq_msg(ctap_cmd_t* cmd)
+static inline void ctap_backend_stats_start(ctap_context_t *ctx)
+{
+#if CONFIG_USR_LIB_CTAP_STATS
+    if (sys_get_systick(&ctx->backend_start_us, PREC_MICRO) != SYS_E_DONE) {
+        ctx->backend_start_us = 0;
+    }
+    CTAP_TRACE_CLOCK(ctx->backend_start_us);
+#else
+    (void)ctx;
+#endif
+}
+
+static inline void ctap_backend_stats_end(const ctap_context_t *ctx, uint8_t cmd)
+{
+#if CONFIG_USR_LIB_CTAP_STATS
+    uint64_t now;
+    if (ctx->backend_start_us != 0 && sys_get_systick(&now, PREC_MICRO) == SYS_E_DONE) {
+        CTAP_TRACE_CLOCK(now);
+        ctap_stats_backend(cmd, now - ctx->backend_start_us);
+    }
+#else
+    (void)ctx;
+    (void)cmd;
+#endif
+}
+
+/*
+ * Submit the command (CTAPHID_MSG or CTAPHID_CBOR) to the asynchronous
+ * backend. The channel command (and its buffer) is kept until the backend
+ * completion, the backend writing its response in the leased TX response
+ * buffer.
+ */
+static mbed_error_t handle_rq_submit(ctap_cmd_t* cmd, uint8_t ctaphid_cmd, ctap_submit_apdu_t submit_cmd)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     ctap_context_t *ctx = ctap_get_context();
     uint32_t cid = cmd->cid;
-    /* CTAPHID level sanitation */
-    /* endianess... */
     uint16_t bcnt = (cmd->bcnth << 8) | cmd->bcntl;
-    if (bcnt < 4) {
-        log_printf("[CTAP] CTAP_MSG pkt len must be at least 4, found %d\n", bcnt);
-        handle_rq_error(cid, U2F_ERR_INVALID_PAR);
-        errcode = MBED_ERROR_INVPARAM;
+
+    if (ctx->backend_busy) {
+        /* a single request can be executed by the backend at a time */
+        log_printf("[CTAP] backend busy, CID %x rejected\n", cid);
+        CTAP_STATS_INC(busy[CTAP_STATS_BUSY_BACKEND]);
+        handle_rq_error(cid, U2F_ERR_CHANNEL_BUSY);
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    chan_ctx_t *chan = ctap_cid_get_chan_ctx(cid);
+    if (chan == NULL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    uint8_t *resp = ctap_tx_resp_lease();
+    if (resp == NULL) {
+        /* not dispatched before the buffer is free (see ctap_request_ready()) */
+        CTAP_STATS_INC(busy[CTAP_STATS_BUSY_RESP]);
+        handle_rq_error(cid, U2F_ERR_CHANNEL_BUSY);
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    ctx->backend_cid = cid;
+    ctx->backend_cmd = ctaphid_cmd;
+    ctx->backend_resp = resp;
+    ctx->backend_resp_len = 0;
+    ctx->backend_stream_queued = false;
+    set_bool_with_membarrier(&(ctx->backend_streaming), false);
+    ctx->backend_keepalive_status = CTAP_KEEPALIVE_PROCESSING;
+    ctx->backend_keepalive_ms = 0;
+#if CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL > 0
+    uint64_t now;
+    if (ctap_systick_ms(&now) == SYS_E_DONE) {
+        ctx->backend_keepalive_ms = now + CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL;
+    }
+#endif
+    ctap_backend_stats_start(ctx);
+    set_bool_with_membarrier(&(ctx->backend_cancelled), false);
+    set_bool_with_membarrier(&(ctx->backend_done), false);
+    set_bool_with_membarrier(&(ctx->backend_busy), true);
+    /* the backend may complete before returning from the submission */
+    ctap_cid_execute_cmd(chan);
+    CTAP_TRACE(CTAP_TRACE_BACKEND_SUBMIT, cid, ctaphid_cmd, bcnt);
+    errcode = submit_cmd(ctaphid_cmd, cmd->data, bcnt, resp, CTAPHID_MAX_PAYLOAD_SIZE);
+    if (errcode != MBED_ERROR_NONE) {
+        log_printf("[CTAP] request submission failed!\n");
+        ctap_tx_resp_release();
+        set_bool_with_membarrier(&(ctx->backend_busy), false);
+        ctap_cid_clear_cmd(cid);
+        handle_rq_error(cid, (ctaphid_cmd == CTAP_CBOR) ? U2F_ERR_OTHER : U2F_ERR_INVALID_CMD);
+        goto err;
+    }
+err:
+    return errcode;
+}
+
+/*
+ * Send back the response of the asynchronous backend, if it has completed,
+ * and release the channel command. A streamed response is queued as soon
+ * as the backend has started to produce it.
+ */
+mbed_error_t ctap_backend_handle_completion(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_context_t *ctx = ctap_get_context();
+    uint32_t cid;
+    uint16_t resp_len;
+
+    if (!ctx->backend_done) {
+        if (ctx->backend_streaming && !ctx->backend_stream_queued && !ctx->backend_cancelled) {
+            request_data_membarrier();
+            if (ctap_tx_resp_stream(ctx->backend_stream_len, ctx->backend_cid, ctx->backend_cmd|0x80) == MBED_ERROR_NONE) {
+                ctx->backend_stream_queued = true;
+            }
+        }
         goto err;
     }
-    if (cid == 0 || cid == CTAPHID_BROADCAST_CID) {
-        log_printf("[CTAP] CTAP_INIT CID must be nonzero\n");
-        handle_rq_error(cid, U2F_ERR_INVALID_PAR);
+    if (!ctx->backend_cancelled && !ctap_tx_has_room()) {
+        /* no room for the response: sent on a next loop, once the IN EP
+         * has drained the TX queue */
+        goto err;
+    }
+    request_data_membarrier();
+    cid = ctx->backend_cid;
+    resp_len = ctx->backend_resp_len;
+    ctap_backend_stats_end(ctx, ctx->backend_cmd);
+    CTAP_TRACE(CTAP_TRACE_BACKEND_DONE, cid, (ctx->backend_status != MBED_ERROR_NONE), resp_len);
+    if (ctx->backend_cancelled) {
+        /* already answered, and the channel released, at cancel time */
+        log_printf("[CTAP] cancelled request completed, response dropped\n");
+        ctap_pool_release(ctx->backend_orphan, ctx->backend_orphan_size);
+        ctx->backend_orphan = NULL;
+        if (!ctx->backend_stream_queued) {
+            /* else, the streamed response has been aborted at cancel time */
+            ctap_tx_resp_release();
+        }
+        set_bool_with_membarrier(&(ctx->backend_cancelled), false);
+        goto release;
+    }
+    if (ctx->backend_streaming) {
+        if (ctx->backend_status == MBED_ERROR_NONE &&
+            ctap_tx_resp_produced_len() == ctx->backend_stream_len) {
+            /* fully produced, and being sent (or to be sent) */
+            if (!ctx->backend_stream_queued) {
+                errcode = ctap_tx_resp_stream(ctx->backend_stream_len, cid, ctx->backend_cmd|0x80);
+                if (errcode != MBED_ERROR_NONE) {
+                    ctap_tx_resp_release();
+                }
+            }
+        } else {
+            /* incomplete response: drop it, the error initialization frame
+             * resynchronizes the host even if some frames have been sent */
+            log_printf("[CTAP] backend streamed response failed!\n");
+            if (ctx->backend_stream_queued) {
+                ctap_tx_resp_abort();
+            } else {
+                ctap_tx_resp_release();
+            }
+            errcode = handle_rq_error(cid, (ctx->backend_cmd == CTAP_CBOR) ? U2F_ERR_OTHER : U2F_ERR_INVALID_CMD);
+        }
+    } else if (ctx->backend_status != MBED_ERROR_NONE) {
+        log_printf("[CTAP] backend request handling failed!\n");
+        /* CBOR level errors are encoded in the response, this is an internal error */
+        ctap_tx_resp_release();
+        errcode = handle_rq_error(cid, (ctx->backend_cmd == CTAP_CBOR) ? U2F_ERR_OTHER : U2F_ERR_INVALID_CMD);
+    } else if (resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        log_printf("[CTAP] invalid backend response length %d\n", resp_len);
+        ctap_tx_resp_release();
+        errcode = handle_rq_error(cid, U2F_ERR_OTHER);
+    } else {
+        /* sent in place, from the leased response buffer */
+        errcode = ctap_tx_resp_commit(resp_len, cid, ctx->backend_cmd|0x80);
+    }
+    ctap_cid_clear_cmd(cid);
+    ctap_cid_refresh(cid);
+release:
+    ctx->backend_stream_queued = false;
+    set_bool_with_membarrier(&(ctx->backend_streaming), false);
+    set_bool_with_membarrier(&(ctx->backend_done), false);
+    set_bool_with_membarrier(&(ctx->backend_busy), false);
+err:
+    return errcode;
+}
+
+/*
+ * Send a CTAPHID_KEEPALIVE with the backend status on the channel of the
+ * executing request, each CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL ms. A
+ * keepalive is skipped (never waited for) if the TX queue is full.
+ * Return the time of the next keepalive, UINT64_MAX if none is due.
+ */
+uint64_t ctap_backend_keepalive(uint64_t now)
+{
+#if CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL > 0
+    ctap_context_t *ctx = ctap_get_context();
+
+    if (!ctx->backend_busy || ctx->backend_done || ctx->backend_cancelled || ctx->backend_streaming) {
+        /* no keepalive once the response is being sent */
+        return 0xffffffffffffffffULL;
+    }
+    if (now >= ctx->backend_keepalive_ms) {
+        if (ctap_tx_has_room()) {
+            uint8_t status = ctx->backend_keepalive_status;
+            ctaphid_send_response(&status, 1, ctx->backend_cid, CTAP_KEEPALIVE|0x80);
+        }
+        ctx->backend_keepalive_ms = now + CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL;
+    }
+    return ctx->backend_keepalive_ms;
+#else
+    (void)now;
+    return 0xffffffffffffffffULL;
+#endif
+}
+
+/*
+ * Answer a cancelled request: CTAP2 requires a CBOR response carrying the
+ * KEEPALIVE_CANCEL status, U2F has no equivalent and gets an error.
+ */
+static mbed_error_t ctap_cancel_respond(uint32_t cid, uint8_t cmd)
+{
+    if (cmd == CTAP_CBOR) {
+        uint8_t status = CTAP2_ERR_KEEPALIVE_CANCEL;
+        return ctaphid_send_response(&status, 1, cid, CTAP_CBOR|0x80);
+    }
+    return handle_rq_error(cid, U2F_ERR_OTHER);
+}
+
+/*
+ * Handling CTAPHID_CANCEL, at frame reception time: the executing (or
+ * waiting for dispatch) request of the channel is cancelled and answered,
+ * and the channel is released. The backend is informed, and its late
+ * completion is dropped. CANCEL itself has no response, and is ignored
+ * when there is no request to cancel.
+ */
+mbed_error_t handle_rq_cancel(uint32_t cid)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_context_t *ctx = ctap_get_context();
+    uint8_t cmd;
+
+    chan_ctx_t *chan = ctap_cid_get_chan_ctx(cid);
+    if (chan == NULL) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    /* TODO channel to handle */
-    if (!ctap_cid_exists(cid)) {
-        /* invalid channel */
-        log_printf("[CTAP][MSG] New CID: %x\n", cid);
-        handle_rq_error(cid, U2F_ERR_INVALID_PAR);
+    switch (chan->ctap_cmd_received) {
+        case CTAP_CMD_EXECUTING:
+            if (!ctx->backend_busy || ctx->backend_cancelled || ctx->backend_cid != cid) {
+                goto err;
+            }
+            set_bool_with_membarrier(&(ctx->backend_cancelled), true);
+            if (ctx->cancel_cmd != NULL) {
+                ctx->cancel_cmd();
+            }
+            /* the backend may still read the request until its completion */
+            ctx->backend_orphan = ctap_cid_detach_cmd_data(chan, &(ctx->backend_orphan_size));
+            if (ctx->backend_stream_queued) {
+                /* drop the partially streamed response */
+                ctap_tx_resp_abort();
+            }
+            ctap_cid_clear_cmd(cid);
+            errcode = ctap_cancel_respond(cid, ctx->backend_cmd);
+            break;
+        case CTAP_CMD_COMPLETE:
+            cmd = chan->ctap_cmd.cmd & 0x7f;
+            ctap_cid_clear_cmd(cid);
+            errcode = ctap_cancel_respond(cid, cmd);
+            break;
+        default:
+            /* nothing to cancel */
+            break;
+    }
+err:
+    return errcode;
+}
+
+/*
+ * Handling CTAPHID_MSG command
+ */
+static mbed_error_t handle_rq_msg(ctap_cmd_t* cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_context_t *ctx = ctap_get_context();
+    uint32_t cid = cmd->cid;
+    /* CTAPHID level sanitation */
+    /* endianess... */
+    /* BCNT (at least an APDU header) and channel checked on the first
+     * frame (see ctap_cmd_check()) */
+    uint16_t bcnt = (cmd->bcnth << 8) | cmd->bcntl;
+
+    if (ctx->submit_cmd != NULL) {
+        errcode = handle_rq_submit(cmd, CTAP_MSG, ctx->submit_cmd);
         goto err;
     }
 
     /* now that header is sanitized, let's push the data content
-     * to the backend
-     * FIXME: by now, calling APDU backend, no APDU vs CBOR detection */
-    uint8_t msg_resp[1024] = { 0 };
-    uint16_t resp_len = sizeof(msg_resp);
+     * to the backend. MSG only carries APDU, CBOR content being received
+     * through CTAPHID_CBOR (see handle_rq_cbor()).
+     * The response is written by the backend in the leased TX response
+     * buffer, from which it is sent without any copy. */
+    /* an asynchronous (CBOR) backend may still be writing the response buffer */
+    uint8_t *resp = ctx->backend_busy ? NULL : ctap_tx_resp_lease();
+    uint16_t resp_len = CTAPHID_MAX_PAYLOAD_SIZE;
+    if (resp == NULL) {
+        /* the response buffer is used by the backend (see ctap_request_ready()) */
+        CTAP_STATS_INC(busy[ctx->backend_busy ? CTAP_STATS_BUSY_BACKEND : CTAP_STATS_BUSY_RESP]);
+        handle_rq_error(cid, U2F_ERR_CHANNEL_BUSY);
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
 
-#if 1
     /* MSG in CTAP1 cotains APDU data. This should be passed to backend APDU through
      * predefined callback, in the case where libapdu is handled in a different task.
      * This callback is responsible for passing the APDU content to whatever is
      * responsible for the APDU parsing, FIDO effective execution and result return */
-    uint16_t val = (cmd->bcnth << 8) + cmd->bcntl;
-    errcode = ctx->apdu_cmd(0, &(cmd->data[0]), val, &(msg_resp[0]), &resp_len);
-        //apdu_handle_request(msg_resp, &resp_len);
-    if (errcode != MBED_ERROR_NONE) {
+    ctap_backend_stats_start(ctx);
+    errcode = ctx->apdu_cmd(0, &(cmd->data[0]), bcnt, resp, &resp_len);
+    ctap_backend_stats_end(ctx, CTAP_MSG);
+    if (errcode != MBED_ERROR_NONE || resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
         log_printf("[CTAP][MSG] APDU requests handling failed!\n");
+        ctap_tx_resp_release();
         handle_rq_error(cid, U2F_ERR_INVALID_CMD);
         goto err;
     }
-#endif
-    log_printf("[CTAP][MSG] Sending back response\n");
-    errcode = ctaphid_send_response(&msg_resp[0], resp_len, cid, CTAP_MSG|0x80);
+    errcode = ctap_tx_resp_commit(resp_len, cid, CTAP_MSG|0x80);
+err:
+    return errcode;
+}
+
+#if CONFIG_USR_LIB_CTAP_CTAP2
+/*
+ * Handling CTAPHID_CBOR command: the request is handed to the CBOR handler
+ * in place, in the channel reassembly buffer.
+ */
+static mbed_error_t handle_rq_cbor(ctap_cmd_t* cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_context_t *ctx = ctap_get_context();
+    uint32_t cid = cmd->cid;
+    uint16_t bcnt = (cmd->bcnth << 8) | cmd->bcntl;
+    uint16_t resp_len = CTAPHID_MAX_PAYLOAD_SIZE;
+    uint8_t *resp;
+
+    if (ctx->cbor_submit_cmd != NULL) {
+        errcode = handle_rq_submit(cmd, CTAP_CBOR, ctx->cbor_submit_cmd);
+        goto err;
+    }
+    if (ctx->cbor_cmd == NULL) {
+        /* CTAP2 not supported by the application */
+        handle_rq_error(cid, U2F_ERR_INVALID_CMD);
+        errcode = MBED_ERROR_UNSUPORTED;
+        goto err;
+    }
+    /* an asynchronous (APDU) backend may still be writing the response buffer */
+    resp = ctx->backend_busy ? NULL : ctap_tx_resp_lease();
+    if (resp == NULL) {
+        /* the response buffer is used by the backend (see ctap_request_ready()) */
+        CTAP_STATS_INC(busy[ctx->backend_busy ? CTAP_STATS_BUSY_BACKEND : CTAP_STATS_BUSY_RESP]);
+        handle_rq_error(cid, U2F_ERR_CHANNEL_BUSY);
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    ctap_backend_stats_start(ctx);
+    errcode = ctx->cbor_cmd(CTAP_CBOR, cmd->data, bcnt, resp, &resp_len);
+    ctap_backend_stats_end(ctx, CTAP_CBOR);
+    if (errcode != MBED_ERROR_NONE || resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        log_printf("[CTAP][CBOR] CBOR requests handling failed!\n");
+        ctap_tx_resp_release();
+        /* CBOR level errors are encoded in the response, this is an internal error */
+        handle_rq_error(cid, U2F_ERR_OTHER);
+        goto err;
+    }
+    errcode = ctap_tx_resp_commit(resp_len, cid, CTAP_CBOR|0x80);
 err:
     return errcode;
 }
+#endif
 
-static mbed_error_t handle_rq_ping(const ctap_cmd_t* cmd)
+static mbed_error_t handle_rq_ping(ctap_cmd_t* cmd)
 {
     uint16_t len = (cmd->bcnth << 8) + cmd->bcntl;
+#if CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+    chan_ctx_t *chan = ctap_cid_get_chan_ctx(cmd->cid);
+    if (chan != NULL && chan->ctap_cmd_echoed != 0) {
+        /* the first frames have been echoed before the TX queue got full
+         * (see ctaphid_echo_fallback()), send the rest */
+        return ctap_tx_enqueue_tail(cmd->data, len, chan->ctap_cmd_echoed, cmd->cid, CTAP_PING|0x80);
+    }
+#endif
     return ctaphid_send_response((uint8_t*)cmd->data, len, cmd->cid, CTAP_PING|0x80);
 }
 
-static mbed_error_t handle_rq_sync(const ctap_cmd_t* cmd)
+static mbed_error_t handle_rq_sync(ctap_cmd_t* cmd)
 {
     return ctaphid_send_response(NULL, 0, cmd->cid, CTAP_SYNC|0x80);
 }
 
 
-static mbed_error_t handle_rq_wink(const ctap_cmd_t* cmd)
+static mbed_error_t handle_rq_wink(ctap_cmd_t* cmd)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     ctap_context_t *ctx = ctap_get_context();
-    uint16_t len = ((cmd->bcnth << 8) + cmd->bcntl);
-	/* We expect 0 data */
-    if (len != 0) {
-        log_printf("[CTAPHID] invalid size for wink request (len == %d)\n", len);
-        errcode = handle_rq_error(cmd->cid, U2F_ERR_INVALID_LEN);
-        goto err;
-    }
     /* first do something for user interaction (500ms)... */
     if (ctx->wink_cmd != NULL) {
         ctx->wink_cmd(500);
     }
     /* and return back content */
     errcode = ctaphid_send_response(NULL, 0, cmd->cid, cmd->cmd);
-err:
     return errcode;
 }
 
-static mbed_error_t handle_rq_lock(const ctap_cmd_t*cmd)
+static mbed_error_t handle_rq_lock(ctap_cmd_t*cmd)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     ctap_context_t *ctx = ctap_get_context();
+    uint64_t now;
 
-    uint16_t len = (cmd->bcnth << 8) + cmd->bcntl + sizeof(ctap_init_header_t);
-	/* We expect 0 data */
-    if (len != 1) {
-       errcode = handle_rq_error(cmd->cid, U2F_ERR_INVALID_LEN);
-       goto err;
-    }
+	/* We expect the lock time (in seconds) only (BCNT checked on the first frame) */
     if (cmd->data[0] > 10) {
 		/* Only timeouts <= 10 seconds are allowed! */
        errcode = handle_rq_error(cmd->cid, U2F_ERR_INVALID_PAR);
        goto err;
     }
-    set_bool_with_membarrier(&(ctx->locked), true);
+    if (cmd->data[0] == 0) {
+        /* lock time 0 releases the lock */
+        ctx->locked = false;
+    } else {
+        if (ctap_systick_ms(&now) != SYS_E_DONE) {
+            errcode = handle_rq_error(cmd->cid, U2F_ERR_OTHER);
+            goto err;
+        }
+        /* other channels are rejected up to the deadline (see ctap_lock_rejects()) */
+        ctx->lock_cid = cmd->cid;
+        ctx->lock_deadline = now + (uint64_t)cmd->data[0] * 1000;
+        ctx->locked = true;
+    }
+    CTAP_TRACE(CTAP_TRACE_LOCK, cmd->cid, 0, cmd->data[0]);
 
     errcode = ctaphid_send_response(NULL, 0, cmd->cid, CTAP_LOCK|0x80);
 
-    /**
-     * TODO: set ctx as locked for the amount of time set in data[0]
-     */
-
 err:
     return errcode;
 }
@@ -272,30 +531,13 @@ err:
 /*
  * Handling CTAPHID_INIT command
  */
-static mbed_error_t handle_rq_init(const ctap_cmd_t* cmd)
+static mbed_error_t handle_rq_init(ctap_cmd_t* cmd)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint32_t curcid = cmd->cid;
-    uint32_t newcid = 0;
-    /* CTAPHID level sanitation */
-    /* endianess... */
-    uint16_t bcnt = (cmd->bcnth << 8) | cmd->bcntl;
-    if (bcnt != 8) {
-        log_printf("[CTAP] CTAP_INIT pkt len must be 8, found %d\n", bcnt);
-        log_printf("[CTAP] bcnth: %x, bcntl: %x\n", cmd->bcnth, cmd->bcntl);
-        handle_rq_error(curcid, U2F_ERR_INVALID_PAR);
-        errcode = MBED_ERROR_INVPARAM;
-        goto err;
-    }
-    if (cmd->cid == 0) {
-        log_printf("[CTAP] CTAP_INIT CID must be nonzero\n");
-        handle_rq_error(curcid, U2F_ERR_INVALID_PAR);
-        errcode = MBED_ERROR_INVPARAM;
-        goto err;
-        /* new channel request */
-    } else {
-        newcid = curcid;
-    }
+    uint32_t newcid = curcid;
+    /* CTAPHID level sanitation (BCNT is the nonce size, nonzero CID) is done
+     * on the first frame (see ctap_cmd_check()) */
     uint8_t resp[17] = { 0 };
     memcpy(&(resp[0]), cmd->data, INIT_NONCE_SIZE);
 
@@ -303,14 +545,21 @@ static mbed_error_t handle_rq_init(const ctap_cmd_t* cmd)
         /* Remove the BROADCAST CID */
         ctap_cid_remove(CTAPHID_BROADCAST_CID);
 	/* Allocate next CID */
-        ctap_cid_generate(&newcid);
+        errcode = ctap_cid_generate(&newcid);
+        if(errcode != MBED_ERROR_NONE){
+            /* no CID could be drawn (TRNG failure): no channel is added */
+            log_printf("[CTAPHID] CID generation failed\n");
+            handle_rq_error(CTAPHID_BROADCAST_CID, U2F_ERR_OTHER);
+            goto err;
+        }
         errcode = ctap_cid_add(newcid);
         if(errcode != MBED_ERROR_NONE){
+            CTAP_STATS_INC(busy[CTAP_STATS_BUSY_CID]);
             handle_rq_error(CTAPHID_BROADCAST_CID, U2F_ERR_CHANNEL_BUSY);
             errcode = MBED_ERROR_NOMEM;
             goto err;
         }
-        log_printf("[CTAP][INIT] New CID: %x\n", newcid);
+        CTAP_TRACE(CTAP_TRACE_CID_NEW, newcid, 0, 0);
         *(uint32_t*)(&(resp[INIT_NONCE_SIZE])) = newcid;
         curcid = CTAPHID_BROADCAST_CID;
     } else{        
@@ -324,17 +573,301 @@ static mbed_error_t handle_rq_init(const ctap_cmd_t* cmd)
      resp[13] = 0; // Major device version number
      resp[14] = 0; // Minor device version number
      resp[15] = 0; // Build device version number
-     /* Capabilities flag: we accept the WINK command */
+     /* Capabilities flag: we accept the WINK command, and CBOR if declared */
      resp[16] = CTAP_CAPA_WINK|CTAP_CAPA_LOCK; // Capabilities flags
+#if CONFIG_USR_LIB_CTAP_CTAP2
+     ctap_context_t *ctx = ctap_get_context();
+     if ((ctx->cbor_cmd != NULL) || (ctx->cbor_submit_cmd != NULL)) {
+         resp[16] |= CTAP_CAPA_CBOR;
+     }
+#endif
      /* Send the frame on the line */
-
-     log_printf("[CTAP][INIT] Sending back response\n");
      errcode = ctaphid_send_response((uint8_t*)&resp, sizeof(resp), curcid, CTAP_INIT|0x80);
 
 err:
     return errcode;
 }
 
+/******************************************************
+ * Vendor commands
+ */
+
+#if CONFIG_USR_LIB_CTAP_STATS || CONFIG_USR_LIB_CTAP_VENDOR_THROUGHPUT || CONFIG_USR_LIB_CTAP_TRACE || (CONFIG_USR_LIB_CTAP_VENDOR_CMDS > 0)
+/*
+ * Execute a vendor command handler in place: the request is read from the
+ * channel reassembly buffer, and the response written in the leased TX
+ * response buffer, from which it is sent.
+ */
+static mbed_error_t handle_rq_vendor_call(ctap_cmd_t* cmd, ctap_handle_vendor_t handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_context_t *ctx = ctap_get_context();
+    uint16_t bcnt = (cmd->bcnth << 8) | cmd->bcntl;
+    uint16_t resp_len = CTAPHID_MAX_PAYLOAD_SIZE;
+    /* an asynchronous backend may still be writing the response buffer */
+    uint8_t *resp = ctx->backend_busy ? NULL : ctap_tx_resp_lease();
+
+    if (resp == NULL) {
+        /* the response buffer is used by the backend (see ctap_request_ready()) */
+        CTAP_STATS_INC(busy[ctx->backend_busy ? CTAP_STATS_BUSY_BACKEND : CTAP_STATS_BUSY_RESP]);
+        handle_rq_error(cmd->cid, U2F_ERR_CHANNEL_BUSY);
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    errcode = handler(cmd->cmd & 0x7f, cmd->data, bcnt, resp, &resp_len);
+    if (errcode != MBED_ERROR_NONE || resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        log_printf("[CTAP][VENDOR] command 0x%x handling failed!\n", cmd->cmd & 0x7f);
+        ctap_tx_resp_release();
+        handle_rq_error(cmd->cid, (errcode == MBED_ERROR_INVPARAM) ? U2F_ERR_INVALID_PAR : U2F_ERR_OTHER);
+        goto err;
+    }
+    errcode = ctap_tx_resp_commit(resp_len, cmd->cid, cmd->cmd);
+err:
+    return errcode;
+}
+#endif
+
+#if CONFIG_USR_LIB_CTAP_STATS
+/*
+ * CTAPHID_VENDOR_STATS built-in command: the runtime statistics are sent
+ * back in their wire format (see CTAP_STATS_WIRE_VERSION). An optional
+ * data byte set to 1 resets them once encoded.
+ */
+static mbed_error_t ctap_vendor_stats(uint32_t metadata,
+                                      uint8_t *msg_in, uint16_t len_in,
+                                      uint8_t *resp, uint16_t *len_out)
+{
+    (void)metadata;
+    if (len_in == 1 && msg_in[0] > 1) {
+        return MBED_ERROR_INVPARAM;
+    }
+    *len_out = ctap_stats_encode(resp, *len_out);
+    if (len_in == 1 && msg_in[0] == 1) {
+        ctap_reset_stats();
+    }
+    return MBED_ERROR_NONE;
+}
+
+static mbed_error_t handle_rq_stats(ctap_cmd_t* cmd)
+{
+    return handle_rq_vendor_call(cmd, ctap_vendor_stats);
+}
+#endif
+
+#if CONFIG_USR_LIB_CTAP_VENDOR_THROUGHPUT
+/*
+ * CTAPHID_VENDOR_THROUGHPUT built-in command, to measure the USB framing
+ * throughput and latency from the host: either the request payload is
+ * sunk, its length being returned, or the requested number of bytes (an
+ * incrementing pattern) is sourced.
+ */
+static mbed_error_t ctap_vendor_throughput(uint32_t metadata,
+                                           uint8_t *msg_in, uint16_t len_in,
+                                           uint8_t *resp, uint16_t *len_out)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint16_t len;
+
+    (void)metadata;
+    switch (msg_in[0]) {
+        case CTAP_THROUGHPUT_SINK:
+            resp[0] = (len_in & 0xff00) >> 8;
+            resp[1] = (len_in & 0xff);
+            *len_out = 2;
+            break;
+        case CTAP_THROUGHPUT_SOURCE:
+            if (len_in != 3) {
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
+            }
+            len = (msg_in[1] << 8) | msg_in[2];
+            if (len > *len_out) {
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
+            }
+            for (uint16_t i = 0; i < len; ++i) {
+                resp[i] = (uint8_t)i;
+            }
+            *len_out = len;
+            break;
+        default:
+            errcode = MBED_ERROR_INVPARAM;
+            break;
+    }
+err:
+    return errcode;
+}
+
+static mbed_error_t handle_rq_throughput(ctap_cmd_t* cmd)
+{
+    return handle_rq_vendor_call(cmd, ctap_vendor_throughput);
+}
+#endif
+
+#if CONFIG_USR_LIB_CTAP_TRACE
+/*
+ * CTAPHID_VENDOR_TRACE built-in command: the trace ring snapshot (see
+ * ctap_trace_snapshot()) is sent back, to be decoded by the host.
+ */
+static mbed_error_t ctap_vendor_trace(uint32_t metadata,
+                                      uint8_t *msg_in, uint16_t len_in,
+                                      uint8_t *resp, uint16_t *len_out)
+{
+    (void)metadata;
+    (void)msg_in;
+    (void)len_in;
+    *len_out = ctap_trace_snapshot(resp, *len_out);
+    return MBED_ERROR_NONE;
+}
+
+static mbed_error_t handle_rq_trace(ctap_cmd_t* cmd)
+{
+    return handle_rq_vendor_call(cmd, ctap_vendor_trace);
+}
+#endif
+
+#if CONFIG_USR_LIB_CTAP_VENDOR_CMDS > 0
+/* vendor commands declared by the application (ctap_declare_vendor()) */
+typedef struct {
+    ctap_cmd_desc_t      desc;
+    ctap_handle_vendor_t handler;
+} ctap_vendor_cmd_t;
+
+static ctap_vendor_cmd_t ctap_vendor_cmds[CONFIG_USR_LIB_CTAP_VENDOR_CMDS];
+static uint8_t ctap_vendor_cmds_num = 0;
+
+static mbed_error_t handle_rq_vendor(ctap_cmd_t* cmd)
+{
+    for (uint8_t i = 0; i < ctap_vendor_cmds_num; ++i) {
+        if (ctap_vendor_cmds[i].desc.cmd == (cmd->cmd & 0x7f)) {
+            return handle_rq_vendor_call(cmd, ctap_vendor_cmds[i].handler);
+        }
+    }
+    return handle_rq_error(cmd->cid, U2F_ERR_INVALID_CMD);
+}
+#endif
+
+/******************************************************
+ * Commands table
+ */
+
+static const ctap_cmd_desc_t ctap_cmds[] = {
+    { CTAP_PING,   CTAP_CMD_CHANNEL|CTAP_CMD_TX_BULK, 0, CTAPHID_MAX_PAYLOAD_SIZE, handle_rq_ping, "U2F PING" },
+    /* at least the APDU header (CLA, INS, P1, P2) */
+    { CTAP_MSG,    CTAP_CMD_CHANNEL|CTAP_CMD_TX_RESP, 4, CTAPHID_MAX_PAYLOAD_SIZE, handle_rq_msg,  "U2F MSG" },
+    /* lock time, in seconds */
+    { CTAP_LOCK,   CTAP_CMD_CHANNEL, 1, 1,                        handle_rq_lock, "U2F LOCK" },
+    /* nonce, on the broadcast CID (allocation) or a channel (resync) */
+    { CTAP_INIT,   CTAP_CMD_BROADCAST|CTAP_CMD_CHANNEL, INIT_NONCE_SIZE, INIT_NONCE_SIZE, handle_rq_init, "U2F INIT" },
+    { CTAP_WINK,   CTAP_CMD_CHANNEL, 0, 0,                        handle_rq_wink, "U2F WINK" },
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    /* at least the CTAP2 command byte */
+    { CTAP_CBOR,   CTAP_CMD_CHANNEL|CTAP_CMD_TX_RESP, 1, CTAPHID_MAX_PAYLOAD_SIZE, handle_rq_cbor, "CTAP2 CBOR" },
+#endif
+    /* handled at reception, see handle_rq_cancel() */
+    { CTAP_CANCEL, CTAP_CMD_CHANNEL, 0, 0,                        NULL,           "CTAP2 CANCEL" },
+    { CTAP_SYNC,   CTAP_CMD_CHANNEL, 0, CTAPHID_MAX_PAYLOAD_SIZE, handle_rq_sync, "U2F SYNC" },
+#if CONFIG_USR_LIB_CTAP_STATS
+    /* optional reset flag */
+    { CTAP_VENDOR_STATS, CTAP_CMD_CHANNEL|CTAP_CMD_TX_RESP, 0, 1,                handle_rq_stats, "VENDOR STATS" },
+#endif
+#if CONFIG_USR_LIB_CTAP_VENDOR_THROUGHPUT
+    /* mode, and source length or sunk payload */
+    { CTAP_VENDOR_THROUGHPUT, CTAP_CMD_CHANNEL|CTAP_CMD_TX_RESP, 1, CTAPHID_MAX_PAYLOAD_SIZE, handle_rq_throughput, "VENDOR THROUGHPUT" },
+#endif
+#if CONFIG_USR_LIB_CTAP_TRACE
+    { CTAP_VENDOR_TRACE, CTAP_CMD_CHANNEL|CTAP_CMD_TX_RESP, 0, 0,                handle_rq_trace, "VENDOR TRACE" },
+#endif
+};
+
+const ctap_cmd_desc_t *ctap_cmd_lookup(uint8_t cmd)
+{
+    for (uint8_t i = 0; i < sizeof(ctap_cmds)/sizeof(ctap_cmd_desc_t); ++i) {
+        if (ctap_cmds[i].cmd == cmd) {
+            return &ctap_cmds[i];
+        }
+    }
+#if CONFIG_USR_LIB_CTAP_VENDOR_CMDS > 0
+    for (uint8_t i = 0; i < ctap_vendor_cmds_num; ++i) {
+        if (ctap_vendor_cmds[i].desc.cmd == cmd) {
+            return &ctap_vendor_cmds[i].desc;
+        }
+    }
+#endif
+    return NULL;
+}
+
+mbed_error_t ctap_cmd_register_vendor(uint8_t cmd, uint16_t min_bcnt, uint16_t max_bcnt, ctap_handle_vendor_t handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+#if CONFIG_USR_LIB_CTAP_VENDOR_CMDS > 0
+    uint8_t i;
+
+    for (i = 0; i < sizeof(ctap_cmds)/sizeof(ctap_cmd_desc_t); ++i) {
+        if (ctap_cmds[i].cmd == cmd) {
+            /* built-in command */
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+        }
+    }
+    for (i = 0; i < ctap_vendor_cmds_num; ++i) {
+        if (ctap_vendor_cmds[i].desc.cmd == cmd) {
+            break;
+        }
+    }
+    if (i == CONFIG_USR_LIB_CTAP_VENDOR_CMDS) {
+        errcode = MBED_ERROR_NOMEM;
+        goto err;
+    }
+    ctap_vendor_cmds[i].desc.cmd = cmd;
+    ctap_vendor_cmds[i].desc.flags = CTAP_CMD_CHANNEL|CTAP_CMD_TX_RESP;
+    ctap_vendor_cmds[i].desc.min_bcnt = min_bcnt;
+    ctap_vendor_cmds[i].desc.max_bcnt = max_bcnt;
+    ctap_vendor_cmds[i].desc.handler = handle_rq_vendor;
+    ctap_vendor_cmds[i].desc.name = "VENDOR";
+    ctap_vendor_cmds[i].handler = handler;
+    if (i == ctap_vendor_cmds_num) {
+        ctap_vendor_cmds_num++;
+    }
+#else
+    (void)cmd;
+    (void)min_bcnt;
+    (void)max_bcnt;
+    (void)handler;
+    errcode = MBED_ERROR_NOMEM;
+    goto err;
+#endif
+err:
+    return errcode;
+}
+
+ctap_error_code_t ctap_cmd_check(uint32_t cid, uint8_t cmd, uint16_t bcnt)
+{
+    const ctap_cmd_desc_t *desc;
+
+    if ((cmd & 0x80) == 0) {
+        return U2F_ERR_INVALID_PAR;
+    }
+    desc = ctap_cmd_lookup(cmd & 0x7f);
+    if (desc == NULL) {
+        log_printf("[CTAPHID] Unkown cmd %x\n", cmd & 0x7f);
+        return U2F_ERR_INVALID_CMD;
+    }
+    if (cid == CTAPHID_BROADCAST_CID) {
+        if (!(desc->flags & CTAP_CMD_BROADCAST)) {
+            log_printf("[CTAPHID] %s not allowed on the broadcast CID\n", desc->name);
+            return U2F_ERR_INVALID_CHANNEL;
+        }
+    } else if (!(desc->flags & CTAP_CMD_CHANNEL)) {
+        return U2F_ERR_INVALID_CHANNEL;
+    }
+    if (bcnt < desc->min_bcnt || bcnt > desc->max_bcnt) {
+        log_printf("[CTAPHID] %s: invalid BCNT %d\n", desc->name, bcnt);
+        return U2F_ERR_INVALID_LEN;
+    }
+    return U2F_ERR_NONE;
+}
+
 
 
 
@@ -343,11 +876,38 @@ err:
  * Requests dispatcher
  */
 
+/*
+ * The TX resources of the request response are available: room in the TX
+ * queue, and the buffer its response is built in. Otherwise the request is
+ * left complete in the dispatch queue, and dispatched once the previous
+ * responses have been sent (see ctap_exec()): a handler never waits for
+ * the IN EP.
+ */
+bool ctap_request_ready(const ctap_cmd_t *cmd)
+{
+    ctap_context_t *ctx = ctap_get_context();
+    const ctap_cmd_desc_t *desc = ctap_cmd_lookup(cmd->cmd & 0x7f);
+    uint8_t flags = (desc != NULL) ? desc->flags : 0;
+
+    /* while the asynchronous backend holds the response buffer, the request
+     * is answered busy, which only needs room in the queue */
+    return ctap_tx_ready((flags & CTAP_CMD_TX_BULK) != 0,
+                         ((flags & CTAP_CMD_TX_RESP) != 0) && !ctx->backend_busy);
+}
+
+/* the oldest complete request can be dispatched */
+bool ctap_dispatch_ready(void)
+{
+    ctap_cmd_t *cmd = ctap_cid_get_chan_complete_cmd();
+
+    return (cmd != NULL) && ctap_request_ready(cmd);
+}
+
 mbed_error_t ctap_handle_request(ctap_cmd_t *ctap_cmd)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     ctap_context_t *ctx = ctap_get_context();
-    uint8_t cmd;
+    const ctap_cmd_desc_t *desc;
     if (ctap_cmd == NULL) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
@@ -358,62 +918,26 @@ mbed_error_t ctap_handle_request(ctap_cmd_t *ctap_cmd)
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    if((ctx->locked == true) && (ctx->curr_cid != ctap_cmd->cid)){
-        errcode = handle_rq_error(ctap_cmd->cid, U2F_ERR_CHANNEL_BUSY);
-  	return errcode;
+    if (ctx->locked) {
+        /* command reassembled before the lock has been taken */
+        uint64_t now;
+        if (ctap_systick_ms(&now) == SYS_E_DONE &&
+            ctap_lock_rejects(ctx, ctap_cmd->cid, now)) {
+            CTAP_STATS_INC(busy[CTAP_STATS_BUSY_LOCK]);
+            errcode = handle_rq_error(ctap_cmd->cid, U2F_ERR_CHANNEL_BUSY);
+            goto err;
+        }
     }
     set_u32_with_membarrier(&(ctx->curr_cid), ctap_cmd->cid);
 
     /* cleaning bit 7 (always set, see above) */
-    cmd = ctap_cmd->cmd & 0x7f;
-    switch (cmd) {
-        case CTAP_INIT:
-        {
-            log_printf("[CTAPHID] received U2F INIT\n");
-            errcode = handle_rq_init(ctap_cmd);
-            break;
-        }
-        case CTAP_PING:
-        {
-            log_printf("[CTAPHID] received U2F PING\n");
-            errcode = handle_rq_ping(ctap_cmd);
-            break;
-        }
-        case CTAP_MSG:
-        {
-            log_printf("[CTAPHID] received U2F MSG\n");
-            errcode = handle_rq_msg(ctap_cmd);
-            break;
-        }
-        case CTAP_ERROR:
-        {
-            log_printf("[CTAPHID] received U2F ERROR\n");
-            errcode = handle_rq_error(ctap_cmd->cid, U2F_ERR_INVALID_CMD);
-            break;
-        }
-        case CTAP_WINK:
-        {
-            log_printf("[CTAPHID] received U2F WINK\n");
-            errcode = handle_rq_wink(ctap_cmd);
-            break;
-        }
-        case CTAP_LOCK:
-        {
-            log_printf("[CTAPHID] received U2F LOCK\n");
-            errcode = handle_rq_lock(ctap_cmd);
-            break;
-        }
-        case CTAP_SYNC:
-        {
-            log_printf("[CTAPHID] received U2F SYNC\n");
-            errcode = handle_rq_sync(ctap_cmd);
-            break;
-        }
-        default:
-            log_printf("[CTAPHID] Unkown cmd %d\n", ctap_cmd);
-            errcode = handle_rq_error(ctap_cmd->cid, U2F_ERR_INVALID_CMD);
-            break;
+    desc = ctap_cmd_lookup(ctap_cmd->cmd & 0x7f);
+    if (desc == NULL || desc->handler == NULL) {
+        log_printf("[CTAPHID] Unkown cmd %d\n", ctap_cmd->cmd & 0x7f);
+        errcode = handle_rq_error(ctap_cmd->cid, U2F_ERR_INVALID_CMD);
+        goto err;
     }
+    errcode = desc->handler(ctap_cmd);
 err:
     return errcode;
 }
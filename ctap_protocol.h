@@ -15,13 +15,13 @@
 #define CTAP_PROTOCOL_H_
 #include "autoconf.h"
 #include "libc/types.h"
+#include "api/libctap.h"
 
 /*
- * FIXME to define properly:
  * range of ctaphid_cmd_id for vendor specific commands
  */
-#define CTAPHID_VENDOR_FIRST 42
-#define CTAPHID_VENDOR_LAST  52
+#define CTAPHID_VENDOR_FIRST 0x40
+#define CTAPHID_VENDOR_LAST  0x7f
 
 #define CTAPHID_BROADCAST_CID 0xffffffff
 
@@ -30,6 +30,9 @@
 
 #define CTAPHID_MAX_PAYLOAD_SIZE 7609
 
+/* CTAP2 status (first byte of a CBOR response) of a cancelled request */
+#define CTAP2_ERR_KEEPALIVE_CANCEL 0x2d
+
 /*****************************************
  * About command
  */
@@ -45,8 +48,36 @@ typedef enum {
     CTAP_KEEPALIVE = 0x3b, /* FIDO2 only */
     CTAP_SYNC      = 0x3c, /* FIDO2 only */
     CTAP_ERROR     = 0x3f, 
+    CTAP_VENDOR_STATS = CTAPHID_VENDOR_FIRST, /* runtime statistics, see CTAP_STATS_WIRE_VERSION */
+    CTAP_VENDOR_THROUGHPUT = 0x41, /* throughput test, see handle_rq_throughput() */
+    CTAP_VENDOR_TRACE      = 0x42, /* trace ring snapshot (see ctap_trace.h) */
 } ctaphid_cmd_id_t;
 
+/*
+ * CTAPHID_VENDOR_STATS response, independent of the ctap_stats_t memory
+ * layout:
+ *   - the wire format version (1 byte),
+ *   - the arrays sizes CTAP_STATS_CMD_NUM, CTAP_STATS_ERR_NUM,
+ *     CTAP_STATS_BUSY_NUM, CTAP_STATS_BACKEND_NUM and
+ *     CTAP_STATS_HIST_BUCKETS (1 byte each),
+ *   - the counters, as big endian u32, in the ctap_stats_t order:
+ *     frames_rx, frames_tx, rx_stalls, tx_drops, evictions,
+ *     cid_pool_misses, cmds[], errors[], busy[], then backend_us[][]
+ *     (the MSG histogram, then the CBOR one).
+ * The version is bumped when scalar counters are added or reordered, the
+ * arrays being sized by the header.
+ */
+#define CTAP_STATS_WIRE_VERSION 1
+#define CTAP_STATS_WIRE_HDR_LEN 6
+#define CTAP_STATS_WIRE_SCALARS 6
+#define CTAP_STATS_WIRE_LEN     (CTAP_STATS_WIRE_HDR_LEN + 4 * (CTAP_STATS_WIRE_SCALARS + \
+                                 CTAP_STATS_CMD_NUM + CTAP_STATS_ERR_NUM + CTAP_STATS_BUSY_NUM + \
+                                 CTAP_STATS_BACKEND_NUM * CTAP_STATS_HIST_BUCKETS))
+
+/* CTAPHID_VENDOR_THROUGHPUT modes (first request byte) */
+#define CTAP_THROUGHPUT_SINK   0 /* payload discarded, its length returned (2 bytes, big endian) */
+#define CTAP_THROUGHPUT_SOURCE 1 /* followed by the length (2 bytes, big endian) of the returned pattern */
+
 
 /*
  * Considering Full Speed devices, the FIDO Alliance define
@@ -66,10 +97,10 @@ typedef struct __packed {
     uint8_t  cmd;
     uint8_t  bcnth;
     uint8_t  bcntl;
-    uint8_t  data[CTAPHID_MAX_PAYLOAD_SIZE]; /* data is a blob here, but is a structured content, depending
-                           on the cmd value. It can be encoded using APDU format or CBOR
-                           format.
-CAUTION: the CTAPHID c*/
+    uint8_t  *data; /* data is a blob here, but is a structured content, depending
+                       on the cmd value. It can be encoded using APDU format or CBOR
+                       format. It is leased from the reassembly buffers pool (see
+                       ctap_pool.h) and sized from BCNT: NULL when BCNT is 0. */
 } ctap_cmd_t;
 
 
@@ -96,6 +127,10 @@ typedef struct __packed {
     /* differenciated resp here */
 } ctap_seq_header_t;
 
+/* payload bytes carried by initialization and continuation frames */
+#define CTAPHID_INIT_DATA_LEN (CTAPHID_FRAME_MAXLEN - sizeof(ctap_init_header_t))
+#define CTAPHID_SEQ_DATA_LEN  (CTAPHID_FRAME_MAXLEN - sizeof(ctap_seq_header_t))
+
 typedef struct __packed {
     ctap_init_header_t header;
     uint8_t data[64];
@@ -167,11 +202,66 @@ typedef enum {
 } ctap_msg_ins_t;
 
 
+/******************************************
+ * About the commands table
+ */
+
+/* the command is accepted on the broadcast CID */
+#define CTAP_CMD_BROADCAST 0x1
+/* the command is accepted on an allocated channel */
+#define CTAP_CMD_CHANNEL   0x2
+/* the response is written in the leased TX response buffer */
+#define CTAP_CMD_TX_RESP   0x4
+/* the response may be copied in the TX bulk buffer */
+#define CTAP_CMD_TX_BULK   0x8
+
+typedef mbed_error_t (*ctap_rq_handler_t)(ctap_cmd_t *cmd);
+
+/*
+ * Command descriptor: what the transport layer checks on the initialization
+ * frame of a request (before any reassembly buffer is leased), and the
+ * handler of the fully reassembled request. A NULL handler means that the
+ * command is handled at reception (CANCEL).
+ */
+typedef struct {
+    uint8_t           cmd;      /* command identifier, without bit 7 */
+    uint8_t           flags;    /* CTAP_CMD_BROADCAST | CTAP_CMD_CHANNEL */
+    uint16_t          min_bcnt;
+    uint16_t          max_bcnt;
+    ctap_rq_handler_t handler;
+    const char       *name;
+} ctap_cmd_desc_t;
+
+const ctap_cmd_desc_t *ctap_cmd_lookup(uint8_t cmd);
+
+mbed_error_t ctap_cmd_register_vendor(uint8_t cmd, uint16_t min_bcnt, uint16_t max_bcnt, ctap_handle_vendor_t handler);
+
+/*
+ * Check a request header against its descriptor. Return U2F_ERR_NONE if the
+ * request can be received, or the CTAPHID error to respond otherwise.
+ */
+ctap_error_code_t ctap_cmd_check(uint32_t cid, uint8_t cmd, uint16_t bcnt);
+
 /*
  * Hande U2F commands
  */
 mbed_error_t ctap_handle_request(ctap_cmd_t *cmd);
 
+bool ctap_request_ready(const ctap_cmd_t *cmd);
+
+bool ctap_dispatch_ready(void);
+
 mbed_error_t handle_rq_error(uint32_t cid, uint8_t error);
 
+mbed_error_t ctap_backend_handle_completion(void);
+
+uint64_t ctap_backend_keepalive(uint64_t now);
+
+mbed_error_t handle_rq_cancel(uint32_t cid);
+
+/*
+ * Fragment and send a response to the host
+ */
+mbed_error_t ctaphid_send_response(const uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd);
+
 #endif/*!CTAP_PROTOCOL_H_*/
@@ -0,0 +1,148 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "api/libctap.h"
+#include "ctap_protocol.h"
+#include "ctap_stats.h"
+
+#if CONFIG_USR_LIB_CTAP_STATS
+
+ctap_stats_t ctap_stats = { 0 };
+
+/* requests accepted on their first frame, per command */
+void ctap_stats_cmd(uint8_t cmd)
+{
+    uint8_t idx;
+
+    switch (cmd & 0x7f) {
+        case CTAP_PING:   idx = CTAP_STATS_CMD_PING; break;
+        case CTAP_MSG:    idx = CTAP_STATS_CMD_MSG; break;
+        case CTAP_LOCK:   idx = CTAP_STATS_CMD_LOCK; break;
+        case CTAP_INIT:   idx = CTAP_STATS_CMD_INIT; break;
+        case CTAP_WINK:   idx = CTAP_STATS_CMD_WINK; break;
+        case CTAP_CBOR:   idx = CTAP_STATS_CMD_CBOR; break;
+        case CTAP_CANCEL: idx = CTAP_STATS_CMD_CANCEL; break;
+        case CTAP_SYNC:   idx = CTAP_STATS_CMD_SYNC; break;
+        default:
+            if ((cmd & 0x7f) < CTAPHID_VENDOR_FIRST) {
+                return;
+            }
+            idx = CTAP_STATS_CMD_VENDOR;
+            break;
+    }
+    ctap_stats.cmds[idx]++;
+}
+
+/* error responses, per CTAPHID error code */
+void ctap_stats_error(uint8_t error)
+{
+    if (error >= (CTAP_STATS_ERR_NUM - 1)) {
+        error = CTAP_STATS_ERR_NUM - 1;
+    }
+    ctap_stats.errors[error]++;
+}
+
+/* backend execution time of a MSG or CBOR request */
+void ctap_stats_backend(uint8_t cmd, uint64_t us)
+{
+    uint8_t bucket = 0;
+
+    while (us != 0 && bucket < (CTAP_STATS_HIST_BUCKETS - 1)) {
+        us >>= 1;
+        bucket++;
+    }
+    ctap_stats.backend_us[(cmd == CTAP_CBOR) ? CTAP_STATS_BACKEND_CBOR : CTAP_STATS_BACKEND_MSG][bucket]++;
+}
+
+static uint8_t *ctap_stats_put(uint8_t *p, const uint32_t *counters, uint16_t num)
+{
+    for (uint16_t i = 0; i < num; ++i) {
+        p[0] = (counters[i] >> 24) & 0xff;
+        p[1] = (counters[i] >> 16) & 0xff;
+        p[2] = (counters[i] >> 8) & 0xff;
+        p[3] = counters[i] & 0xff;
+        p += 4;
+    }
+    return p;
+}
+
+/*
+ * Encode the statistics in their wire format (see CTAP_STATS_WIRE_VERSION).
+ * Return the encoded size, 0 if buf is too small.
+ */
+uint16_t ctap_stats_encode(uint8_t *buf, uint16_t len)
+{
+    uint8_t *p = &buf[CTAP_STATS_WIRE_HDR_LEN];
+
+    if (len < CTAP_STATS_WIRE_LEN) {
+        return 0;
+    }
+    buf[0] = CTAP_STATS_WIRE_VERSION;
+    buf[1] = CTAP_STATS_CMD_NUM;
+    buf[2] = CTAP_STATS_ERR_NUM;
+    buf[3] = CTAP_STATS_BUSY_NUM;
+    buf[4] = CTAP_STATS_BACKEND_NUM;
+    buf[5] = CTAP_STATS_HIST_BUCKETS;
+    p = ctap_stats_put(p, &ctap_stats.frames_rx, 1);
+    p = ctap_stats_put(p, &ctap_stats.frames_tx, 1);
+    p = ctap_stats_put(p, &ctap_stats.rx_stalls, 1);
+    p = ctap_stats_put(p, &ctap_stats.tx_drops, 1);
+    p = ctap_stats_put(p, &ctap_stats.evictions, 1);
+    p = ctap_stats_put(p, &ctap_stats.cid_pool_misses, 1);
+    p = ctap_stats_put(p, ctap_stats.cmds, CTAP_STATS_CMD_NUM);
+    p = ctap_stats_put(p, ctap_stats.errors, CTAP_STATS_ERR_NUM);
+    p = ctap_stats_put(p, ctap_stats.busy, CTAP_STATS_BUSY_NUM);
+    for (uint8_t i = 0; i < CTAP_STATS_BACKEND_NUM; ++i) {
+        p = ctap_stats_put(p, ctap_stats.backend_us[i], CTAP_STATS_HIST_BUCKETS);
+    }
+    return CTAP_STATS_WIRE_LEN;
+}
+
+#endif
+
+mbed_error_t ctap_get_stats(ctap_stats_t *stats)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (stats == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USR_LIB_CTAP_STATS
+    memcpy(stats, &ctap_stats, sizeof(ctap_stats_t));
+#else
+    errcode = MBED_ERROR_UNSUPORTED;
+#endif
+err:
+    return errcode;
+}
+
+void ctap_reset_stats(void)
+{
+#if CONFIG_USR_LIB_CTAP_STATS
+    memset(&ctap_stats, 0, sizeof(ctap_stats_t));
+#endif
+}
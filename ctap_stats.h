@@ -0,0 +1,76 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef CTAP_STATS_H_
+#define CTAP_STATS_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "api/libctap.h"
+
+/*
+ * Runtime statistics (see ctap_get_stats()).
+ *
+ * Each counter has a single writer at a time: the engine, or the USB
+ * triggers for the counters updated under the TX lock (frames sent) or
+ * while the OUT EP is not armed (RX stalls). Counters are plain 32 bits
+ * words, wrapping around.
+ */
+
+#if CONFIG_USR_LIB_CTAP_STATS
+
+extern ctap_stats_t ctap_stats;
+
+#define CTAP_STATS_INC(counter) (ctap_stats.counter++)
+
+void ctap_stats_cmd(uint8_t cmd);
+
+void ctap_stats_error(uint8_t error);
+
+void ctap_stats_backend(uint8_t cmd, uint64_t us);
+
+uint16_t ctap_stats_encode(uint8_t *buf, uint16_t len);
+
+#else
+
+#define CTAP_STATS_INC(counter) do { } while (0)
+
+static inline void ctap_stats_cmd(uint8_t cmd)
+{
+    (void)cmd;
+}
+
+static inline void ctap_stats_error(uint8_t error)
+{
+    (void)error;
+}
+
+static inline void ctap_stats_backend(uint8_t cmd, uint64_t us)
+{
+    (void)cmd;
+    (void)us;
+}
+
+#endif
+
+#endif/*!CTAP_STATS_H_*/
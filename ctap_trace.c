@@ -0,0 +1,116 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "ctap_trace.h"
+
+#if CONFIG_USR_LIB_CTAP_TRACE
+
+static struct {
+    ctap_trace_rec_t  recs[CTAP_TRACE_RECORDS];
+    volatile uint32_t head;  /* records written since startup */
+    volatile uint32_t clock; /* engine clock (us), the records timestamp */
+    uint32_t          sleep_head; /* head when the engine went to sleep */
+    bool              asleep;
+} trace = { 0 };
+
+void ctap_trace(uint8_t event, uint32_t cid, uint8_t arg8, uint16_t arg16)
+{
+    /* reserve the slot, the writer may be preempted by a trigger */
+    uint32_t idx = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+    ctap_trace_rec_t *rec = &trace.recs[idx % CTAP_TRACE_RECORDS];
+
+    rec->ts = trace.clock;
+    rec->cid = cid;
+    rec->event = event;
+    rec->arg8 = arg8;
+    rec->arg16 = arg16;
+}
+
+/* the engine is about to sleep, waiting for an event */
+void ctap_trace_sleep(void)
+{
+    trace.sleep_head = trace.head;
+    trace.asleep = true;
+}
+
+/*
+ * Engine systick read: the clock of the next records. The records written
+ * by the triggers while the engine was sleeping are stamped with it, their
+ * events having woken the engine up. Called from the engine only, whose
+ * accesses to the records are thus not interleaved with the triggers ones.
+ */
+void ctap_trace_clock(uint64_t us)
+{
+    trace.clock = (uint32_t)us;
+    if (trace.asleep) {
+        uint32_t head = trace.head;
+        uint32_t from = trace.sleep_head;
+
+        if ((head - from) > CTAP_TRACE_RECORDS) {
+            from = head - CTAP_TRACE_RECORDS;
+        }
+        for (uint32_t i = from; i != head; ++i) {
+            trace.recs[i % CTAP_TRACE_RECORDS].ts = trace.clock;
+        }
+        trace.asleep = false;
+    }
+}
+
+/*
+ * Copy the snapshot header and the most recent records that fit in buf,
+ * oldest first. Return the snapshot size, 0 if buf is too small.
+ */
+uint16_t ctap_trace_snapshot(uint8_t *buf, uint16_t len)
+{
+    ctap_trace_hdr_t hdr;
+    uint32_t head = trace.head;
+    uint32_t count = head;
+
+    if (buf == NULL || len < sizeof(ctap_trace_hdr_t)) {
+        return 0;
+    }
+    if (count > CTAP_TRACE_RECORDS) {
+        count = CTAP_TRACE_RECORDS;
+    }
+    if (count > ((len - sizeof(ctap_trace_hdr_t)) / sizeof(ctap_trace_rec_t))) {
+        count = (len - sizeof(ctap_trace_hdr_t)) / sizeof(ctap_trace_rec_t);
+    }
+    hdr.magic = CTAP_TRACE_MAGIC;
+    hdr.version = CTAP_TRACE_VERSION;
+    hdr.rec_size = sizeof(ctap_trace_rec_t);
+    hdr.count = count;
+    hdr.written = head;
+    memcpy(buf, &hdr, sizeof(hdr));
+    buf += sizeof(hdr);
+    for (uint32_t i = head - count; i != head; ++i) {
+        memcpy(buf, &trace.recs[i % CTAP_TRACE_RECORDS], sizeof(ctap_trace_rec_t));
+        buf += sizeof(ctap_trace_rec_t);
+    }
+    return sizeof(ctap_trace_hdr_t) + count * sizeof(ctap_trace_rec_t);
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef CTAP_TRACE_H_
+#define CTAP_TRACE_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "libc/syscall.h"
+
+/*
+ * Binary trace ring (CONFIG_USR_LIB_CTAP_TRACE).
+ *
+ * Instead of formatting log strings in the frames handling paths, which
+ * changes their timing, fixed size records are written in a ring, in a few
+ * stores. The ring is read back as a snapshot (see ctap_trace_snapshot(),
+ * or the CTAPHID_VENDOR_TRACE command) and decoded offline (see
+ * host/ctap_trace_decode.c).
+ *
+ * Records may be written from the engine and from the USB triggers (ISR):
+ * their slot is reserved with an atomic increment of the ring head.
+ *
+ * Reading the systick is a syscall: records are not timestamped on their
+ * own, they carry the engine clock, cached on each systick read the engine
+ * makes anyway (ctap_systick_ms(), at least once per received frame). The
+ * records written by the triggers while the engine sleeps are stamped with
+ * the engine clock at its wake up, i.e. when their event is handled.
+ */
+
+#define CTAP_TRACE_RECORDS CONFIG_USR_LIB_CTAP_TRACE_RECORDS
+
+/* snapshot header magic, "CTRC" */
+#define CTAP_TRACE_MAGIC   0x43525443
+#define CTAP_TRACE_VERSION 1
+
+typedef enum {
+    CTAP_TRACE_RX_FRAME = 1,   /* OUT report received, arg8: CMD or SEQ, arg16: size */
+    CTAP_TRACE_RX_STALL,       /* RX ring full, OUT EP left NAK */
+    CTAP_TRACE_DISPATCH,       /* complete request dispatched, arg8: CMD, arg16: BCNT */
+    CTAP_TRACE_TX_QUEUE,       /* response queued, arg8: CMD, arg16: BCNT */
+    CTAP_TRACE_TX_FRAME,       /* IN report pushed, arg8: CMD or SEQ, arg16: payload sent */
+    CTAP_TRACE_TX_SENT,        /* IN report sent event */
+    CTAP_TRACE_TX_DROP,        /* response dropped, full TX queue */
+    CTAP_TRACE_TX_ABORT,       /* streamed response aborted, arg16: payload sent */
+    CTAP_TRACE_ERROR,          /* error response, arg8: CTAPHID error */
+    CTAP_TRACE_CID_NEW,        /* channel allocated (CID is the new channel) */
+    CTAP_TRACE_CID_EVICT,      /* channel evicted */
+    CTAP_TRACE_BACKEND_SUBMIT, /* request submitted to the backend, arg8: CMD, arg16: BCNT */
+    CTAP_TRACE_BACKEND_DONE,   /* backend completion, arg8: failed, arg16: response length */
+    CTAP_TRACE_CANCEL,         /* CTAPHID_CANCEL received */
+    CTAP_TRACE_LOCK,           /* CTAPHID_LOCK, arg16: seconds */
+    CTAP_TRACE_EVENTS
+} ctap_trace_event_t;
+
+/* little endian on the targets (and on the host decoder) */
+typedef struct __packed {
+    uint32_t ts;     /* engine clock (us), low 32 bits */
+    uint32_t cid;
+    uint8_t  event;
+    uint8_t  arg8;
+    uint16_t arg16;
+} ctap_trace_rec_t;
+
+/* snapshot header, followed by count records, oldest first */
+typedef struct __packed {
+    uint32_t magic;
+    uint8_t  version;
+    uint8_t  rec_size;
+    uint16_t count;
+    uint32_t written;  /* records written since startup (written - count lost) */
+} ctap_trace_hdr_t;
+
+#if CONFIG_USR_LIB_CTAP_TRACE
+
+void ctap_trace(uint8_t event, uint32_t cid, uint8_t arg8, uint16_t arg16);
+
+void ctap_trace_clock(uint64_t us);
+
+void ctap_trace_sleep(void);
+
+uint16_t ctap_trace_snapshot(uint8_t *buf, uint16_t len);
+
+# define CTAP_TRACE(event, cid, arg8, arg16) ctap_trace((event), (cid), (arg8), (arg16))
+# define CTAP_TRACE_CLOCK(us)                ctap_trace_clock(us)
+# define CTAP_TRACE_SLEEP()                  ctap_trace_sleep()
+#else
+# define CTAP_TRACE(event, cid, arg8, arg16)
+# define CTAP_TRACE_CLOCK(us)
+# define CTAP_TRACE_SLEEP()
+#endif
+
+/*
+ * Engine systick read (ms). In trace builds, the systick is read in us
+ * instead, and becomes the timestamp of the next records.
+ */
+static inline e_syscall_ret ctap_systick_ms(uint64_t *ms)
+{
+#if CONFIG_USR_LIB_CTAP_TRACE
+    uint64_t us;
+    e_syscall_ret ret = sys_get_systick(&us, PREC_MICRO);
+
+    if (ret == SYS_E_DONE) {
+        ctap_trace_clock(us);
+        *ms = us / 1000;
+    }
+    return ret;
+#else
+    return sys_get_systick(ms, PREC_MILLI);
+#endif
+}
+
+#endif/*!CTAP_TRACE_H_*/
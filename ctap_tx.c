@@ -0,0 +1,505 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "libc/sync.h"
+#include "libusbhid.h"
+#include "ctap_control.h"
+#include "ctap_tx.h"
+#include "ctap_stats.h"
+#include "ctap_trace.h"
+#include "ctap_capture.h"
+
+static struct {
+    ctap_tx_msg_t      msgs[CTAP_TX_QUEUE_DEPTH];
+    volatile uint32_t  head;  /* messages queued (engine side) */
+    volatile uint32_t  tail;  /* messages fully sent (pump side) */
+    volatile bool      bulk_busy;
+    volatile bool      resp_busy;
+    /* response buffer bytes written by the backend: the frames are only
+     * built once their payload is available (streamed responses) */
+    volatile uint16_t  resp_avail;
+    volatile bool      resp_aborted;
+    volatile uint32_t  lock;
+    /* frame in flight, must not be modified before it is sent */
+    uint8_t            frame[CTAPHID_FRAME_MAXLEN];
+    uint8_t            bulk[CTAPHID_MAX_PAYLOAD_SIZE];
+    uint8_t            resp[CTAPHID_MAX_PAYLOAD_SIZE];
+} tx = { 0 };
+
+
+/* head and tail run modulo twice the queue depth, so that a full queue is
+ * told apart from an empty one, whatever the depth */
+#define CTAP_TX_WRAP (2 * CTAP_TX_QUEUE_DEPTH)
+
+static inline uint32_t ctap_tx_next(uint32_t idx)
+{
+    return (idx + 1) % CTAP_TX_WRAP;
+}
+
+static inline uint32_t ctap_tx_pending(void)
+{
+    return (tx.head + CTAP_TX_WRAP - tx.tail) % CTAP_TX_WRAP;
+}
+
+bool ctap_tx_idle(void)
+{
+    return (ctap_tx_pending() == 0);
+}
+
+/* room for a single frame message, i.e. ctap_tx_enqueue() would not drop it */
+bool ctap_tx_has_room(void)
+{
+    return (ctap_tx_pending() < CTAP_TX_QUEUE_DEPTH);
+}
+
+/*
+ * Build the next frame of the message in the TX frame buffer: the header is
+ * written in place, the payload slice is copied behind it, and only the tail
+ * of the last frame is padded.
+ */
+static void ctap_tx_build_frame(ctap_tx_msg_t *msg)
+{
+    uint16_t chunk;
+    uint16_t hdr_len;
+    uint16_t max_len;
+
+    if (msg->raw) {
+        memcpy(&tx.frame[0], &msg->inline_data[0], CTAPHID_FRAME_MAXLEN);
+        msg->started = true;
+        msg->idx = msg->len;
+        return;
+    }
+    if (!msg->started) {
+        /* first chunk: initialization frame */
+        ctap_init_header_t *init_hdr = (ctap_init_header_t*)&tx.frame[0];
+        init_hdr->cid = msg->cid;
+        init_hdr->cmd = msg->cmd;
+        init_hdr->bcnth = (msg->len & 0xff00) >> 8;
+        init_hdr->bcntl = (msg->len & 0xff);
+        hdr_len = sizeof(ctap_init_header_t);
+        max_len = CTAPHID_INIT_DATA_LEN;
+        msg->started = true;
+    } else {
+        /* successive chunks: continuation frames */
+        ctap_seq_header_t *seq_hdr = (ctap_seq_header_t*)&tx.frame[0];
+        seq_hdr->cid = msg->cid;
+        seq_hdr->seq = msg->seq++;
+        hdr_len = sizeof(ctap_seq_header_t);
+        max_len = CTAPHID_SEQ_DATA_LEN;
+    }
+    chunk = max_len;
+    if (chunk >= (msg->len - msg->idx)) {
+        chunk = msg->len - msg->idx;
+        /* padding to mpsize */
+        memset(&tx.frame[hdr_len + chunk], 0, max_len - chunk);
+    }
+    if (chunk != 0) {
+        memcpy(&tx.frame[hdr_len], &msg->data[msg->idx], chunk);
+    }
+    msg->idx += chunk;
+}
+
+/* the payload of the next frame of the message is available */
+static inline bool ctap_tx_frame_ready(const ctap_tx_msg_t *msg)
+{
+    uint16_t needed = msg->started ? CTAPHID_SEQ_DATA_LEN : CTAPHID_INIT_DATA_LEN;
+
+    if (!msg->resp) {
+        return true;
+    }
+    if (needed > (msg->len - msg->idx)) {
+        needed = msg->len - msg->idx;
+    }
+    return (tx.resp_avail >= (msg->idx + needed));
+}
+
+/* there is something to do for the pump: drop an aborted response or send a frame */
+static inline bool ctap_tx_pump_needed(const ctap_context_t *ctx)
+{
+    if (ctap_tx_pending() == 0) {
+        return false;
+    }
+    const ctap_tx_msg_t *msg = &tx.msgs[tx.tail % CTAP_TX_QUEUE_DEPTH];
+    if (msg->resp && tx.resp_aborted) {
+        return true;
+    }
+    return (ctx->report_sent && ctap_tx_frame_ready(msg));
+}
+
+/*
+ * Push the next frame of the head message, if the previous frame has been
+ * sent and, for a streamed response, if its payload has been produced.
+ * Called from the engine, from usbhid_report_sent_trigger() and from the
+ * response producer, all being serialized through the TX lock.
+ */
+void ctap_tx_pump(void)
+{
+    ctap_context_t *ctx = ctap_get_context();
+
+    do {
+        if (!mutex_trylock(&tx.lock)) {
+            /* the other side is pumping, it will check for our event */
+            return;
+        }
+        ctap_tx_msg_t *msg = &tx.msgs[tx.tail % CTAP_TX_QUEUE_DEPTH];
+        if (ctap_tx_pending() != 0 && msg->resp && tx.resp_aborted) {
+            /* the producer failed: the rest of the response is dropped */
+            log_printf("[CTAPHID] CID 0x%x: response aborted (%d/%d)\n", msg->cid, msg->idx, msg->len);
+            CTAP_TRACE(CTAP_TRACE_TX_ABORT, msg->cid, msg->cmd, msg->idx);
+            if (msg->started) {
+                usbhid_response_done(ctap_get_usbhid_handler());
+            }
+            set_bool_with_membarrier(&(tx.resp_aborted), false);
+            set_bool_with_membarrier(&(tx.resp_busy), false);
+            set_u32_with_membarrier(&(tx.tail), ctap_tx_next(tx.tail));
+        } else if (ctx->report_sent && ctap_tx_pending() != 0 && ctap_tx_frame_ready(msg)) {
+            ctap_tx_build_frame(msg);
+            set_bool_with_membarrier(&(ctx->report_sent), false);
+            CTAP_TRACE(CTAP_TRACE_TX_FRAME, msg->cid, tx.frame[4], msg->idx);
+            CTAP_CAPTURE(CTAP_CAPTURE_IN, &tx.frame[0], CTAPHID_FRAME_MAXLEN);
+            usbhid_send_response(ctap_get_usbhid_handler(), &tx.frame[0], CTAPHID_FRAME_MAXLEN);
+            CTAP_STATS_INC(frames_tx);
+            if (msg->started && msg->idx >= msg->len) {
+                /* message fully sent */
+                usbhid_response_done(ctap_get_usbhid_handler());
+                if (msg->bulk) {
+                    set_bool_with_membarrier(&(tx.bulk_busy), false);
+                }
+                if (msg->resp) {
+                    set_bool_with_membarrier(&(tx.resp_busy), false);
+                }
+                set_u32_with_membarrier(&(tx.tail), ctap_tx_next(tx.tail));
+            }
+        }
+        mutex_unlock(&tx.lock);
+        /* the report may have been sent (or the payload produced) while we
+         * were holding the lock */
+    } while (ctap_tx_pump_needed(ctx));
+}
+
+/* a new message would not fit: the queue is full, or the buffer it needs
+ * is still being sent from */
+static inline bool ctap_tx_blocked(bool need_bulk, bool need_resp)
+{
+    return (ctap_tx_pending() >= CTAP_TX_QUEUE_DEPTH) ||
+           (need_bulk && tx.bulk_busy) || (need_resp && tx.resp_busy);
+}
+
+/*
+ * Room for a new message, and the bulk or response buffer free if needed.
+ * Nothing waits for room: the engine only dispatches a request once the
+ * TX resources of its response are available (see ctap_request_ready()).
+ */
+bool ctap_tx_ready(bool need_bulk, bool need_resp)
+{
+    return !ctap_tx_blocked(need_bulk, need_resp);
+}
+
+/*
+ * Single frame response fast path: when nothing is queued and the IN EP is
+ * ready, the frame is built and sent at once instead of being queued.
+ * Return false if the response has to be queued.
+ */
+static bool ctap_tx_send_direct(const uint8_t *resp, uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    ctap_context_t *ctx = ctap_get_context();
+    ctap_init_header_t *init_hdr = (ctap_init_header_t*)&tx.frame[0];
+
+    if (ctap_tx_pending() != 0 || !ctx->report_sent || !mutex_trylock(&tx.lock)) {
+        return false;
+    }
+    /* checked again under the lock, a trigger may have been executed */
+    if (ctap_tx_pending() != 0 || !ctx->report_sent) {
+        mutex_unlock(&tx.lock);
+        return false;
+    }
+    init_hdr->cid = cid;
+    init_hdr->cmd = cmd;
+    init_hdr->bcnth = 0;
+    init_hdr->bcntl = (uint8_t)resp_len;
+    /* constant size padding first, cheaper than a variable size one */
+    memset(&tx.frame[sizeof(ctap_init_header_t)], 0, CTAPHID_INIT_DATA_LEN);
+    if (resp_len != 0) {
+        memcpy(&tx.frame[sizeof(ctap_init_header_t)], resp, resp_len);
+    }
+    set_bool_with_membarrier(&(ctx->report_sent), false);
+    CTAP_TRACE(CTAP_TRACE_TX_QUEUE, cid, cmd, resp_len);
+    CTAP_TRACE(CTAP_TRACE_TX_FRAME, cid, cmd, resp_len);
+    CTAP_CAPTURE(CTAP_CAPTURE_IN, &tx.frame[0], CTAPHID_FRAME_MAXLEN);
+    usbhid_send_response(ctap_get_usbhid_handler(), &tx.frame[0], CTAPHID_FRAME_MAXLEN);
+    CTAP_STATS_INC(frames_tx);
+    usbhid_response_done(ctap_get_usbhid_handler());
+    mutex_unlock(&tx.lock);
+    return true;
+}
+
+/*
+ * Queue a response. The response content is copied, the caller's buffer
+ * can be reused as soon as this function returns.
+ */
+mbed_error_t ctap_tx_enqueue(const uint8_t *resp, uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    bool need_bulk = (resp_len > CTAP_TX_INLINE_LEN);
+    ctap_tx_msg_t *msg;
+
+    if ((resp == NULL && resp_len != 0) || resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (resp_len <= CTAPHID_INIT_DATA_LEN && ctap_tx_send_direct(resp, resp_len, cid, cmd)) {
+        goto err;
+    }
+    if (ctap_tx_blocked(need_bulk, false)) {
+        errcode = MBED_ERROR_BUSY;
+        CTAP_STATS_INC(tx_drops);
+        CTAP_TRACE(CTAP_TRACE_TX_DROP, cid, cmd, resp_len);
+        log_printf("[CTAPHID] CID 0x%x: TX queue full, response dropped\n", cid);
+        goto err;
+    }
+    msg = &tx.msgs[tx.head % CTAP_TX_QUEUE_DEPTH];
+    msg->cid = cid;
+    msg->cmd = cmd;
+    msg->len = resp_len;
+    msg->idx = 0;
+    msg->seq = 0;
+    msg->started = false;
+    msg->bulk = need_bulk;
+    msg->resp = false;
+    msg->raw = false;
+    if (need_bulk) {
+        set_bool_with_membarrier(&(tx.bulk_busy), true);
+        memcpy(&tx.bulk[0], resp, resp_len);
+        msg->data = &tx.bulk[0];
+    } else {
+        if (resp_len != 0) {
+            memcpy(&msg->inline_data[0], resp, resp_len);
+        }
+        msg->data = &msg->inline_data[0];
+    }
+    /* publish the message, then start the transmission if the EP is idle */
+    CTAP_TRACE(CTAP_TRACE_TX_QUEUE, cid, cmd, resp_len);
+    set_u32_with_membarrier(&(tx.head), ctap_tx_next(tx.head));
+    ctap_tx_pump();
+err:
+    return errcode;
+}
+
+/*
+ * Queue the end of a response whose first sent bytes (initialization frame
+ * and first continuation frames) have already been sent, e.g. echoed by the
+ * cut-through PING. The remaining content is copied.
+ */
+mbed_error_t ctap_tx_enqueue_tail(const uint8_t *resp, uint16_t resp_len, uint16_t sent, uint32_t cid, uint8_t cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_tx_msg_t *msg;
+
+    /* sent is a frame boundary */
+    if (resp == NULL || resp_len > CTAPHID_MAX_PAYLOAD_SIZE || sent >= resp_len ||
+        sent < CTAPHID_INIT_DATA_LEN || ((sent - CTAPHID_INIT_DATA_LEN) % CTAPHID_SEQ_DATA_LEN) != 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctap_tx_blocked(true, false)) {
+        errcode = MBED_ERROR_BUSY;
+        CTAP_STATS_INC(tx_drops);
+        CTAP_TRACE(CTAP_TRACE_TX_DROP, cid, cmd, resp_len);
+        log_printf("[CTAPHID] CID 0x%x: TX queue full, response dropped\n", cid);
+        goto err;
+    }
+    msg = &tx.msgs[tx.head % CTAP_TX_QUEUE_DEPTH];
+    msg->cid = cid;
+    msg->cmd = cmd;
+    msg->len = resp_len;
+    msg->idx = sent;
+    msg->seq = (sent - CTAPHID_INIT_DATA_LEN) / CTAPHID_SEQ_DATA_LEN;
+    msg->started = true;
+    msg->bulk = true;
+    msg->resp = false;
+    msg->raw = false;
+    /* the payload keeps its offset in the bulk buffer */
+    set_bool_with_membarrier(&(tx.bulk_busy), true);
+    memcpy(&tx.bulk[sent], &resp[sent], resp_len - sent);
+    msg->data = &tx.bulk[0];
+    CTAP_TRACE(CTAP_TRACE_TX_QUEUE, cid, cmd, resp_len - sent);
+    set_u32_with_membarrier(&(tx.head), ctap_tx_next(tx.head));
+    ctap_tx_pump();
+err:
+    return errcode;
+}
+
+/*
+ * Queue a single frame, sent as is: only its first len bytes (header
+ * included) are meaningful, the tail is padded. The frame is copied.
+ */
+mbed_error_t ctap_tx_enqueue_frame(const uint8_t *frame, uint8_t len)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_tx_msg_t *msg;
+
+    if (frame == NULL || len < sizeof(ctap_seq_header_t) || len > CTAPHID_FRAME_MAXLEN) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctap_tx_blocked(false, false)) {
+        errcode = MBED_ERROR_BUSY;
+        CTAP_STATS_INC(tx_drops);
+        CTAP_TRACE(CTAP_TRACE_TX_DROP, ((const ctap_seq_header_t*)frame)->cid, frame[4], len);
+        log_printf("[CTAPHID] TX queue full, frame dropped\n");
+        goto err;
+    }
+    msg = &tx.msgs[tx.head % CTAP_TX_QUEUE_DEPTH];
+    memcpy(&msg->cid, &frame[0], sizeof(msg->cid));
+    msg->cmd = frame[4];
+    msg->len = len;
+    msg->idx = 0;
+    msg->seq = 0;
+    msg->started = false;
+    msg->bulk = false;
+    msg->resp = false;
+    msg->raw = true;
+    memcpy(&msg->inline_data[0], frame, len);
+    memset(&msg->inline_data[len], 0, CTAPHID_FRAME_MAXLEN - len);
+    msg->data = &msg->inline_data[0];
+    set_u32_with_membarrier(&(tx.head), ctap_tx_next(tx.head));
+    ctap_tx_pump();
+err:
+    return errcode;
+}
+
+/*
+ * Lease the response buffer (CTAPHID_MAX_PAYLOAD_SIZE bytes) to the backend,
+ * which writes its response in place. Return NULL if the buffer is still
+ * held, by an executing asynchronous backend or by the previous response
+ * being sent from it (see ctap_tx_ready()).
+ */
+uint8_t *ctap_tx_resp_lease(void)
+{
+    if (tx.resp_busy) {
+        return NULL;
+    }
+    tx.resp_avail = 0;
+    tx.resp_aborted = false;
+    set_bool_with_membarrier(&(tx.resp_busy), true);
+    return &tx.resp[0];
+}
+
+/* give back the response buffer lease without sending anything */
+void ctap_tx_resp_release(void)
+{
+    set_bool_with_membarrier(&(tx.resp_busy), false);
+}
+
+/*
+ * Queue a message sent from the leased response buffer, its frames being
+ * sent as the payload becomes available.
+ */
+static mbed_error_t ctap_tx_resp_queue(uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    ctap_tx_msg_t *msg;
+
+    if (resp_len > CTAPHID_MAX_PAYLOAD_SIZE) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (ctap_tx_blocked(false, false)) {
+        errcode = MBED_ERROR_BUSY;
+        CTAP_STATS_INC(tx_drops);
+        CTAP_TRACE(CTAP_TRACE_TX_DROP, cid, cmd, resp_len);
+        log_printf("[CTAPHID] CID 0x%x: TX queue full, response dropped\n", cid);
+        goto err;
+    }
+    msg = &tx.msgs[tx.head % CTAP_TX_QUEUE_DEPTH];
+    msg->cid = cid;
+    msg->cmd = cmd;
+    msg->len = resp_len;
+    msg->idx = 0;
+    msg->seq = 0;
+    msg->started = false;
+    msg->bulk = false;
+    msg->resp = true;
+    msg->raw = false;
+    msg->data = &tx.resp[0];
+    CTAP_TRACE(CTAP_TRACE_TX_QUEUE, cid, cmd, resp_len);
+    set_u32_with_membarrier(&(tx.head), ctap_tx_next(tx.head));
+    ctap_tx_pump();
+err:
+    return errcode;
+}
+
+/*
+ * Queue the response written in the leased response buffer. It is sent
+ * without any copy, the lease being released once its last frame is sent
+ * (or immediately on error).
+ */
+mbed_error_t ctap_tx_resp_commit(uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    mbed_error_t errcode;
+
+    set_u16_with_membarrier(&(tx.resp_avail), resp_len);
+    errcode = ctap_tx_resp_queue(resp_len, cid, cmd);
+    if (errcode != MBED_ERROR_NONE) {
+        ctap_tx_resp_release();
+    }
+    return errcode;
+}
+
+/*
+ * Queue a streamed response of resp_len bytes: the leased buffer is filled
+ * by the producer (see ctap_tx_resp_produced()) while its first frames are
+ * sent. On error, the lease is kept: the producer may still be writing.
+ */
+mbed_error_t ctap_tx_resp_stream(uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    return ctap_tx_resp_queue(resp_len, cid, cmd);
+}
+
+/*
+ * The producer has written the response buffer up to avail bytes: send the
+ * frames which are now complete. May be called from an ISR.
+ */
+void ctap_tx_resp_produced(uint16_t avail)
+{
+    set_u16_with_membarrier(&(tx.resp_avail), avail);
+    ctap_tx_pump();
+}
+
+uint16_t ctap_tx_resp_produced_len(void)
+{
+    return tx.resp_avail;
+}
+
+/*
+ * Abort the queued streamed response: its remaining frames are dropped and
+ * the lease is released by the pump.
+ */
+void ctap_tx_resp_abort(void)
+{
+    set_bool_with_membarrier(&(tx.resp_aborted), true);
+    ctap_tx_pump();
+}
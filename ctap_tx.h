@@ -0,0 +1,95 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef CTAP_TX_H_
+#define CTAP_TX_H_
+
+#include "autoconf.h"
+#include "libc/types.h"
+#include "ctap_protocol.h"
+
+/*
+ * CTAPHID transmission queue.
+ *
+ * Responses are queued as messages and fragmented one frame at a time: a
+ * new frame is only pushed to the IN endpoint when the previous one has been
+ * sent (i.e. on usbhid_report_sent_trigger()), so that the engine never
+ * blocks on a multi-frame response. Nothing waits for room in the queue
+ * either: the engine only dispatches a request (or handles a received
+ * frame) once its response can be queued.
+ * Single frame messages are sent at once when nothing is queued and the
+ * IN endpoint is ready. Messages of up to CTAP_TX_INLINE_LEN bytes are
+ * stored inline in the queue, longer ones use the (single) bulk TX buffer.
+ * Backend responses are written in place in the response buffer, leased
+ * to the backend (see ctap_tx_resp_lease()), and are fragmented directly
+ * from it.
+ * Raw frames (header included, see ctap_tx_enqueue_frame()) are stored
+ * inline and sent as is.
+ */
+
+#define CTAP_TX_QUEUE_DEPTH CONFIG_USR_LIB_CTAP_TX_QUEUE_DEPTH
+#define CTAP_TX_INLINE_LEN  CTAPHID_FRAME_MAXLEN
+
+typedef struct {
+    uint32_t       cid;
+    uint8_t        cmd;
+    uint16_t       len;   /* BCNT of the message */
+    uint16_t       idx;   /* payload bytes already sent */
+    uint8_t        seq;   /* next continuation frame sequence */
+    bool           started;  /* initialization frame sent */
+    bool           bulk;  /* payload in the bulk buffer */
+    bool           resp;  /* payload in the response buffer */
+    bool           raw;   /* single complete frame in inline_data */
+    const uint8_t *data;
+    uint8_t        inline_data[CTAP_TX_INLINE_LEN];
+} ctap_tx_msg_t;
+
+mbed_error_t ctap_tx_enqueue(const uint8_t *resp, uint16_t resp_len, uint32_t cid, uint8_t cmd);
+
+mbed_error_t ctap_tx_enqueue_frame(const uint8_t *frame, uint8_t len);
+
+mbed_error_t ctap_tx_enqueue_tail(const uint8_t *resp, uint16_t resp_len, uint16_t sent, uint32_t cid, uint8_t cmd);
+
+void ctap_tx_pump(void);
+
+bool ctap_tx_idle(void);
+
+bool ctap_tx_has_room(void);
+
+bool ctap_tx_ready(bool need_bulk, bool need_resp);
+
+uint8_t *ctap_tx_resp_lease(void);
+
+mbed_error_t ctap_tx_resp_commit(uint16_t resp_len, uint32_t cid, uint8_t cmd);
+
+mbed_error_t ctap_tx_resp_stream(uint16_t resp_len, uint32_t cid, uint8_t cmd);
+
+void ctap_tx_resp_produced(uint16_t avail);
+
+uint16_t ctap_tx_resp_produced_len(void);
+
+void ctap_tx_resp_abort(void);
+
+void ctap_tx_resp_release(void);
+
+#endif/*!CTAP_TX_H_*/
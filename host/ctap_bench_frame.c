@@ -0,0 +1,224 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+#include "api/libctap.h"
+#include "ctap_protocol.h"
+#include "ctap_control.h"
+#include "ctap_tx.h"
+#include "ctap_sim.h"
+
+/*
+ * Microbenchmark of the response fragmentation path: ctaphid_send_response()
+ * against the historical per-iteration memset and byte loop implementation
+ * (kept below as a reference), with frames handed to a sink instead of the
+ * emulated endpoint. The sink acknowledges each frame at once, so that the
+ * TX queue is drained within the call. Both implementations must produce
+ * the same frames.
+ * The "lease" path is the one of the backend responses: the response is
+ * written in place in the leased TX response buffer and is fragmented
+ * from it, without the copy in the TX queue.
+ */
+
+static inline uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* historical implementation, used as the reference */
+static mbed_error_t legacy_send_response(uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    uint8_t sequence = 0;
+    uint32_t offset = 0;
+    uint32_t max_resp_len = 0;
+    uint32_t idx = 0;
+    bool new_seq = true;
+    do {
+        uint32_t len = 0;
+        offset = 0;
+        ctap_init_cmd_t full_init_resp = { 0 };
+        ctap_seq_cmd_t full_seq_resp = { 0 };
+        if (new_seq == true) {
+            full_init_resp.header.cid = cid;
+            full_init_resp.header.cmd = cmd;
+            full_init_resp.header.bcnth = (resp_len & 0xff00) >> 8;
+            full_init_resp.header.bcntl = (resp_len & 0xff);
+            max_resp_len = CTAPHID_FRAME_MAXLEN - sizeof(ctap_init_header_t);
+        } else {
+            full_seq_resp.header.cid = cid;
+            full_seq_resp.header.seq = sequence;
+            max_resp_len = CTAPHID_FRAME_MAXLEN - sizeof(ctap_seq_header_t);
+            sequence++;
+        }
+        if (new_seq == true) {
+            while (idx < resp_len && offset < max_resp_len) {
+                full_init_resp.data[offset] = resp[idx];
+                offset++;
+                idx++;
+            }
+        } else {
+            while (idx < resp_len && offset < max_resp_len) {
+                full_seq_resp.data[offset] = resp[idx];
+                offset++;
+                idx++;
+            }
+        }
+        if (new_seq == true) {
+            len = offset + sizeof(ctap_init_header_t);
+            if (len < CTAPHID_FRAME_MAXLEN) {
+                len = CTAPHID_FRAME_MAXLEN;
+            }
+            usbhid_send_response(ctap_get_usbhid_handler(), (uint8_t*)&full_init_resp, len);
+        } else {
+            len = offset + sizeof(ctap_seq_header_t);
+            if (len < CTAPHID_FRAME_MAXLEN) {
+                len = CTAPHID_FRAME_MAXLEN;
+            }
+            usbhid_send_response(ctap_get_usbhid_handler(), (uint8_t*)&full_seq_resp, len);
+        }
+        new_seq = false;
+    } while (idx < resp_len);
+    usbhid_response_done(ctap_get_usbhid_handler());
+    return MBED_ERROR_NONE;
+}
+
+/* sinks: either accumulate a cheap digest, or record the frames for comparison */
+static volatile uint32_t digest = 0;
+static uint8_t recorded[2][CTAPHID_MAX_PAYLOAD_SIZE / CTAPHID_SEQ_DATA_LEN + 2][CTAPHID_FRAME_MAXLEN];
+static uint32_t recorded_num[2];
+static uint32_t recording = 0;
+
+static void digest_sink(const uint8_t *frame, uint8_t len)
+{
+    digest += frame[len - 1] ^ frame[4];
+}
+
+static void record_sink(const uint8_t *frame, uint8_t len)
+{
+    memcpy(recorded[recording][recorded_num[recording]++], frame, len);
+}
+
+typedef mbed_error_t (*send_fn_t)(uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd);
+
+static mbed_error_t current_send_response(uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    return ctaphid_send_response(resp, resp_len, cid, cmd);
+}
+
+/* the response has been written in the leased buffer by the backend */
+static mbed_error_t lease_send_response(uint8_t *resp, const uint16_t resp_len, uint32_t cid, uint8_t cmd)
+{
+    (void)resp;
+    if (ctap_tx_resp_lease() == NULL) {
+        return MBED_ERROR_BUSY;
+    }
+    return ctap_tx_resp_commit(resp_len, cid, cmd);
+}
+
+static double bench(send_fn_t fn, uint8_t *resp, uint16_t len, uint32_t iterations)
+{
+    uint64_t best = UINT64_MAX;
+    /* best of 5 runs, to filter out scheduling noise */
+    for (uint32_t run = 0; run < 5; ++run) {
+        uint64_t start = bench_cycles();
+        for (uint32_t i = 0; i < iterations; ++i) {
+            fn(resp, len, 0x11223344, CTAP_MSG | 0x80);
+        }
+        uint64_t elapsed = bench_cycles() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return (double)best / (double)iterations;
+}
+
+int main(void)
+{
+    static uint8_t resp[CTAPHID_MAX_PAYLOAD_SIZE];
+    const uint16_t sizes[] = { 1, 17, 57, 64, 256, 1024, 4096, 7609 };
+
+    for (uint32_t i = 0; i < sizeof(resp); ++i) {
+        resp[i] = (uint8_t)(i * 13 + 1);
+    }
+    if (ctap_declare(0, sim_echo_apdu, sim_wink) != MBED_ERROR_NONE) {
+        fprintf(stderr, "CTAP stack initialization failed\n");
+        return EXIT_FAILURE;
+    }
+
+    /* the backend response, written once in the response buffer */
+    uint8_t *lease = ctap_tx_resp_lease();
+    memcpy(lease, resp, sizeof(resp));
+    ctap_tx_resp_release();
+
+    /* check first that the implementations produce the same frames */
+    sim_usb_set_in_sink(record_sink);
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        recorded_num[0] = recorded_num[1] = 0;
+        recording = 0;
+        legacy_send_response(resp, sizes[s], 0x11223344, CTAP_MSG | 0x80);
+        recording = 1;
+        ctaphid_send_response(resp, sizes[s], 0x11223344, CTAP_MSG | 0x80);
+        if (recorded_num[0] != recorded_num[1] ||
+            memcmp(recorded[0], recorded[1], recorded_num[0] * CTAPHID_FRAME_MAXLEN) != 0) {
+            fprintf(stderr, "frames mismatch for a %u bytes response\n", sizes[s]);
+            return EXIT_FAILURE;
+        }
+        recorded_num[1] = 0;
+        lease_send_response(resp, sizes[s], 0x11223344, CTAP_MSG | 0x80);
+        if (recorded_num[0] != recorded_num[1] ||
+            memcmp(recorded[0], recorded[1], recorded_num[0] * CTAPHID_FRAME_MAXLEN) != 0) {
+            fprintf(stderr, "leased frames mismatch for a %u bytes response\n", sizes[s]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    sim_usb_set_in_sink(digest_sink);
+#if defined(__x86_64__) || defined(__i386__)
+    printf("%8s %14s %14s %14s %14s %14s %8s\n", "bytes", "legacy cyc", "legacy cyc/B", "builder cyc", "builder cyc/B", "lease cyc/B", "speedup");
+#else
+    printf("%8s %14s %14s %14s %14s %14s %8s\n", "bytes", "legacy ns", "legacy ns/B", "builder ns", "builder ns/B", "lease ns/B", "speedup");
+#endif
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        uint32_t iterations = 2000000 / (sizes[s] + 64) + 100;
+        double legacy = bench(legacy_send_response, resp, sizes[s], iterations);
+        double builder = bench(current_send_response, resp, sizes[s], iterations);
+        double leased = bench(lease_send_response, resp, sizes[s], iterations);
+        printf("%8u %14.1f %14.2f %14.1f %14.2f %14.2f %7.1fx\n", sizes[s],
+               legacy, legacy / sizes[s], builder, builder / sizes[s], leased / sizes[s], legacy / builder);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,612 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "api/libctap.h"
+#include "ctap_protocol.h"
+#include "ctap_sim.h"
+
+/*
+ * Multi-client load generator: N host clients (browsers, ssh-agent,
+ * daemons...) each open their own channel with a broadcast INIT, then
+ * issue a mix of INIT, MSG, CBOR and PING requests against the echo
+ * backend, with a think time between two requests.
+ *
+ * The host sends one frame at a time, picking the clients round-robin,
+ * so that the fragments of concurrent requests are interleaved on the
+ * wire (-w: each request is sent as a whole). A client answered with
+ * ERR_CHANNEL_BUSY retries after a backoff, and a client whose channel
+ * has been evicted, answered ERR_INVALID_CHANNEL, opens a new one and
+ * retries. A client without response for LOAD_CLIENT_TIMEOUT_US sends
+ * its request again. The latency of a request covers its retries.
+ *
+ * The number of channels of the library is a build time option
+ * (CONFIG_USR_LIB_CTAP_MAX_CONCURRENT_CIDS): "make load" sweeps it, along
+ * with the number of clients and the payload size.
+ */
+
+#define LOAD_MAX_CLIENTS     64
+/* virtual time without any completed request before failing */
+#define LOAD_STALL_TIMEOUT_US 10000000ULL
+/* ERR_CHANNEL_BUSY backoff, randomized up to twice this value */
+#define LOAD_BUSY_BACKOFF_US 1000
+/* response timeout of a client, before sending its request again */
+#define LOAD_CLIENT_TIMEOUT_US 2000000ULL
+/* default requests mix, no CBOR request without CTAP2 support */
+#if CONFIG_USR_LIB_CTAP_CTAP2
+# define LOAD_DEFAULT_MIX "0:4:4:2"
+#else
+# define LOAD_DEFAULT_MIX "0:4:0:2"
+#endif
+
+typedef enum {
+    LOAD_OP_INIT = 0,
+    LOAD_OP_MSG,
+    LOAD_OP_CBOR,
+    LOAD_OP_PING,
+    LOAD_OP_NUM
+} load_op_t;
+
+static const uint8_t load_op_cmd[LOAD_OP_NUM] = {
+    [LOAD_OP_INIT] = CTAP_INIT | 0x80,
+    [LOAD_OP_MSG]  = CTAP_MSG | 0x80,
+    [LOAD_OP_CBOR] = CTAP_CBOR | 0x80,
+    [LOAD_OP_PING] = CTAP_PING | 0x80,
+};
+
+typedef enum {
+    CLIENT_IDLE,     /* thinking, or backing off before a retry */
+    CLIENT_SENDING,  /* request frames being sent */
+    CLIENT_WAITING,  /* waiting for the response */
+} load_client_state_t;
+
+typedef struct {
+    load_client_state_t state;
+    uint32_t cid;          /* own channel, CTAPHID_BROADCAST_CID if none */
+    uint64_t wake_us;      /* CLIENT_IDLE: next (re)try */
+    /* pending request, possibly preceded by an INIT to get a channel */
+    bool     pending;
+    load_op_t op;
+    uint16_t len;
+    uint64_t start_us;
+    /* request on the wire */
+    uint8_t  cmd;
+    uint16_t wire_len;
+    uint16_t sent;
+    uint64_t sent_us;      /* last request frame */
+    uint8_t  seq;
+    uint8_t  nonce[8];
+    /* response reassembly */
+    uint16_t rlen;
+    uint16_t ridx;
+    uint8_t  rseq;
+    bool     receiving;
+    uint8_t  req[CTAPHID_MAX_PAYLOAD_SIZE];
+    uint8_t  resp[CTAPHID_MAX_PAYLOAD_SIZE];
+} load_client_t;
+
+static load_client_t clients[LOAD_MAX_CLIENTS];
+
+static struct {
+    uint32_t nclients;
+    uint32_t requests;
+    uint32_t size;
+    bool     random_size;
+    bool     whole;
+    uint32_t think_us;
+    uint32_t weights[LOAD_OP_NUM];
+    uint32_t weights_sum;
+    uint64_t rng;
+    uint32_t rr;          /* round-robin position */
+    uint32_t sending;     /* -w: client whose request is being sent, or nclients */
+    /* results */
+    uint32_t started;
+    uint32_t done;
+    uint32_t failed;
+    uint64_t bytes;
+    uint64_t *latency_us;
+    uint32_t attempts;    /* requests sent on the wire, retries included */
+    uint32_t inits;
+    uint32_t busy;
+    uint32_t lost;        /* channels evicted under a client */
+    uint32_t timeouts;
+    uint32_t errors;      /* other error responses */
+    uint32_t keepalives;
+    uint32_t stray;       /* frames for no waiting client */
+    uint32_t corrupt;     /* responses not matching their request */
+    bool     stalled;
+} load = { 0 };
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c clients] [-n requests] [-s payload_size [-R]] [-m init:msg:cbor:ping] [-t think_us] [-w] [-i usb_interval_us] [-a backend_delay_us] [-S seed] [-l|-L]\n", prog);
+    fprintf(stderr, "  -R  random payload sizes, up to payload_size\n");
+    fprintf(stderr, "  -m  requests mix weights (default " LOAD_DEFAULT_MIX ")\n");
+    fprintf(stderr, "  -t  think time between two requests of a client (mean)\n");
+    fprintf(stderr, "  -w  send each request as a whole instead of interleaving the clients frames\n");
+    fprintf(stderr, "  -a  use the asynchronous backend, completing after the given delay\n");
+    fprintf(stderr, "  -l  print the results as a single line, -L print the header of that line\n");
+}
+
+/* xorshift64*, independent of the CIDs RNG */
+static uint32_t load_rand(uint32_t bound)
+{
+    load.rng ^= load.rng >> 12;
+    load.rng ^= load.rng << 25;
+    load.rng ^= load.rng >> 27;
+    return (bound != 0) ? (uint32_t)(((load.rng * 0x2545f4914f6cdd1dULL) >> 32) % bound) : 0;
+}
+
+static void client_sleep(load_client_t *c, uint32_t mean_us)
+{
+    c->state = CLIENT_IDLE;
+    c->wake_us = sim_clock_us() + load_rand(2 * mean_us + 1);
+}
+
+/* put the pending request (or the INIT it requires) on the wire */
+static void client_send(load_client_t *c)
+{
+    if (c->cid == CTAPHID_BROADCAST_CID || c->op == LOAD_OP_INIT) {
+        c->cmd = CTAP_INIT | 0x80;
+        c->wire_len = sizeof(c->nonce);
+        for (uint8_t i = 0; i < sizeof(c->nonce); ++i) {
+            c->nonce[i] = (uint8_t)load_rand(256);
+        }
+        memcpy(c->req, c->nonce, sizeof(c->nonce));
+        load.inits++;
+    } else {
+        c->cmd = load_op_cmd[c->op];
+        c->wire_len = c->len;
+        for (uint16_t i = 0; i < c->len; ++i) {
+            c->req[i] = (uint8_t)(load.started + i);
+        }
+    }
+    c->sent = 0;
+    c->sent_us = sim_clock_us();
+    c->seq = 0;
+    c->receiving = false;
+    c->state = CLIENT_SENDING;
+    load.attempts++;
+}
+
+static void client_start(load_client_t *c)
+{
+    uint32_t w = load_rand(load.weights_sum);
+    uint16_t min = 0;
+
+    for (c->op = 0; c->op < (LOAD_OP_NUM - 1) && w >= load.weights[c->op]; c->op++) {
+        w -= load.weights[c->op];
+    }
+    if (c->op == LOAD_OP_MSG) {
+        min = 4;
+    } else if (c->op == LOAD_OP_CBOR) {
+        min = 1;
+    }
+    c->len = load.random_size ? min + load_rand(load.size - min + 1) : load.size;
+    c->pending = true;
+    c->start_us = sim_clock_us();
+    load.started++;
+    client_send(c);
+}
+
+static void client_done(load_client_t *c, bool success)
+{
+    if (success) {
+        load.latency_us[load.done++] = sim_clock_us() - c->start_us;
+        load.bytes += (c->op == LOAD_OP_INIT) ? 0 : c->len;
+    } else {
+        load.failed++;
+    }
+    c->pending = false;
+    client_sleep(c, load.think_us);
+}
+
+/* the response to the request on the wire has been received */
+static void client_response(load_client_t *c)
+{
+    if (c->cmd == (CTAP_INIT | 0x80)) {
+        memcpy(&c->cid, &c->resp[8], sizeof(c->cid));
+        if (c->op != LOAD_OP_INIT) {
+            /* the channel is open: now the request itself */
+            client_send(c);
+            return;
+        }
+        client_done(c, true);
+        return;
+    }
+    if (c->rlen != c->len || memcmp(c->resp, c->req, c->len) != 0) {
+        load.corrupt++;
+        client_done(c, false);
+        return;
+    }
+    client_done(c, true);
+}
+
+static void client_error(load_client_t *c, uint8_t error)
+{
+    switch (error) {
+        case U2F_ERR_CHANNEL_BUSY:
+            load.busy++;
+            client_sleep(c, LOAD_BUSY_BACKOFF_US);
+            break;
+        case U2F_ERR_INVALID_CHANNEL:
+            /* evicted: open a new channel before retrying, after a backoff
+             * so that the clients do not evict each other in turn */
+            load.lost++;
+            c->cid = CTAPHID_BROADCAST_CID;
+            client_sleep(c, LOAD_BUSY_BACKOFF_US);
+            break;
+        default:
+            load.errors++;
+            client_done(c, false);
+            break;
+    }
+}
+
+static load_client_t *client_lookup(const uint8_t *frame)
+{
+    uint32_t cid;
+
+    memcpy(&cid, frame, sizeof(cid));
+    for (uint32_t i = 0; i < load.nclients; ++i) {
+        load_client_t *c = &clients[i];
+        if (c->state == CLIENT_IDLE || c->cmd == (CTAP_INIT | 0x80)) {
+            continue;
+        }
+        if (c->cid == cid) {
+            return c;
+        }
+    }
+    if (cid == CTAPHID_BROADCAST_CID && frame[4] == (CTAP_INIT | 0x80)) {
+        /* broadcast INIT responses are told apart by their nonce */
+        for (uint32_t i = 0; i < load.nclients; ++i) {
+            load_client_t *c = &clients[i];
+            if (c->state != CLIENT_IDLE && c->cmd == (CTAP_INIT | 0x80) &&
+                memcmp(&frame[7], c->nonce, sizeof(c->nonce)) == 0) {
+                return c;
+            }
+        }
+    }
+    if (cid == CTAPHID_BROADCAST_CID && frame[4] == (CTAP_ERROR | 0x80)) {
+        /* error on a broadcast INIT: no nonce, the first INIT on the wire */
+        for (uint32_t i = 0; i < load.nclients; ++i) {
+            load_client_t *c = &clients[i];
+            if (c->state != CLIENT_IDLE && c->cmd == (CTAP_INIT | 0x80)) {
+                return c;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void receive_frame(const uint8_t *frame)
+{
+    load_client_t *c = client_lookup(frame);
+    uint16_t len;
+
+    if (frame[4] == (CTAP_KEEPALIVE | 0x80)) {
+        load.keepalives++;
+        return;
+    }
+    if (c == NULL) {
+        load.stray++;
+        return;
+    }
+    if (frame[4] == (CTAP_ERROR | 0x80)) {
+        client_error(c, frame[7]);
+        return;
+    }
+    if (frame[4] & 0x80) {
+        c->rlen = (frame[5] << 8) | frame[6];
+        c->ridx = 0;
+        c->rseq = 0;
+        c->receiving = true;
+        len = (c->rlen < CTAPHID_INIT_DATA_LEN) ? c->rlen : CTAPHID_INIT_DATA_LEN;
+        memcpy(c->resp, &frame[7], len);
+    } else {
+        if (!c->receiving || frame[4] != c->rseq || c->rlen > CTAPHID_MAX_PAYLOAD_SIZE) {
+            load.stray++;
+            return;
+        }
+        c->rseq++;
+        len = c->rlen - c->ridx;
+        if (len > CTAPHID_SEQ_DATA_LEN) {
+            len = CTAPHID_SEQ_DATA_LEN;
+        }
+        memcpy(&c->resp[c->ridx], &frame[5], len);
+    }
+    c->ridx += len;
+    if (c->ridx >= c->rlen) {
+        c->receiving = false;
+        client_response(c);
+    }
+}
+
+/* next frame of the client request, return false when all sent */
+static bool client_frame(load_client_t *c, uint8_t *frame)
+{
+    uint16_t len;
+
+    memset(frame, 0, SIM_FRAME_LEN);
+    memcpy(frame, &c->cid, sizeof(c->cid));
+    if (c->cmd == (CTAP_INIT | 0x80)) {
+        uint32_t bcast = CTAPHID_BROADCAST_CID;
+        memcpy(frame, &bcast, sizeof(bcast));
+    }
+    if (c->sent == 0 && c->seq == 0) {
+        frame[4] = c->cmd;
+        frame[5] = (c->wire_len >> 8) & 0xff;
+        frame[6] = c->wire_len & 0xff;
+        len = (c->wire_len < CTAPHID_INIT_DATA_LEN) ? c->wire_len : CTAPHID_INIT_DATA_LEN;
+        memcpy(&frame[7], c->req, len);
+        c->seq = 0x80; /* first frame sent */
+    } else {
+        frame[4] = c->seq & 0x7f;
+        len = c->wire_len - c->sent;
+        if (len > CTAPHID_SEQ_DATA_LEN) {
+            len = CTAPHID_SEQ_DATA_LEN;
+        }
+        memcpy(&frame[5], &c->req[c->sent], len);
+        c->seq = ((c->seq + 1) & 0x7f) | 0x80;
+    }
+    c->sent += len;
+    c->sent_us = sim_clock_us();
+    return c->sent < c->wire_len;
+}
+
+static void agent(void)
+{
+    uint8_t frame[SIM_FRAME_LEN];
+    uint64_t wake_us = UINT64_MAX;
+
+    while (sim_usb_in_pop(frame)) {
+        receive_frame(frame);
+    }
+    /* clients done thinking start a new request */
+    for (uint32_t i = 0; i < load.nclients; ++i) {
+        load_client_t *c = &clients[i];
+        if (c->state == CLIENT_SENDING) {
+            continue;
+        }
+        if (c->state == CLIENT_WAITING) {
+            if ((sim_clock_us() - c->sent_us) >= LOAD_CLIENT_TIMEOUT_US) {
+                load.timeouts++;
+                client_send(c);
+            } else if ((c->sent_us + LOAD_CLIENT_TIMEOUT_US) < wake_us) {
+                wake_us = c->sent_us + LOAD_CLIENT_TIMEOUT_US;
+            }
+            continue;
+        }
+        if (sim_clock_us() < c->wake_us) {
+            if (c->wake_us < wake_us) {
+                wake_us = c->wake_us;
+            }
+            continue;
+        }
+        if (c->pending) {
+            client_send(c);
+        } else if (load.started < load.requests) {
+            client_start(c);
+        }
+    }
+    /* the library may be sleeping until then */
+    sim_agent_wakeup(wake_us);
+    /* a single frame in flight: the next one is picked when delivered */
+    if (sim_usb_out_pending() != 0) {
+        return;
+    }
+    for (uint32_t n = 0; n < load.nclients; ++n) {
+        uint32_t i = (load.sending < load.nclients) ? load.sending : (load.rr + n) % load.nclients;
+        load_client_t *c = &clients[i];
+        if (c->state != CLIENT_SENDING) {
+            load.sending = load.nclients;
+            continue;
+        }
+        if (!client_frame(c, frame)) {
+            c->state = CLIENT_WAITING;
+            load.sending = load.nclients;
+        } else if (load.whole) {
+            load.sending = i;
+        }
+        sim_usb_out_push(frame);
+        load.rr = (i + 1) % load.nclients;
+        break;
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t quantile(double p)
+{
+    uint32_t idx = (uint32_t)(p * (double)load.done);
+    return (load.done == 0) ? 0 : load.latency_us[(idx < load.done) ? idx : load.done - 1];
+}
+
+static bool parse_mix(const char *mix)
+{
+    char *end;
+
+    load.weights_sum = 0;
+    for (uint8_t i = 0; i < LOAD_OP_NUM; ++i) {
+        load.weights[i] = strtoul(mix, &end, 0);
+        load.weights_sum += load.weights[i];
+        if (end == mix || (i < (LOAD_OP_NUM - 1) && *end != ':') || (i == (LOAD_OP_NUM - 1) && *end != '\0')) {
+            return false;
+        }
+        mix = end + 1;
+    }
+#if !CONFIG_USR_LIB_CTAP_CTAP2
+    if (load.weights[LOAD_OP_CBOR] != 0) {
+        fprintf(stderr, "CTAPHID_CBOR requires a CONFIG_USR_LIB_CTAP_CTAP2 build\n");
+        return false;
+    }
+#endif
+    return load.weights_sum != 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t interval = 0;
+    uint64_t seed = 1;
+    bool async = false, line = false;
+    int opt;
+
+    load.nclients = 4;
+    load.requests = 10000;
+    load.size = 256;
+    load.rng = 0x9e3779b97f4a7c15ULL;
+    parse_mix(LOAD_DEFAULT_MIX);
+    while ((opt = getopt(argc, argv, "c:n:s:Rm:t:wi:a:S:lLh")) != -1) {
+        switch (opt) {
+            case 'c': load.nclients = strtoul(optarg, NULL, 0); break;
+            case 'n': load.requests = strtoul(optarg, NULL, 0); break;
+            case 's': load.size = strtoul(optarg, NULL, 0); break;
+            case 'R': load.random_size = true; break;
+            case 'm':
+                if (!parse_mix(optarg)) {
+                    fprintf(stderr, "invalid mix %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't': load.think_us = strtoul(optarg, NULL, 0); break;
+            case 'w': load.whole = true; break;
+            case 'i': interval = strtoul(optarg, NULL, 0); break;
+            case 'a': async = true; sim_async_set_delay(strtoul(optarg, NULL, 0)); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            case 'l': line = true; break;
+            case 'L':
+                printf("%5s %7s %5s %5s %9s %8s %8s %8s %7s %6s %6s %6s %6s %6s %6s %6s %6s %6s\n", "cids", "clients", "size", "mode",
+                       "trans/s", "p50_us", "p99_us", "p999_us", "busy%", "b_pool", "b_resp", "b_bknd", "b_chan",
+                       "b_cid", "b_lock", "evict", "lost", "failed");
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (load.nclients == 0 || load.nclients > LOAD_MAX_CLIENTS || load.requests == 0 ||
+        load.size > CTAPHID_MAX_PAYLOAD_SIZE ||
+        (!load.random_size && ((load.weights[LOAD_OP_MSG] != 0 && load.size < 4) ||
+                               (load.weights[LOAD_OP_CBOR] != 0 && load.size < 1))) ||
+        (load.random_size && load.size < 4)) {
+        fprintf(stderr, "invalid parameters\n");
+        return EXIT_FAILURE;
+    }
+    load.latency_us = calloc(load.requests, sizeof(uint64_t));
+    load.sending = load.nclients;
+    load.rng ^= seed;
+
+    sim_rng_seed(seed);
+    sim_usb_set_interval(interval);
+    mbed_error_t errcode = async ? ctap_declare_async(0, sim_async_apdu, sim_wink)
+                                 : ctap_declare(0, sim_echo_apdu, sim_wink);
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    if (errcode == MBED_ERROR_NONE) {
+        errcode = async ? ctap_declare_cbor_async(sim_async_apdu)
+                        : ctap_declare_cbor(sim_echo_apdu);
+    }
+#endif
+    if (errcode != MBED_ERROR_NONE || ctap_configure() != MBED_ERROR_NONE) {
+        fprintf(stderr, "CTAP stack initialization failed\n");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < load.nclients; ++i) {
+        clients[i].cid = CTAPHID_BROADCAST_CID;
+        client_sleep(&clients[i], load.think_us);
+    }
+    ctap_reset_stats();
+    sim_set_agent(agent);
+
+    uint64_t start_us = sim_clock_us();
+    uint64_t last_progress = start_us;
+    uint32_t last_done = 0;
+    while ((load.done + load.failed) < load.requests) {
+        ctap_exec();
+        if ((load.done + load.failed) != last_done) {
+            last_done = load.done + load.failed;
+            last_progress = sim_clock_us();
+        }
+        if ((sim_clock_us() - last_progress) > LOAD_STALL_TIMEOUT_US) {
+            /* the engine has collapsed under the load: reported as such */
+            load.stalled = true;
+            break;
+        }
+    }
+    uint64_t elapsed_us = sim_clock_us() - start_us;
+    ctap_stats_t stats = { 0 };
+    ctap_get_stats(&stats);
+    qsort(load.latency_us, load.done, sizeof(uint64_t), cmp_u64);
+    double tps = (elapsed_us != 0) ? (double)load.done * 1e6 / (double)elapsed_us : 0.0;
+    double busy = (load.attempts != 0) ? 100.0 * (double)load.busy / (double)load.attempts : 0.0;
+
+    if (line) {
+        printf("%5u %7u %5u %5s %9.0f %8llu %8llu %8llu %7.2f %6u %6u %6u %6u %6u %6u %6u %6u %6u%s\n",
+               CONFIG_USR_LIB_CTAP_MAX_CONCURRENT_CIDS, load.nclients, load.size,
+               load.whole ? "whole" : "inter", tps,
+               (unsigned long long)quantile(0.5), (unsigned long long)quantile(0.99),
+               (unsigned long long)quantile(0.999), busy,
+               stats.busy[CTAP_STATS_BUSY_POOL], stats.busy[CTAP_STATS_BUSY_RESP],
+               stats.busy[CTAP_STATS_BUSY_BACKEND], stats.busy[CTAP_STATS_BUSY_CHANNEL],
+               stats.busy[CTAP_STATS_BUSY_CID], stats.busy[CTAP_STATS_BUSY_LOCK],
+               stats.evictions, load.lost, load.failed,
+               load.stalled ? " stalled" : "");
+    } else {
+        printf("%u clients, %u channels: %u requests (mix %u:%u:%u:%u), %s%u bytes payloads, %s frames\n",
+               load.nclients, CONFIG_USR_LIB_CTAP_MAX_CONCURRENT_CIDS, load.requests,
+               load.weights[LOAD_OP_INIT], load.weights[LOAD_OP_MSG], load.weights[LOAD_OP_CBOR],
+               load.weights[LOAD_OP_PING], load.random_size ? "up to " : "", load.size,
+               load.whole ? "grouped" : "interleaved");
+        printf("  throughput: %.0f transactions/s, %.0f bytes/s (virtual, %.3f ms)\n",
+               tps, (elapsed_us != 0) ? (double)load.bytes * 1e6 / (double)elapsed_us : 0.0,
+               (double)elapsed_us / 1000.0);
+        printf("  latency:    p50 %llu us, p99 %llu us, p999 %llu us, max %llu us\n",
+               (unsigned long long)quantile(0.5), (unsigned long long)quantile(0.99),
+               (unsigned long long)quantile(0.999),
+               (unsigned long long)((load.done != 0) ? load.latency_us[load.done - 1] : 0));
+        printf("  busy:       %u ERR_CHANNEL_BUSY, %.2f%% of %u attempts\n", load.busy, busy, load.attempts);
+        printf("              %u no reassembly buffer, %u response buffer held, %u backend busy, %u channel busy, %u no channel, %u locked\n",
+               stats.busy[CTAP_STATS_BUSY_POOL], stats.busy[CTAP_STATS_BUSY_RESP],
+               stats.busy[CTAP_STATS_BUSY_BACKEND], stats.busy[CTAP_STATS_BUSY_CHANNEL],
+               stats.busy[CTAP_STATS_BUSY_CID], stats.busy[CTAP_STATS_BUSY_LOCK]);
+        printf("  channels:   %u INIT, %u evictions, %u channels lost by a client, %u CIDs drawn on INIT\n",
+               load.inits, stats.evictions, load.lost, stats.cid_pool_misses);
+        printf("  other:      %u failed requests (%u wrong responses), %u other errors, %u timeouts, %u keepalives, %u stray frames\n",
+               load.failed, load.corrupt, load.errors, load.timeouts, load.keepalives, load.stray);
+        if (load.stalled) {
+            printf("  stalled:    no request completed for %llu us, %u requests never completed\n",
+                   LOAD_STALL_TIMEOUT_US, load.requests - load.done - load.failed);
+        }
+    }
+    free(load.latency_us);
+    /* a collapse is a result, a wrong response a bug */
+    return (load.corrupt != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
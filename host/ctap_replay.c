@@ -0,0 +1,594 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "api/libctap.h"
+#include "ctap_protocol.h"
+#include "ctap_sim.h"
+
+/*
+ * Deterministic replay of a HID frames capture (see ctap_declare_capture(),
+ * or ctap_sim -C): the recorded OUT frames are fed to the library at their
+ * recorded time, on the virtual clock, and the frames sent back, captured
+ * by the same hook, are compared with the recorded IN frames.
+ *
+ * The channels allocated by the recorded broadcast INIT responses are
+ * mapped to the ones allocated during the replay, so that the replay does
+ * not depend on the RNG of the recording device. The frames of a mapped
+ * channel are held until its INIT response has been replayed. In the same
+ * way, a request sent on an idle channel in the capture (i.e. after the
+ * response to the previous one) is held until the replayed response, so
+ * that a slight timing difference does not make requests overlap.
+ *
+ * KEEPALIVE frames, which depend on the backend timing, are not compared.
+ * The backend is the echo backend of the simulation: captures of a real
+ * authenticator are to be compared on the frame headers only (-H).
+ *
+ * A transaction lasts from a request first frame to the last frame of its
+ * response, both timestamped by the capture hook, i.e. when received from
+ * and pushed to the HID layer. Their latency is reported for the capture
+ * and for the replay.
+ */
+
+/* channels allocated in the capture */
+#define REPLAY_MAX_CIDS       1024
+/* channels with a transaction in progress */
+#define REPLAY_MAX_PENDING    64
+/* virtual time without any frame before ending the replay */
+#define REPLAY_DRAIN_US       1000000ULL
+/* reported divergences, the other ones being only counted */
+#define REPLAY_REPORTED       8
+
+#define REPLAY_NO_TXN         UINT32_MAX
+#define REPLAY_NO_LATENCY     UINT64_MAX
+
+typedef struct {
+    uint32_t cid;
+    uint32_t txn;        /* transaction in progress, REPLAY_NO_TXN if none */
+    uint64_t start_us;
+    uint16_t remaining;  /* response bytes still expected */
+    bool     responding; /* response first frame received */
+} replay_pending_t;
+
+/* transactions of a frames stream, numbered in their request order */
+typedef struct {
+    replay_pending_t pending[REPLAY_MAX_PENDING];
+    uint32_t         started;
+    uint32_t         completed;
+    uint64_t        *latency_us;
+} replay_txns_t;
+
+/* transaction description, from the capture */
+typedef struct {
+    uint32_t cid;
+    uint8_t  cmd;
+} replay_txn_desc_t;
+
+static struct {
+    const ctap_capture_rec_t *recs;
+    uint32_t                  nrecs;
+    uint64_t                  first_us;  /* capture time of the first record */
+    uint64_t                  base_us;   /* replay time of the first record */
+    uint32_t                  next_out;  /* next record to push */
+    uint32_t                  next_in;   /* next record to compare */
+    uint64_t                  last_us;   /* replay time of the last frame */
+    bool                      headers_only;
+    bool                      failed;
+    /* recorded channels and their replay counterpart */
+    struct {
+        uint32_t rec;
+        uint32_t rep;
+        bool     mapped;
+    } cids[REPLAY_MAX_CIDS];
+    uint32_t                  ncids;
+    replay_txn_desc_t        *desc;
+    bool                     *after_resp; /* per record: request on an idle channel */
+    replay_txns_t             recorded;
+    replay_txns_t             replayed;
+    uint32_t                  in_frames;
+    uint32_t                  in_keepalives;
+    uint32_t                  differing;
+    uint32_t                  extra;
+} replay = { 0 };
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-H] [-v] [-i usb_interval_us] [-c systick_cost_us] [-a backend_delay_us [-t chunk]] [-S seed] capture_file\n", prog);
+    fprintf(stderr, "  -H  compare the frames headers (CID, CMD or SEQ) only\n");
+    fprintf(stderr, "  -v  print the latency of each transaction\n");
+    fprintf(stderr, "  -a  use the asynchronous echo backend, completing after the given delay\n");
+    fprintf(stderr, "  -t  stream the asynchronous backend response by chunks of the given size\n");
+}
+
+static inline uint32_t frame_cid(const uint8_t *frame)
+{
+    uint32_t cid;
+    memcpy(&cid, frame, sizeof(cid));
+    return cid;
+}
+
+static inline bool frame_is_keepalive(const uint8_t *frame)
+{
+    return frame[4] == (CTAP_KEEPALIVE | 0x80);
+}
+
+/* INIT response allocating a channel: the new CID follows the nonce */
+static inline bool frame_allocates(const uint8_t *frame, uint32_t *newcid)
+{
+    if (frame_cid(frame) != CTAPHID_BROADCAST_CID || frame[4] != (CTAP_INIT | 0x80) ||
+        ((frame[5] << 8) | frame[6]) < 17) {
+        return false;
+    }
+    memcpy(newcid, &frame[7 + 8], sizeof(*newcid));
+    return true;
+}
+
+/*
+ * Channels mapping
+ */
+
+static int cid_lookup(uint32_t rec)
+{
+    for (uint32_t i = 0; i < replay.ncids; ++i) {
+        if (replay.cids[i].rec == rec) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static uint32_t cid_to_replay(uint32_t rec)
+{
+    int i = cid_lookup(rec);
+    return (i >= 0 && replay.cids[i].mapped) ? replay.cids[i].rep : rec;
+}
+
+static uint32_t cid_to_record(uint32_t rep)
+{
+    for (uint32_t i = 0; i < replay.ncids; ++i) {
+        if (replay.cids[i].mapped && replay.cids[i].rep == rep) {
+            return replay.cids[i].rec;
+        }
+    }
+    return rep;
+}
+
+/* allocated in the capture, but not yet during the replay */
+static bool cid_unmapped(uint32_t rec)
+{
+    int i = cid_lookup(rec);
+    return (i >= 0 && !replay.cids[i].mapped);
+}
+
+/*
+ * Transactions tracking, on recorded CIDs
+ */
+
+static replay_pending_t *txn_chan(replay_txns_t *t, uint32_t cid, bool alloc)
+{
+    replay_pending_t *oldest = NULL;
+
+    for (uint32_t i = 0; i < REPLAY_MAX_PENDING; ++i) {
+        if (t->pending[i].txn != REPLAY_NO_TXN && t->pending[i].cid == cid) {
+            return &t->pending[i];
+        }
+    }
+    if (!alloc) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < REPLAY_MAX_PENDING; ++i) {
+        if (t->pending[i].txn == REPLAY_NO_TXN) {
+            return &t->pending[i];
+        }
+        if (oldest == NULL || t->pending[i].start_us < oldest->start_us) {
+            oldest = &t->pending[i];
+        }
+    }
+    /* too many concurrent transactions: the oldest one is lost */
+    return oldest;
+}
+
+static void txn_init(replay_txns_t *t, uint32_t num)
+{
+    memset(t, 0, sizeof(*t));
+    for (uint32_t i = 0; i < REPLAY_MAX_PENDING; ++i) {
+        t->pending[i].txn = REPLAY_NO_TXN;
+    }
+    t->latency_us = malloc((num != 0 ? num : 1) * sizeof(uint64_t));
+    for (uint32_t i = 0; i < num; ++i) {
+        t->latency_us[i] = REPLAY_NO_LATENCY;
+    }
+}
+
+/* request first frame: a transaction starts, CANCEL excepted (no response) */
+static bool txn_out(replay_txns_t *t, uint32_t cid, const uint8_t *frame, uint64_t ts)
+{
+    replay_pending_t *chan;
+
+    if (!(frame[4] & 0x80) || frame[4] == (CTAP_CANCEL | 0x80)) {
+        return false;
+    }
+    chan = txn_chan(t, cid, true);
+    chan->cid = cid;
+    chan->txn = t->started++;
+    chan->start_us = ts;
+    chan->remaining = 0;
+    chan->responding = false;
+    return true;
+}
+
+static void txn_in(replay_txns_t *t, uint32_t cid, const uint8_t *frame, uint64_t ts)
+{
+    replay_pending_t *chan = txn_chan(t, cid, false);
+    uint16_t len;
+
+    if (chan == NULL || frame_is_keepalive(frame)) {
+        return;
+    }
+    if (frame[4] & 0x80) {
+        chan->remaining = (frame[5] << 8) | frame[6];
+        chan->responding = true;
+        len = CTAPHID_INIT_DATA_LEN;
+    } else if (chan->responding) {
+        len = CTAPHID_SEQ_DATA_LEN;
+    } else {
+        return;
+    }
+    chan->remaining -= (chan->remaining < len) ? chan->remaining : len;
+    if (chan->remaining == 0) {
+        t->latency_us[chan->txn] = ts - chan->start_us;
+        t->completed++;
+        chan->txn = REPLAY_NO_TXN;
+    }
+}
+
+/*
+ * Capture pre-scan: channels allocations and recorded transactions
+ */
+
+static bool prescan(void)
+{
+    uint32_t requests = 0, newcid, lost = 0;
+
+    for (uint32_t i = 0; i < replay.nrecs; ++i) {
+        const ctap_capture_rec_t *rec = &replay.recs[i];
+        if (i != 0 && rec->seq != replay.recs[i - 1].seq + 1) {
+            lost += rec->seq - replay.recs[i - 1].seq - 1;
+        }
+        if (rec->dir == CTAP_CAPTURE_OUT && (rec->frame[4] & 0x80)) {
+            requests++;
+        }
+        if (rec->dir == CTAP_CAPTURE_IN && frame_allocates(rec->frame, &newcid) &&
+            cid_lookup(newcid) < 0) {
+            if (replay.ncids == REPLAY_MAX_CIDS) {
+                fprintf(stderr, "too many channels in the capture\n");
+                return false;
+            }
+            replay.cids[replay.ncids].rec = newcid;
+            replay.cids[replay.ncids].mapped = false;
+            replay.ncids++;
+        }
+    }
+    if (lost != 0) {
+        printf("warning: %u records lost during the capture\n", lost);
+    }
+    replay.desc = calloc((requests != 0) ? requests : 1, sizeof(replay_txn_desc_t));
+    replay.after_resp = calloc((replay.nrecs != 0) ? replay.nrecs : 1, sizeof(bool));
+    txn_init(&replay.recorded, requests);
+    txn_init(&replay.replayed, requests);
+    for (uint32_t i = 0; i < replay.nrecs; ++i) {
+        const ctap_capture_rec_t *rec = &replay.recs[i];
+        uint32_t cid = frame_cid(rec->frame);
+        if (rec->dir == CTAP_CAPTURE_IN) {
+            txn_in(&replay.recorded, cid, rec->frame, rec->ts_us);
+            continue;
+        }
+        replay.after_resp[i] = (txn_chan(&replay.recorded, cid, false) == NULL);
+        if (txn_out(&replay.recorded, cid, rec->frame, rec->ts_us)) {
+            replay.desc[replay.recorded.started - 1].cid = cid;
+            replay.desc[replay.recorded.started - 1].cmd = rec->frame[4];
+        }
+    }
+    return true;
+}
+
+/*
+ * Replay
+ */
+
+static void report_divergence(const char *what, const uint8_t *expected, const uint8_t *got)
+{
+    if ((replay.differing + replay.extra) > REPLAY_REPORTED) {
+        return;
+    }
+    printf("IN frame %u %s:", replay.in_frames, what);
+    if (expected != NULL) {
+        printf(" expected cid 0x%08x cmd/seq 0x%02x", frame_cid(expected), expected[4]);
+    }
+    if (got != NULL) {
+        printf(" got cid 0x%08x cmd/seq 0x%02x", frame_cid(got), got[4]);
+    }
+    printf("\n");
+}
+
+/* compare a replayed IN frame with the next recorded one */
+static void compare_in(const uint8_t *frame)
+{
+    const ctap_capture_rec_t *rec = NULL;
+    uint8_t expected[CTAP_CAPTURE_FRAME_LEN];
+    uint32_t newcid, cid;
+    int i;
+
+    while (replay.next_in < replay.nrecs) {
+        rec = &replay.recs[replay.next_in++];
+        if (rec->dir == CTAP_CAPTURE_IN && !frame_is_keepalive(rec->frame)) {
+            break;
+        }
+        rec = NULL;
+    }
+    if (rec == NULL) {
+        replay.extra++;
+        report_divergence("not in the capture", NULL, frame);
+        return;
+    }
+    memcpy(expected, rec->frame, sizeof(expected));
+    /* the channel allocated by the replay stands for the recorded one */
+    if (frame_allocates(expected, &newcid) && frame_allocates(frame, &cid) &&
+        (i = cid_lookup(newcid)) >= 0 && !replay.cids[i].mapped) {
+        replay.cids[i].rep = cid;
+        replay.cids[i].mapped = true;
+    }
+    cid = cid_to_replay(frame_cid(expected));
+    memcpy(&expected[0], &cid, sizeof(cid));
+    if ((expected[4] == (CTAP_INIT | 0x80)) && ((expected[5] << 8) | expected[6]) >= 17) {
+        memcpy(&newcid, &expected[7 + 8], sizeof(newcid));
+        newcid = cid_to_replay(newcid);
+        memcpy(&expected[7 + 8], &newcid, sizeof(newcid));
+    }
+    for (uint8_t off = 0; off < (replay.headers_only ? 5 : CTAP_CAPTURE_FRAME_LEN); ++off) {
+        if (expected[off] != frame[off]) {
+            replay.differing++;
+            report_divergence("differs", expected, frame);
+            if ((replay.differing + replay.extra) <= REPLAY_REPORTED) {
+                printf("  first difference at byte %u: expected 0x%02x, got 0x%02x\n", off, expected[off], frame[off]);
+            }
+            break;
+        }
+    }
+}
+
+/* frames captured during the replay */
+static void replay_capture(const ctap_capture_rec_t *rec)
+{
+    uint32_t cid = cid_to_record(frame_cid(rec->frame));
+
+    replay.last_us = rec->ts_us;
+    if (rec->dir == CTAP_CAPTURE_OUT) {
+        txn_out(&replay.replayed, cid, rec->frame, rec->ts_us);
+        return;
+    }
+    if (frame_is_keepalive(rec->frame)) {
+        replay.in_keepalives++;
+        return;
+    }
+    compare_in(rec->frame);
+    replay.in_frames++;
+    /* the mapping may have been established by this very frame */
+    txn_in(&replay.replayed, cid_to_record(frame_cid(rec->frame)), rec->frame, rec->ts_us);
+}
+
+/* host side: push the recorded OUT frames, at their recorded time */
+static void agent(void)
+{
+    uint8_t frame[CTAP_CAPTURE_FRAME_LEN];
+
+    while (replay.next_out < replay.nrecs) {
+        const ctap_capture_rec_t *rec = &replay.recs[replay.next_out];
+        uint32_t cid = frame_cid(rec->frame);
+        if (rec->dir != CTAP_CAPTURE_OUT) {
+            replay.next_out++;
+            continue;
+        }
+        if (cid_unmapped(cid)) {
+            /* the INIT response allocating this channel is still to come */
+            break;
+        }
+        if ((rec->frame[4] & 0x80) && replay.after_resp[replay.next_out] &&
+            (sim_usb_out_pending() != 0 || txn_chan(&replay.replayed, cid, false) != NULL)) {
+            /* the response to the previous request is still to come */
+            break;
+        }
+        memcpy(frame, rec->frame, sizeof(frame));
+        cid = cid_to_replay(cid);
+        memcpy(&frame[0], &cid, sizeof(cid));
+        if (!sim_usb_out_push_at(frame, replay.base_us + (rec->ts_us - replay.first_us))) {
+            break;
+        }
+        replay.next_out++;
+    }
+    /* the responses are checked by the capture hook */
+    while (sim_usb_in_pop(NULL)) {
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *what, const replay_txns_t *t)
+{
+    uint64_t *sorted = malloc((t->started != 0 ? t->started : 1) * sizeof(uint64_t));
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < t->started; ++i) {
+        if (t->latency_us[i] != REPLAY_NO_LATENCY) {
+            sorted[n++] = t->latency_us[i];
+        }
+    }
+    if (n == 0) {
+        printf("  %-9s no completed transaction\n", what);
+    } else {
+        qsort(sorted, n, sizeof(uint64_t), cmp_u64);
+        printf("  %-9s %u transactions, latency (us) min %llu, p50 %llu, p99 %llu, max %llu\n",
+               what, n, (unsigned long long)sorted[0], (unsigned long long)sorted[n / 2],
+               (unsigned long long)sorted[(n * 99) / 100], (unsigned long long)sorted[n - 1]);
+    }
+    free(sorted);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t interval = 0;
+    uint64_t seed = 1;
+    bool async = false, verbose = false;
+    struct stat st;
+    void *map;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "Hvi:c:a:t:S:h")) != -1) {
+        switch (opt) {
+            case 'H': replay.headers_only = true; break;
+            case 'v': verbose = true; break;
+            case 'i': interval = strtoul(optarg, NULL, 0); break;
+            case 'c': sim_clock_set_read_cost(strtoul(optarg, NULL, 0)); break;
+            case 'a': async = true; sim_async_set_delay(strtoul(optarg, NULL, 0)); break;
+            case 't': sim_async_set_stream(strtoul(optarg, NULL, 0)); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    /* the capture is read in place */
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if ((size_t)st.st_size < sizeof(ctap_capture_hdr_t)) {
+        fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    const ctap_capture_hdr_t *hdr = map;
+    if (hdr->magic != CTAP_CAPTURE_MAGIC || hdr->version != CTAP_CAPTURE_VERSION ||
+        hdr->rec_size != sizeof(ctap_capture_rec_t)) {
+        fprintf(stderr, "%s: not a version %u capture file\n", argv[optind], CTAP_CAPTURE_VERSION);
+        return EXIT_FAILURE;
+    }
+    replay.recs = (const ctap_capture_rec_t*)(hdr + 1);
+    replay.nrecs = (st.st_size - sizeof(ctap_capture_hdr_t)) / sizeof(ctap_capture_rec_t);
+    replay.first_us = (replay.nrecs != 0) ? replay.recs[0].ts_us : 0;
+    if (!prescan()) {
+        return EXIT_FAILURE;
+    }
+
+    sim_rng_seed(seed);
+    sim_usb_set_interval(interval);
+    mbed_error_t errcode = async ? ctap_declare_async(0, sim_async_apdu, sim_wink)
+                                 : ctap_declare(0, sim_echo_apdu, sim_wink);
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    if (errcode == MBED_ERROR_NONE) {
+        errcode = async ? ctap_declare_cbor_async(sim_async_apdu)
+                        : ctap_declare_cbor(sim_echo_apdu);
+    }
+#endif
+    if (errcode != MBED_ERROR_NONE || ctap_configure() != MBED_ERROR_NONE) {
+        fprintf(stderr, "CTAP stack initialization failed\n");
+        return EXIT_FAILURE;
+    }
+    if (ctap_declare_capture(replay_capture) != MBED_ERROR_NONE) {
+        fprintf(stderr, "the replay requires a CONFIG_USR_LIB_CTAP_CAPTURE build\n");
+        return EXIT_FAILURE;
+    }
+    replay.base_us = sim_clock_us();
+    replay.last_us = replay.base_us;
+    sim_set_agent(agent);
+
+    /* until the last frame has been pushed, and nothing happens anymore */
+    while (replay.next_out < replay.nrecs || sim_usb_out_pending() != 0 ||
+           (sim_clock_us() - replay.last_us) < REPLAY_DRAIN_US) {
+        ctap_exec();
+        if ((sim_clock_us() - replay.last_us) >= REPLAY_DRAIN_US && replay.next_out < replay.nrecs &&
+            sim_usb_out_pending() == 0) {
+            fprintf(stderr, "record %u: channel 0x%08x never allocated by the replay\n",
+                    replay.next_out, frame_cid(replay.recs[replay.next_out].frame));
+            replay.failed = true;
+            break;
+        }
+    }
+
+    /* recorded frames never sent back */
+    uint32_t missing = 0;
+    while (replay.next_in < replay.nrecs) {
+        const ctap_capture_rec_t *rec = &replay.recs[replay.next_in++];
+        if (rec->dir == CTAP_CAPTURE_IN && !frame_is_keepalive(rec->frame)) {
+            missing++;
+        }
+    }
+
+    printf("capture %s: %u records over %.3f ms, %u transactions\n", argv[optind], replay.nrecs,
+           (replay.nrecs != 0) ? (double)(replay.recs[replay.nrecs - 1].ts_us - replay.first_us) / 1000.0 : 0.0,
+           replay.recorded.started);
+    print_latency("recorded:", &replay.recorded);
+    print_latency("replayed:", &replay.replayed);
+    printf("  frames:   %u IN frames compared (%s), %u keepalives\n", replay.in_frames,
+           replay.headers_only ? "headers" : "full frames", replay.in_keepalives);
+    printf("  diverged: %u differing, %u missing, %u extra frames\n", replay.differing, missing, replay.extra);
+    if (verbose) {
+        for (uint32_t i = 0; i < replay.recorded.started; ++i) {
+            printf("  txn %u cid 0x%08x cmd 0x%02x: recorded %lld us, replayed %lld us\n", i,
+                   replay.desc[i].cid, replay.desc[i].cmd,
+                   (replay.recorded.latency_us[i] != REPLAY_NO_LATENCY) ? (long long)replay.recorded.latency_us[i] : -1LL,
+                   (i < replay.replayed.started && replay.replayed.latency_us[i] != REPLAY_NO_LATENCY) ? (long long)replay.replayed.latency_us[i] : -1LL);
+        }
+    }
+    free(replay.desc);
+    free(replay.after_resp);
+    free(replay.recorded.latency_us);
+    free(replay.replayed.latency_us);
+    munmap(map, st.st_size);
+    if (replay.failed || replay.differing != 0 || missing != 0 || replay.extra != 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
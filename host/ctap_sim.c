@@ -0,0 +1,427 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "api/libctap.h"
+#include "ctap_protocol.h"
+#include "ctap_trace.h"
+#include "ctap_sim.h"
+
+/*
+ * End-to-end simulation harness: open a channel with a broadcast INIT, then
+ * push a number of MSG (or PING) requests through ctap_exec(), checking that
+ * the echo backend response matches the request, and report throughput.
+ * With -T, the built-in throughput vendor command is used instead, sinking
+ * or sourcing the given size.
+ * With -D (CONFIG_USR_LIB_CTAP_TRACE builds), the trace ring snapshot is
+ * dumped at the end of the run, for host/ctap_trace_decode.
+ * With -C, the HID frames are recorded in a capture file, to be replayed
+ * by host/ctap_replay.
+ *
+ * The host side is a sim agent: it sends the next request as soon as the
+ * previous response has been received, while the library is running.
+ */
+
+/* virtual time without any completed transaction before failing */
+#define SIM_STALL_TIMEOUT_US 10000000ULL
+
+static struct {
+    uint32_t requests;
+    uint32_t size;
+    uint8_t  cmd;
+    int      throughput; /* CTAP_THROUGHPUT_* mode, -1 if not used */
+    uint32_t cid;
+    uint32_t done;
+    uint32_t keepalives;
+    bool     opened;
+    bool     failed;
+    uint64_t sent_us;
+    uint64_t start_us;
+    uint64_t end_us;
+    uint64_t slept_us;
+    uint64_t reads;
+    uint64_t latency_us;
+    uint64_t max_latency_us;
+    uint8_t  req[CTAPHID_MAX_PAYLOAD_SIZE];
+    uint8_t  resp[CTAPHID_MAX_PAYLOAD_SIZE];
+} sim = { 0 };
+
+#if CONFIG_USR_LIB_CTAP_TRACE
+static bool dump_trace(const char *path)
+{
+    static uint8_t snapshot[sizeof(ctap_trace_hdr_t) + CTAP_TRACE_RECORDS * sizeof(ctap_trace_rec_t)];
+    uint16_t len = ctap_trace_snapshot(snapshot, sizeof(snapshot));
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    if (fwrite(snapshot, 1, len, f) != len) {
+        perror(path);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    return true;
+}
+#endif
+
+static FILE *capture_file = NULL;
+
+static void capture(const ctap_capture_rec_t *rec)
+{
+    if (fwrite(rec, sizeof(*rec), 1, capture_file) != 1) {
+        sim.failed = true;
+    }
+}
+
+static bool start_capture(const char *path)
+{
+    ctap_capture_hdr_t hdr = {
+        .magic = CTAP_CAPTURE_MAGIC,
+        .version = CTAP_CAPTURE_VERSION,
+        .rec_size = sizeof(ctap_capture_rec_t),
+    };
+
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL || fwrite(&hdr, sizeof(hdr), 1, capture_file) != 1) {
+        perror(path);
+        return false;
+    }
+    if (ctap_declare_capture(capture) != MBED_ERROR_NONE) {
+        fprintf(stderr, "-C requires a CONFIG_USR_LIB_CTAP_CAPTURE build\n");
+        return false;
+    }
+    return true;
+}
+
+static const uint8_t nonce[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n requests] [-s payload_size] [-p|-b|-T mode] [-i usb_interval_us] [-c systick_cost_us] [-a backend_delay_us [-t chunk]] [-S seed] [-D trace_file] [-C capture_file]\n", prog);
+    fprintf(stderr, "  -p  use CTAPHID_PING instead of CTAPHID_MSG\n");
+    fprintf(stderr, "  -T  use the throughput vendor command, sinking (0) or sourcing (1) the payload size\n");
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    fprintf(stderr, "  -b  use CTAPHID_CBOR instead of CTAPHID_MSG\n");
+#endif
+    fprintf(stderr, "  -c  virtual time consumed by each systick read (emulates the core speed)\n");
+    fprintf(stderr, "  -a  use the asynchronous backend, completing after the given delay\n");
+    fprintf(stderr, "  -t  stream the asynchronous backend response by chunks of the given size\n");
+    fprintf(stderr, "  -D  dump the trace ring snapshot in the given file (trace builds)\n");
+    fprintf(stderr, "  -C  record the HID frames in the given capture file\n");
+}
+
+static double wall_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* upper bound (us) of the log2 histogram bucket holding the p quantile */
+static uint64_t hist_quantile(const uint32_t *hist, double p)
+{
+    uint64_t total = 0, acc = 0;
+    uint8_t i;
+
+    for (i = 0; i < CTAP_STATS_HIST_BUCKETS; ++i) {
+        total += hist[i];
+    }
+    for (i = 0; i < CTAP_STATS_HIST_BUCKETS; ++i) {
+        acc += hist[i];
+        if (acc != 0 && (double)acc >= p * (double)total) {
+            break;
+        }
+    }
+    return (i == 0) ? 0 : (1ULL << i);
+}
+
+/* the response matches the request */
+static bool check_response(uint32_t rcid, uint8_t rcmd, uint16_t rlen)
+{
+    if (rcid != sim.cid || rcmd != sim.cmd) {
+        return false;
+    }
+    switch (sim.throughput) {
+        case CTAP_THROUGHPUT_SINK:
+            return (rlen == 2 && (uint32_t)((sim.resp[0] << 8) | sim.resp[1]) == sim.size);
+        case CTAP_THROUGHPUT_SOURCE:
+            if (rlen != sim.size) {
+                return false;
+            }
+            for (uint32_t i = 0; i < sim.size; ++i) {
+                if (sim.resp[i] != (uint8_t)i) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return (rlen == sim.size && memcmp(sim.req, sim.resp, sim.size) == 0);
+    }
+}
+
+static void send_request(void)
+{
+    uint16_t len = sim.size;
+
+    switch (sim.throughput) {
+        case CTAP_THROUGHPUT_SINK:
+            sim.req[0] = CTAP_THROUGHPUT_SINK;
+            break;
+        case CTAP_THROUGHPUT_SOURCE:
+            sim.req[0] = CTAP_THROUGHPUT_SOURCE;
+            sim.req[1] = (sim.size >> 8) & 0xff;
+            sim.req[2] = sim.size & 0xff;
+            len = 3;
+            break;
+        default:
+            sim.req[0] = (uint8_t)sim.done;
+            break;
+    }
+    sim.sent_us = sim_clock_us();
+    if (!sim_host_send(sim.cid, sim.cmd, sim.req, len)) {
+        fprintf(stderr, "host OUT queue full\n");
+        sim.failed = true;
+    }
+}
+
+static void agent(void)
+{
+    uint32_t rcid;
+    uint8_t rcmd;
+    uint16_t rlen;
+
+    if (sim.failed || sim.done == sim.requests) {
+        return;
+    }
+    if (!sim_host_recv(&rcid, &rcmd, sim.resp, &rlen)) {
+        return;
+    }
+    if (!sim.opened) {
+        if (rcmd != (CTAP_INIT | 0x80) || rlen < 17 || memcmp(sim.resp, nonce, sizeof(nonce)) != 0 ||
+            (sim.cmd == (CTAP_CBOR | 0x80) && !(sim.resp[16] & CTAP_CAPA_CBOR))) {
+            fprintf(stderr, "INIT failed (cmd 0x%x, len %u)\n", rcmd, rlen);
+            sim.failed = true;
+            return;
+        }
+        memcpy(&sim.cid, &sim.resp[8], sizeof(sim.cid));
+        sim.opened = true;
+        sim.start_us = sim_clock_us();
+        sim.slept_us = sim_clock_slept_us();
+        sim.reads = sim_clock_reads();
+        ctap_reset_stats();
+        send_request();
+        return;
+    }
+    if (rcid == sim.cid && rcmd == (CTAP_KEEPALIVE | 0x80) && rlen == 1) {
+        /* the backend is still processing our request */
+        sim.keepalives++;
+        return;
+    }
+    if (!check_response(rcid, rcmd, rlen)) {
+        fprintf(stderr, "request %u: bad response (cid 0x%x cmd 0x%x len %u)\n", sim.done, rcid, rcmd, rlen);
+        sim.failed = true;
+        return;
+    }
+    uint64_t latency = sim_clock_us() - sim.sent_us;
+    sim.latency_us += latency;
+    if (latency > sim.max_latency_us) {
+        sim.max_latency_us = latency;
+    }
+    sim.done++;
+    if (sim.done < sim.requests) {
+        send_request();
+    } else {
+        sim.end_us = sim_clock_us();
+        sim.slept_us = sim_clock_slept_us() - sim.slept_us;
+        sim.reads = sim_clock_reads() - sim.reads;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t interval = 0;
+    uint64_t seed = 1;
+    const char *trace_path = NULL;
+    const char *capture_path = NULL;
+    bool async = false;
+    int opt;
+
+    sim.requests = 100000;
+    sim.size = 64;
+    sim.cmd = CTAP_MSG | 0x80;
+    sim.throughput = -1;
+    while ((opt = getopt(argc, argv, "n:s:pbT:i:c:a:t:S:D:C:h")) != -1) {
+        switch (opt) {
+            case 'n': sim.requests = strtoul(optarg, NULL, 0); break;
+            case 's': sim.size = strtoul(optarg, NULL, 0); break;
+            case 'p': sim.cmd = CTAP_PING | 0x80; break;
+            case 'b':
+#if CONFIG_USR_LIB_CTAP_CTAP2
+                sim.cmd = CTAP_CBOR | 0x80;
+                break;
+#else
+                fprintf(stderr, "CTAPHID_CBOR requires a CONFIG_USR_LIB_CTAP_CTAP2 build\n");
+                return EXIT_FAILURE;
+#endif
+            case 'T':
+                sim.cmd = CTAP_VENDOR_THROUGHPUT | 0x80;
+                sim.throughput = (int)strtoul(optarg, NULL, 0);
+                break;
+            case 'i': interval = strtoul(optarg, NULL, 0); break;
+            case 'c': sim_clock_set_read_cost(strtoul(optarg, NULL, 0)); break;
+            case 'a': async = true; sim_async_set_delay(strtoul(optarg, NULL, 0)); break;
+            case 't': sim_async_set_stream(strtoul(optarg, NULL, 0)); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            case 'D': trace_path = optarg; break;
+            case 'C': capture_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (sim.requests == 0 || sim.size > CTAPHID_MAX_PAYLOAD_SIZE ||
+        (sim.cmd == (CTAP_MSG | 0x80) && sim.size < 4) ||
+        (sim.cmd == (CTAP_CBOR | 0x80) && sim.size < 1) ||
+        (sim.throughput == CTAP_THROUGHPUT_SINK && sim.size < 1) ||
+        (sim.throughput > CTAP_THROUGHPUT_SOURCE)) {
+        fprintf(stderr, "invalid parameters\n");
+        return EXIT_FAILURE;
+    }
+#if !CONFIG_USR_LIB_CTAP_TRACE
+    if (trace_path != NULL) {
+        fprintf(stderr, "-D requires a CONFIG_USR_LIB_CTAP_TRACE build (make trace)\n");
+        return EXIT_FAILURE;
+    }
+#endif
+    for (uint32_t i = 0; i < sim.size; ++i) {
+        sim.req[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    sim_rng_seed(seed);
+    sim_usb_set_interval(interval);
+    mbed_error_t errcode = async ? ctap_declare_async(0, sim_async_apdu, sim_wink)
+                                 : ctap_declare(0, sim_echo_apdu, sim_wink);
+#if CONFIG_USR_LIB_CTAP_CTAP2
+    if (errcode == MBED_ERROR_NONE) {
+        /* the echo backends do not care about the APDU vs CBOR content */
+        errcode = async ? ctap_declare_cbor_async(sim_async_apdu)
+                        : ctap_declare_cbor(sim_echo_apdu);
+    }
+#endif
+    if (errcode != MBED_ERROR_NONE || ctap_configure() != MBED_ERROR_NONE) {
+        fprintf(stderr, "CTAP stack initialization failed\n");
+        return EXIT_FAILURE;
+    }
+    if (capture_path != NULL && !start_capture(capture_path)) {
+        return EXIT_FAILURE;
+    }
+    sim_set_agent(agent);
+
+    /* open our channel, the agent then chains the requests */
+    sim_host_send(CTAPHID_BROADCAST_CID, CTAP_INIT | 0x80, nonce, sizeof(nonce));
+
+    uint64_t frames_out = sim_usb_out_delivered();
+    uint64_t frames_in = sim_usb_in_sent();
+    double start = wall_seconds();
+    uint32_t last_done = 0;
+    uint64_t last_progress = sim_clock_us();
+    while (!sim.failed && sim.done < sim.requests) {
+        ctap_exec();
+        if (sim.done != last_done) {
+            last_done = sim.done;
+            last_progress = sim_clock_us();
+        }
+        if ((sim_clock_us() - last_progress) > SIM_STALL_TIMEOUT_US) {
+            fprintf(stderr, "request %u never completed\n", sim.done);
+            sim.failed = true;
+        }
+    }
+    if (capture_file != NULL) {
+        ctap_declare_capture(NULL);
+        if (fclose(capture_file) != 0) {
+            sim.failed = true;
+        }
+    }
+    if (sim.failed) {
+        return EXIT_FAILURE;
+    }
+    double elapsed = wall_seconds() - start;
+    uint64_t velapsed = sim.end_us - sim.start_us;
+    ctap_stats_t stats = { 0 };
+    ctap_get_stats(&stats);
+    uint32_t errors = 0;
+    for (uint8_t i = 0; i < CTAP_STATS_ERR_NUM; ++i) {
+        errors += stats.errors[i];
+    }
+    uint32_t busy = 0;
+    for (uint8_t i = 0; i < CTAP_STATS_BUSY_NUM; ++i) {
+        busy += stats.busy[i];
+    }
+    frames_out = sim_usb_out_delivered() - frames_out;
+    frames_in = sim_usb_in_sent() - frames_in;
+
+    printf("channel 0x%08x: %u %s requests of %u bytes\n", sim.cid, sim.requests,
+           (sim.throughput == CTAP_THROUGHPUT_SINK) ? "THROUGHPUT sink" :
+           (sim.throughput == CTAP_THROUGHPUT_SOURCE) ? "THROUGHPUT source" :
+           (sim.cmd == (CTAP_PING | 0x80)) ? "PING" : (sim.cmd == (CTAP_CBOR | 0x80)) ? "CBOR" : "MSG", sim.size);
+    printf("  frames:  %llu out, %llu in (%u keepalives), OUT EP NAK on full RX ring %u times\n",
+           (unsigned long long)frames_out, (unsigned long long)frames_in, sim.keepalives,
+           stats.rx_stalls);
+    printf("  wall:    %.3f s, %.0f frames/s, %.0f transactions/s\n",
+           elapsed, (double)(frames_out + frames_in) / elapsed, (double)sim.requests / elapsed);
+    printf("  virtual: %.3f ms, %.1f us/transaction (max %llu us), %.0f bytes/s\n",
+           (double)velapsed / 1000.0, (double)sim.latency_us / (double)sim.requests,
+           (unsigned long long)sim.max_latency_us,
+           (velapsed != 0) ? (((sim.throughput < 0) ? 2.0 : 1.0) * sim.size * sim.requests * 1e6 / (double)velapsed) : 0.0);
+    printf("  cpu:     %.1f%% of virtual time asleep, %.1f systick reads/transaction\n",
+           (velapsed != 0) ? (100.0 * (double)sim.slept_us / (double)velapsed) : 0.0,
+           (double)sim.reads / (double)sim.requests);
+    printf("  stats:   %u frames received, %u sent, %u error responses, %u evictions\n",
+           stats.frames_rx, stats.frames_tx, errors, stats.evictions);
+    if (busy != 0) {
+        printf("  busy:    %u no reassembly buffer, %u response buffer held, %u backend busy, %u channel busy, %u no channel, %u locked\n",
+               stats.busy[CTAP_STATS_BUSY_POOL], stats.busy[CTAP_STATS_BUSY_RESP],
+               stats.busy[CTAP_STATS_BUSY_BACKEND], stats.busy[CTAP_STATS_BUSY_CHANNEL],
+               stats.busy[CTAP_STATS_BUSY_CID], stats.busy[CTAP_STATS_BUSY_LOCK]);
+    }
+    if (sim.cmd == (CTAP_MSG | 0x80) || sim.cmd == (CTAP_CBOR | 0x80)) {
+        const uint32_t *hist = stats.backend_us[(sim.cmd == (CTAP_CBOR | 0x80)) ? CTAP_STATS_BACKEND_CBOR : CTAP_STATS_BACKEND_MSG];
+        printf("  backend: p50 < %llu us, p99 < %llu us\n",
+               (unsigned long long)hist_quantile(hist, 0.5), (unsigned long long)hist_quantile(hist, 0.99));
+    }
+#if CONFIG_USR_LIB_CTAP_TRACE
+    if (trace_path != NULL && !dump_trace(trace_path)) {
+        return EXIT_FAILURE;
+    }
+#endif
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef CTAP_SIM_H_
+#define CTAP_SIM_H_
+
+/*
+ * Host simulation of the environment of libctap:
+ *
+ * [ sim host (CTAPHID client) ]  <--- ctap_sim_host.c
+ *  -[OUT queue]-[IN queue]----
+ * [ libusbhid emulation        ]  <--- usbhid_shim.c
+ * [ libctap                    ]  <--- ../ctap_*.c, unmodified
+ * [ EwoK emulation             ]  <--- ewok_shim.c (virtual clock, RNG, timers)
+ *
+ * Everything is single threaded: USB events (frame reception, report sent)
+ * and timer callbacks are delivered while the library reads the virtual
+ * clock or sleeps, the same way EwoK ISR handlers preempt the main thread.
+ */
+
+#include "libc/types.h"
+
+#define SIM_FRAME_LEN       64
+#define SIM_QUEUE_DEPTH     1024
+#define SIM_MAX_PAYLOAD     7609
+
+/*
+ * Virtual clock (microseconds). Each systick read costs SIM_SYSTICK_COST_US
+ * by default, which can be raised to emulate a slower core.
+ */
+#define SIM_SYSTICK_COST_US 1
+
+uint64_t sim_clock_us(void);
+
+void     sim_clock_set_read_cost(uint32_t us);
+
+void     sim_clock_advance(uint64_t us);
+
+/* number of sys_get_systick() calls and virtual time spent in sys_sleep() */
+uint64_t sim_clock_reads(void);
+
+uint64_t sim_clock_slept_us(void);
+
+/* virtual time of the next pending event (USB transfer or timer), UINT64_MAX if none */
+uint64_t sim_next_event_us(void);
+
+/* run pending bus events, timers and host agent at the current virtual time */
+void     sim_tick(void);
+
+/*
+ * The host agent is executed at each tick, after the bus events. This is
+ * where the simulated host consumes responses and sends new requests,
+ * concurrently with the library execution.
+ */
+typedef void (*sim_agent_t)(void);
+
+void     sim_set_agent(sim_agent_t agent);
+
+/*
+ * Next virtual time at which the agent has something to do on its own
+ * (e.g. a think time expiring), waking up a sleeping library as any
+ * other event. UINT64_MAX if none.
+ */
+void     sim_agent_wakeup(uint64_t at_us);
+
+/*
+ * Deterministic RNG backing get_random(). Each call costs SIM_TRNG_COST_US,
+ * the EwoK TRNG being reached through a syscall.
+ */
+#define SIM_TRNG_COST_US    20
+
+void     sim_rng_seed(uint64_t seed);
+
+/*
+ * USB link emulation. interval_us is the minimum virtual time between two
+ * transfers in each direction (0: unthrottled, 1000: full speed interrupt EP).
+ */
+void     sim_usb_set_interval(uint32_t interval_us);
+
+void     sim_usb_step(void);
+
+uint64_t sim_usb_next_event_us(void);
+
+bool     sim_usb_out_push(const uint8_t *frame);
+
+/* the frame is not transferred before at_us (virtual time) */
+bool     sim_usb_out_push_at(const uint8_t *frame, uint64_t at_us);
+
+bool     sim_usb_in_pop(uint8_t *frame);
+
+uint32_t sim_usb_out_pending(void);
+
+uint32_t sim_usb_in_pending(void);
+
+uint64_t sim_usb_out_delivered(void);
+
+uint64_t sim_usb_in_sent(void);
+
+/*
+ * When set, the frames sent by the library are handed to the sink instead
+ * of being queued to the host (used by the microbenchmarks).
+ */
+typedef void (*sim_usb_sink_t)(const uint8_t *frame, uint8_t len);
+
+void     sim_usb_set_in_sink(sim_usb_sink_t sink);
+
+/*
+ * CTAPHID client helpers (fragmentation and reassembly at host side)
+ */
+bool     sim_host_send(uint32_t cid, uint8_t cmd, const uint8_t *data, uint16_t len);
+
+/* return true when a full message has been reassembled from the IN queue */
+bool     sim_host_recv(uint32_t *cid, uint8_t *cmd, uint8_t *data, uint16_t *len);
+
+/*
+ * Backends
+ */
+mbed_error_t sim_echo_apdu(uint32_t metadata,
+                           uint8_t *msg_in, uint16_t len_in,
+                           uint8_t *resp, uint16_t *len_out);
+
+mbed_error_t sim_wink(uint16_t timeout_ms);
+
+/* asynchronous echo backend, completing delay_us after the submission */
+void         sim_async_set_delay(uint32_t delay_us);
+
+/* stream the response by chunks of chunk bytes (0: complete at once) */
+void         sim_async_set_stream(uint16_t chunk);
+
+void         sim_async_cancel(void);
+
+mbed_error_t sim_async_apdu(uint32_t metadata,
+                            uint8_t *msg_in, uint16_t len_in,
+                            uint8_t *resp, uint16_t resp_maxlen);
+
+#endif/*!CTAP_SIM_H_*/
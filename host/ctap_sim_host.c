@@ -0,0 +1,278 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "libc/time.h"
+#include "api/libctap.h"
+#include "ctap_sim.h"
+
+/*
+ * Host side CTAPHID client: fragments requests into OUT frames and
+ * reassembles IN frames into responses.
+ */
+
+#define SIM_INIT_HDR_LEN 7
+#define SIM_SEQ_HDR_LEN  5
+
+bool sim_host_send(uint32_t cid, uint8_t cmd, const uint8_t *data, uint16_t len)
+{
+    uint8_t frame[SIM_FRAME_LEN];
+    uint16_t idx = 0;
+    uint8_t seq = 0;
+    uint16_t chunk;
+
+    if (len > SIM_MAX_PAYLOAD || (data == NULL && len != 0)) {
+        return false;
+    }
+    memset(frame, 0, sizeof(frame));
+    memcpy(&frame[0], &cid, sizeof(cid));
+    frame[4] = cmd;
+    frame[5] = (len >> 8) & 0xff;
+    frame[6] = len & 0xff;
+    chunk = (len > (SIM_FRAME_LEN - SIM_INIT_HDR_LEN)) ? (SIM_FRAME_LEN - SIM_INIT_HDR_LEN) : len;
+    if (chunk != 0) {
+        memcpy(&frame[SIM_INIT_HDR_LEN], data, chunk);
+    }
+    idx = chunk;
+    if (!sim_usb_out_push(frame)) {
+        return false;
+    }
+    while (idx < len) {
+        memset(frame, 0, sizeof(frame));
+        memcpy(&frame[0], &cid, sizeof(cid));
+        frame[4] = seq++;
+        chunk = len - idx;
+        if (chunk > (SIM_FRAME_LEN - SIM_SEQ_HDR_LEN)) {
+            chunk = SIM_FRAME_LEN - SIM_SEQ_HDR_LEN;
+        }
+        memcpy(&frame[SIM_SEQ_HDR_LEN], &data[idx], chunk);
+        idx += chunk;
+        if (!sim_usb_out_push(frame)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct {
+    bool     inprogress;
+    uint32_t cid;
+    uint8_t  cmd;
+    uint16_t len;
+    uint16_t idx;
+    uint8_t  seq;
+} rx = { 0 };
+
+bool sim_host_recv(uint32_t *cid, uint8_t *cmd, uint8_t *data, uint16_t *len)
+{
+    uint8_t frame[SIM_FRAME_LEN];
+    uint16_t chunk;
+
+    while (sim_usb_in_pop(frame)) {
+        uint32_t fcid;
+        memcpy(&fcid, &frame[0], sizeof(fcid));
+        if (frame[4] & 0x80) {
+            /* initialization frame: (re)start a message */
+            rx.inprogress = true;
+            rx.cid = fcid;
+            rx.cmd = frame[4];
+            rx.len = (frame[5] << 8) | frame[6];
+            rx.idx = 0;
+            rx.seq = 0;
+            chunk = (rx.len > (SIM_FRAME_LEN - SIM_INIT_HDR_LEN)) ? (SIM_FRAME_LEN - SIM_INIT_HDR_LEN) : rx.len;
+            memcpy(&data[0], &frame[SIM_INIT_HDR_LEN], chunk);
+            rx.idx = chunk;
+        } else {
+            if (!rx.inprogress || fcid != rx.cid || frame[4] != rx.seq) {
+                /* unexpected continuation frame, drop it */
+                continue;
+            }
+            rx.seq++;
+            chunk = rx.len - rx.idx;
+            if (chunk > (SIM_FRAME_LEN - SIM_SEQ_HDR_LEN)) {
+                chunk = SIM_FRAME_LEN - SIM_SEQ_HDR_LEN;
+            }
+            memcpy(&data[rx.idx], &frame[SIM_SEQ_HDR_LEN], chunk);
+            rx.idx += chunk;
+        }
+        if (rx.idx >= rx.len) {
+            rx.inprogress = false;
+            *cid = rx.cid;
+            *cmd = rx.cmd;
+            *len = rx.len;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Echo APDU backend: the response is the request.
+ */
+mbed_error_t sim_echo_apdu(uint32_t metadata,
+                           uint8_t *msg_in, uint16_t len_in,
+                           uint8_t *resp, uint16_t *len_out)
+{
+    (void)metadata;
+    if (msg_in == NULL || resp == NULL || len_out == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (len_in > *len_out) {
+        return MBED_ERROR_NOMEM;
+    }
+    memcpy(resp, msg_in, len_in);
+    *len_out = len_in;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t sim_wink(uint16_t timeout_ms)
+{
+    (void)timeout_ms;
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * Asynchronous echo APDU backend: the response is produced delay_us after
+ * the submission by a virtual timer, as if a separate task had executed it.
+ * In streaming mode, the same production time is spread over chunks of
+ * chunk bytes, each one being pushed as soon as it is produced.
+ */
+static struct {
+    bool      init;
+    timer_t   timer;
+    uint32_t  delay_us;
+    uint16_t  chunk;
+    uint8_t  *msg_in;
+    uint16_t  len_in;
+    uint8_t  *resp;
+    uint16_t  resp_maxlen;
+    uint16_t  pushed;
+} async = { 0 };
+
+static void sim_async_done(__sigval_t sig)
+{
+    (void)sig;
+    if (async.len_in > async.resp_maxlen) {
+        ctap_backend_complete(MBED_ERROR_NOMEM, 0);
+        return;
+    }
+    if (async.chunk != 0) {
+        struct itimerspec its = { 0 };
+        uint16_t len = async.len_in - async.pushed;
+        if (len > async.chunk) {
+            len = async.chunk;
+        }
+        /* produced in place, in the response buffer */
+        memcpy(&async.resp[async.pushed], &async.msg_in[async.pushed], len);
+        if (ctap_backend_resp_push(&async.resp[async.pushed], len) != MBED_ERROR_NONE) {
+            timer_settime(async.timer, 0, &its, NULL);
+            ctap_backend_complete(MBED_ERROR_UNKNOWN, 0);
+            return;
+        }
+        async.pushed += len;
+        if (async.pushed < async.len_in) {
+            return;
+        }
+        timer_settime(async.timer, 0, &its, NULL);
+    } else {
+        memcpy(async.resp, async.msg_in, async.len_in);
+    }
+    ctap_backend_complete(MBED_ERROR_NONE, async.len_in);
+}
+
+/* the host cancelled the request: stop early, as a real backend would */
+void sim_async_cancel(void)
+{
+    struct itimerspec its = { 0 };
+
+    if (async.init) {
+        timer_settime(async.timer, 0, &its, NULL);
+    }
+    ctap_backend_complete(MBED_ERROR_INTR, 0);
+}
+
+void sim_async_set_delay(uint32_t delay_us)
+{
+    async.delay_us = delay_us;
+}
+
+void sim_async_set_stream(uint16_t chunk)
+{
+    async.chunk = chunk;
+}
+
+mbed_error_t sim_async_apdu(uint32_t metadata,
+                            uint8_t *msg_in, uint16_t len_in,
+                            uint8_t *resp, uint16_t resp_maxlen)
+{
+    struct itimerspec its = { 0 };
+    (void)metadata;
+
+    if (msg_in == NULL || resp == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (!async.init) {
+        struct sigevent sevp = { 0 };
+        sevp.sigev_notify = SIGEV_THREAD;
+        sevp.sigev_notify_function = sim_async_done;
+        if (timer_create(CLOCK_MONOTONIC, &sevp, &async.timer) == -1) {
+            return MBED_ERROR_UNKNOWN;
+        }
+        async.init = true;
+    }
+    async.msg_in = msg_in;
+    async.len_in = len_in;
+    async.resp = resp;
+    async.resp_maxlen = resp_maxlen;
+    async.pushed = 0;
+    if (async.chunk != 0 && len_in != 0 && len_in <= resp_maxlen) {
+        /* the length of the echo is known before producing it */
+        uint64_t step = (uint64_t)async.delay_us * async.chunk / len_in;
+        if (ctap_backend_resp_begin(len_in) != MBED_ERROR_NONE) {
+            return MBED_ERROR_UNKNOWN;
+        }
+        if (step == 0) {
+            step = 1;
+        }
+        its.it_value.tv_sec = step / 1000000;
+        its.it_value.tv_nsec = (step % 1000000) * 1000;
+        its.it_interval = its.it_value;
+        if (timer_settime(async.timer, 0, &its, NULL) == -1) {
+            return MBED_ERROR_UNKNOWN;
+        }
+        return MBED_ERROR_NONE;
+    }
+    if (async.delay_us == 0) {
+        /* completed before returning from the submission */
+        sim_async_done((__sigval_t){ 0 });
+        return MBED_ERROR_NONE;
+    }
+    its.it_value.tv_sec = async.delay_us / 1000000;
+    its.it_value.tv_nsec = (async.delay_us % 1000000) * 1000;
+    if (timer_settime(async.timer, 0, &its, NULL) == -1) {
+        return MBED_ERROR_UNKNOWN;
+    }
+    return MBED_ERROR_NONE;
+}
@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctap_trace.h"
+
+/*
+ * Trace ring snapshot decoder: read a snapshot (as returned by the
+ * CTAPHID_VENDOR_TRACE command or by ctap_trace_snapshot(), e.g. dumped with
+ * ctap_sim -D) and print one line per record, with its time relative to the
+ * first record and to the previous one. Records times are the engine clock
+ * at its last systick read (see ctap_trace.h): records written between two
+ * reads share their time.
+ */
+
+static const char *event_names[CTAP_TRACE_EVENTS] = {
+    [CTAP_TRACE_RX_FRAME]       = "RX_FRAME",
+    [CTAP_TRACE_RX_STALL]       = "RX_STALL",
+    [CTAP_TRACE_DISPATCH]       = "DISPATCH",
+    [CTAP_TRACE_TX_QUEUE]       = "TX_QUEUE",
+    [CTAP_TRACE_TX_FRAME]       = "TX_FRAME",
+    [CTAP_TRACE_TX_SENT]        = "TX_SENT",
+    [CTAP_TRACE_TX_DROP]        = "TX_DROP",
+    [CTAP_TRACE_TX_ABORT]       = "TX_ABORT",
+    [CTAP_TRACE_ERROR]          = "ERROR",
+    [CTAP_TRACE_CID_NEW]        = "CID_NEW",
+    [CTAP_TRACE_CID_EVICT]      = "CID_EVICT",
+    [CTAP_TRACE_BACKEND_SUBMIT] = "BACKEND_SUBMIT",
+    [CTAP_TRACE_BACKEND_DONE]   = "BACKEND_DONE",
+    [CTAP_TRACE_CANCEL]         = "CANCEL",
+    [CTAP_TRACE_LOCK]           = "LOCK",
+};
+
+int main(int argc, char **argv)
+{
+    ctap_trace_hdr_t hdr;
+    ctap_trace_rec_t rec;
+    uint32_t first = 0, prev = 0;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s snapshot_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CTAP_TRACE_MAGIC ||
+        hdr.version != CTAP_TRACE_VERSION || hdr.rec_size != sizeof(ctap_trace_rec_t)) {
+        fprintf(stderr, "%s: not a version %u trace snapshot\n", argv[1], CTAP_TRACE_VERSION);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    printf("%u records (%u written, %u lost)\n", hdr.count, hdr.written, hdr.written - hdr.count);
+    printf("%12s %10s  %-10s %-14s %5s %6s\n", "time (us)", "delta", "cid", "event", "arg8", "arg16");
+    for (uint16_t i = 0; i < hdr.count; ++i) {
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            fprintf(stderr, "%s: truncated after %u records\n", argv[1], i);
+            fclose(f);
+            return EXIT_FAILURE;
+        }
+        if (i == 0) {
+            first = prev = rec.ts;
+        }
+        /* 32 bits timestamps, the unsigned differences handle their wrap */
+        printf("%12u %10u  0x%08x %-14s 0x%02x %6u\n", rec.ts - first, rec.ts - prev, rec.cid,
+               (rec.event < CTAP_TRACE_EVENTS && event_names[rec.event] != NULL) ? event_names[rec.event] : "?",
+               rec.arg8, rec.arg16);
+        prev = rec.ts;
+    }
+    fclose(f);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/time.h"
+#include "libc/random.h"
+#include "ctap_sim.h"
+
+/*
+ * EwoK kernel emulation: virtual clock, TRNG and POSIX timers.
+ */
+
+static uint64_t sim_now_us = 0;
+static uint64_t sim_reads = 0;
+static uint64_t sim_slept_us = 0;
+static uint32_t sim_read_cost_us = SIM_SYSTICK_COST_US;
+
+void sim_clock_set_read_cost(uint32_t us)
+{
+    sim_read_cost_us = us;
+}
+
+uint64_t sim_clock_reads(void)
+{
+    return sim_reads;
+}
+
+uint64_t sim_clock_slept_us(void)
+{
+    return sim_slept_us;
+}
+
+uint64_t sim_clock_us(void)
+{
+    return sim_now_us;
+}
+
+void sim_clock_advance(uint64_t us)
+{
+    sim_now_us += us;
+    sim_tick();
+}
+
+e_syscall_ret sys_get_systick(uint64_t *val, e_tick_type type)
+{
+    if (val == NULL) {
+        return SYS_E_INVAL;
+    }
+    /* reading the clock is what lets time (and events) flow */
+    sim_reads++;
+    sim_clock_advance(sim_read_cost_us);
+    switch (type) {
+        case PREC_MILLI:
+            *val = sim_now_us / 1000;
+            break;
+        case PREC_MICRO:
+            *val = sim_now_us;
+            break;
+        case PREC_CYCLE:
+            /* consider a 64MHz core */
+            *val = sim_now_us * 64;
+            break;
+        default:
+            return SYS_E_INVAL;
+    }
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_sleep(uint32_t time_ms, sleep_mode_t mode)
+{
+    uint64_t target = sim_now_us + (uint64_t)time_ms * 1000ULL;
+
+    if (mode == SLEEP_MODE_INTERRUPTIBLE) {
+        /* jump to the next event, if it occurs before the end of the sleep */
+        uint64_t ev = sim_next_event_us();
+        if (ev < target) {
+            target = (ev > sim_now_us) ? ev : sim_now_us;
+        }
+    }
+    sim_slept_us += target - sim_now_us;
+    sim_now_us = target;
+    sim_tick();
+    return SYS_E_DONE;
+}
+
+/*
+ * Deterministic RNG (xorshift64*), so that two runs with the same seed
+ * generate the same CIDs.
+ */
+volatile sec_random_t random_secure = SEC_RANDOM_SECURE;
+
+static uint64_t sim_rng_state = 0x9e3779b97f4a7c15ULL;
+
+void sim_rng_seed(uint64_t seed)
+{
+    sim_rng_state = (seed != 0) ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+mbed_error_t get_random(unsigned char *buf, uint16_t len)
+{
+    if (buf == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    sim_clock_advance(SIM_TRNG_COST_US);
+    for (uint16_t i = 0; i < len; ++i) {
+        sim_rng_state ^= sim_rng_state >> 12;
+        sim_rng_state ^= sim_rng_state << 25;
+        sim_rng_state ^= sim_rng_state >> 27;
+        buf[i] = (uint8_t)((sim_rng_state * 0x2545f4914f6cdd1dULL) >> 56);
+    }
+    return MBED_ERROR_NONE;
+}
+
+/*
+ * POSIX timers on the virtual clock. Callbacks are executed synchronously
+ * from sim_tick(), i.e. in the middle of whatever the library was doing
+ * when it read the clock, which is the closest we get to SIGEV_THREAD.
+ */
+#define SIM_MAX_TIMERS 4
+
+typedef struct {
+    bool              used;
+    bool              armed;
+    struct sigevent   sevp;
+    uint64_t          next_us;
+    uint64_t          interval_us;
+} sim_timer_t;
+
+static sim_timer_t sim_timers[SIM_MAX_TIMERS];
+
+int sim_timer_create(clockid_t clockid, struct sigevent *sevp, timer_t *timerid)
+{
+    (void)clockid;
+    if (sevp == NULL || timerid == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < SIM_MAX_TIMERS; ++i) {
+        if (!sim_timers[i].used) {
+            sim_timers[i].used = true;
+            sim_timers[i].armed = false;
+            sim_timers[i].sevp = *sevp;
+            *timerid = (timer_t)(uintptr_t)(i + 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int sim_timer_settime(timer_t timerid, int flags,
+                      const struct itimerspec *new_value,
+                      struct itimerspec *old_value)
+{
+    uint32_t i = (uint32_t)(uintptr_t)timerid - 1;
+    (void)flags;
+    (void)old_value;
+    if (i >= SIM_MAX_TIMERS || !sim_timers[i].used || new_value == NULL) {
+        return -1;
+    }
+    uint64_t first = (uint64_t)new_value->it_value.tv_sec * 1000000ULL +
+                     (uint64_t)new_value->it_value.tv_nsec / 1000ULL;
+    sim_timers[i].interval_us = (uint64_t)new_value->it_interval.tv_sec * 1000000ULL +
+                                (uint64_t)new_value->it_interval.tv_nsec / 1000ULL;
+    sim_timers[i].armed = (first != 0);
+    sim_timers[i].next_us = sim_now_us + first;
+    return 0;
+}
+
+static uint64_t sim_agent_wake_us = UINT64_MAX;
+
+void sim_agent_wakeup(uint64_t at_us)
+{
+    sim_agent_wake_us = at_us;
+}
+
+uint64_t sim_next_event_us(void)
+{
+    uint64_t next = sim_usb_next_event_us();
+    if (sim_agent_wake_us < next) {
+        next = sim_agent_wake_us;
+    }
+    for (uint32_t i = 0; i < SIM_MAX_TIMERS; ++i) {
+        if (sim_timers[i].armed && sim_timers[i].next_us < next) {
+            next = sim_timers[i].next_us;
+        }
+    }
+    return next;
+}
+
+static void sim_timers_run(void)
+{
+    for (uint32_t i = 0; i < SIM_MAX_TIMERS; ++i) {
+        sim_timer_t *t = &sim_timers[i];
+        if (!t->armed || sim_now_us < t->next_us) {
+            continue;
+        }
+        if (t->interval_us != 0) {
+            t->next_us += t->interval_us;
+        } else {
+            t->armed = false;
+        }
+        if (t->sevp.sigev_notify_function != NULL) {
+            t->sevp.sigev_notify_function(t->sevp.sigev_value);
+        }
+    }
+}
+
+static sim_agent_t sim_agent = NULL;
+
+void sim_set_agent(sim_agent_t agent)
+{
+    sim_agent = agent;
+}
+
+void sim_tick(void)
+{
+    static bool in_tick = false;
+    /* callbacks may read the clock again: do not recurse */
+    if (in_tick) {
+        return;
+    }
+    in_tick = true;
+    sim_usb_step();
+    sim_timers_run();
+    if (sim_agent != NULL) {
+        sim_agent();
+    }
+    in_tick = false;
+}
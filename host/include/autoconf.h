@@ -0,0 +1,85 @@
+/*
+ * Host build configuration.
+ *
+ * This file replaces the SDK generated autoconf.h when building the
+ * library on a Linux host (see host/Makefile). Each entry mirrors a
+ * Kconfig option of the library and can be overriden from the command
+ * line (e.g. make CTAP_CFLAGS=-DCONFIG_USR_LIB_CTAP_DEBUG=1).
+ */
+#ifndef AUTOCONF_H_
+#define AUTOCONF_H_
+
+#define CONFIG_USR_LIB_CTAP 1
+
+#ifndef CONFIG_USR_LIB_CTAP_DEBUG
+# define CONFIG_USR_LIB_CTAP_DEBUG 0
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_EVENT_WAIT
+# define CONFIG_USR_LIB_CTAP_EVENT_WAIT 1
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_RX_SLOTS
+# define CONFIG_USR_LIB_CTAP_RX_SLOTS 4
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_RX_POOL_SIZE
+# define CONFIG_USR_LIB_CTAP_RX_POOL_SIZE 8192
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_TX_QUEUE_DEPTH
+# define CONFIG_USR_LIB_CTAP_TX_QUEUE_DEPTH 4
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH
+# define CONFIG_USR_LIB_CTAP_PING_CUT_THROUGH 1
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_STATS
+# define CONFIG_USR_LIB_CTAP_STATS 1
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_VENDOR_CMDS
+# define CONFIG_USR_LIB_CTAP_VENDOR_CMDS 4
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_VENDOR_THROUGHPUT
+# define CONFIG_USR_LIB_CTAP_VENDOR_THROUGHPUT 1
+#endif
+
+/* enabled with the trace target, see the Makefile */
+#ifndef CONFIG_USR_LIB_CTAP_TRACE
+# define CONFIG_USR_LIB_CTAP_TRACE 0
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_TRACE_RECORDS
+# define CONFIG_USR_LIB_CTAP_TRACE_RECORDS 256
+#endif
+
+/* captures are recorded with ctap_sim -C */
+#ifndef CONFIG_USR_LIB_CTAP_CAPTURE
+# define CONFIG_USR_LIB_CTAP_CAPTURE 1
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL
+# define CONFIG_USR_LIB_CTAP_KEEPALIVE_INTERVAL 100
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_CTAP1
+# define CONFIG_USR_LIB_CTAP_CTAP1 1
+#endif
+
+/* enabled on host, so that the CBOR path is built and simulated */
+#ifndef CONFIG_USR_LIB_CTAP_CTAP2
+# define CONFIG_USR_LIB_CTAP_CTAP2 1
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_MAX_CONCURRENT_CIDS
+# define CONFIG_USR_LIB_CTAP_MAX_CONCURRENT_CIDS 2
+#endif
+
+#ifndef CONFIG_USR_LIB_CTAP_CID_POOL
+# define CONFIG_USR_LIB_CTAP_CID_POOL 4
+#endif
+
+#endif/*!AUTOCONF_H_*/
@@ -0,0 +1,6 @@
+#ifndef LIBC_ERRNO_H_
+#define LIBC_ERRNO_H_
+
+#include <errno.h>
+
+#endif/*!LIBC_ERRNO_H_*/
@@ -0,0 +1,18 @@
+/*
+ * Host emulation of the libstd TRNG interface (deterministic PRNG).
+ */
+#ifndef LIBC_RANDOM_H_
+#define LIBC_RANDOM_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    SEC_RANDOM_NONSECURE = 0,
+    SEC_RANDOM_SECURE    = 1,
+} sec_random_t;
+
+extern volatile sec_random_t random_secure;
+
+mbed_error_t get_random(unsigned char *buf, uint16_t len);
+
+#endif/*!LIBC_RANDOM_H_*/
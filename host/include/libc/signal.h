@@ -0,0 +1,6 @@
+#ifndef LIBC_SIGNAL_H_
+#define LIBC_SIGNAL_H_
+
+#include <signal.h>
+
+#endif/*!LIBC_SIGNAL_H_*/
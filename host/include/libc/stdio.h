@@ -0,0 +1,6 @@
+#ifndef LIBC_STDIO_H_
+#define LIBC_STDIO_H_
+
+#include <stdio.h>
+
+#endif/*!LIBC_STDIO_H_*/
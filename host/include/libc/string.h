@@ -0,0 +1,6 @@
+#ifndef LIBC_STRING_H_
+#define LIBC_STRING_H_
+
+#include <string.h>
+
+#endif/*!LIBC_STRING_H_*/
@@ -0,0 +1,74 @@
+/*
+ * Host emulation of the libstd synchronization helpers.
+ *
+ * The simulator is single threaded: "ISR" code (triggers) and the main
+ * thread interleave on the same core, a compiler barrier is thus enough
+ * to order their memory accesses (as the DMB on a single core Cortex-M).
+ */
+#ifndef LIBC_SYNC_H_
+#define LIBC_SYNC_H_
+
+#include "libc/types.h"
+
+static inline void request_data_membarrier(void)
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void set_bool_with_membarrier(volatile bool *target, bool val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+static inline void set_u8_with_membarrier(volatile uint8_t *target, uint8_t val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+static inline void set_u16_with_membarrier(volatile uint16_t *target, uint16_t val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+static inline void set_u32_with_membarrier(volatile uint32_t *target, uint32_t val)
+{
+    *target = val;
+    request_data_membarrier();
+}
+
+/*
+ * Mutexes are only used between the main thread and ISR handlers (the
+ * simulator is single threaded), trylock is thus never waiting.
+ */
+static inline void mutex_init(volatile uint32_t *mutex)
+{
+    *mutex = 0;
+}
+
+static inline bool mutex_trylock(volatile uint32_t *mutex)
+{
+    if (*mutex != 0) {
+        return false;
+    }
+    *mutex = 1;
+    request_data_membarrier();
+    return true;
+}
+
+static inline void mutex_lock(volatile uint32_t *mutex)
+{
+    while (!mutex_trylock(mutex)) {
+        continue;
+    }
+}
+
+static inline void mutex_unlock(volatile uint32_t *mutex)
+{
+    request_data_membarrier();
+    *mutex = 0;
+}
+
+#endif/*!LIBC_SYNC_H_*/
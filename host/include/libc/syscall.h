@@ -0,0 +1,35 @@
+/*
+ * Host emulation of the EwoK syscalls used by the library.
+ *
+ * The time base is the virtual clock of the simulator (see host/ewok_shim.c),
+ * which only moves forward when the library reads it or sleeps.
+ */
+#ifndef LIBC_SYSCALL_H_
+#define LIBC_SYSCALL_H_
+
+#include <stdint.h>
+
+typedef enum {
+    SYS_E_DONE = 0,
+    SYS_E_INVAL,
+    SYS_E_DENIED,
+    SYS_E_BUSY,
+} e_syscall_ret;
+
+typedef enum {
+    PREC_MILLI,
+    PREC_MICRO,
+    PREC_CYCLE,
+} e_tick_type;
+
+typedef enum {
+    SLEEP_MODE_INTERRUPTIBLE,
+    SLEEP_MODE_DEEP,
+} sleep_mode_t;
+
+e_syscall_ret sys_get_systick(uint64_t *val, e_tick_type type);
+
+/* sleep for time_ms, or until the next external event if interruptible */
+e_syscall_ret sys_sleep(uint32_t time_ms, sleep_mode_t mode);
+
+#endif/*!LIBC_SYSCALL_H_*/
@@ -0,0 +1,23 @@
+/*
+ * Host emulation of the libstd POSIX timers.
+ *
+ * Timers are driven by the simulator virtual clock instead of the host
+ * one, so that the periodic callbacks are executed deterministically.
+ */
+#ifndef LIBC_TIME_H_
+#define LIBC_TIME_H_
+
+#include <time.h>
+#include <signal.h>
+#include "libc/syscall.h"
+
+#define timer_create  sim_timer_create
+#define timer_settime sim_timer_settime
+
+int sim_timer_create(clockid_t clockid, struct sigevent *sevp, timer_t *timerid);
+
+int sim_timer_settime(timer_t timerid, int flags,
+                      const struct itimerspec *new_value,
+                      struct itimerspec *old_value);
+
+#endif/*!LIBC_TIME_H_*/
@@ -0,0 +1,39 @@
+/*
+ * Host emulation of the EwoK libstd basic types.
+ */
+#ifndef LIBC_TYPES_H_
+#define LIBC_TYPES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef __packed
+# define __packed __attribute__((packed))
+#endif
+
+typedef enum {
+    MBED_ERROR_NONE = 0,
+    MBED_ERROR_NOMEM,
+    MBED_ERROR_NOSTORAGE,
+    MBED_ERROR_NOBACKEND,
+    MBED_ERROR_INVCREDENCIALS,
+    MBED_ERROR_UNKNOWN,
+    MBED_ERROR_INVPARAM,
+    MBED_ERROR_WRERROR,
+    MBED_ERROR_RDERROR,
+    MBED_ERROR_INITFAIL,
+    MBED_ERROR_BUSY,
+    MBED_ERROR_NOTREADY,
+    MBED_ERROR_INVSTATE,
+    MBED_ERROR_UNSUPORTED,
+    MBED_ERROR_DENIED,
+    MBED_ERROR_NOTFOUND,
+    MBED_ERROR_TOOBIG,
+    MBED_ERROR_INTR,
+} mbed_error_t;
+
+/* EwoK syscalls are reachable from any libstd header */
+#include "libc/syscall.h"
+
+#endif/*!LIBC_TYPES_H_*/
@@ -0,0 +1,102 @@
+/*
+ * Host emulation of the libusbhid API used by libctap.
+ *
+ * Only the subset required by the CTAP stack is declared here. The
+ * implementation (host/usbhid_shim.c) connects the HID OUT and IN
+ * endpoints to in-memory queues driven by the simulator.
+ */
+#ifndef LIBUSBHID_H_
+#define LIBUSBHID_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    USBHID_SUBCLASS_NONE = 0,
+    USBHID_SUBCLASS_BOOT_IFACE = 1,
+} usbhid_subclass_t;
+
+typedef enum {
+    USBHID_PROTOCOL_NONE     = 0,
+    USBHID_PROTOCOL_KEYBOARD = 1,
+    USBHID_PROTOCOL_MOUSE    = 2,
+} usbhid_protocol_t;
+
+/* HID items types */
+#define USBHID_ITEM_TYPE_MAIN    0x0
+#define USBHID_ITEM_TYPE_GLOBAL  0x1
+#define USBHID_ITEM_TYPE_LOCAL   0x2
+
+/* Main items tags */
+#define USBHID_ITEM_MAIN_TAG_INPUT          0x8
+#define USBHID_ITEM_MAIN_TAG_OUTPUT         0x9
+#define USBHID_ITEM_MAIN_TAG_COLLECTION     0xa
+#define USBHID_ITEM_MAIN_TAG_FEATURE        0xb
+#define USBHID_ITEM_MAIN_TAG_END_COLLECTION 0xc
+
+/* Global items tags */
+#define USBHID_ITEM_GLOBAL_TAG_USAGE_PAGE   0x0
+#define USBHID_ITEM_GLOBAL_TAG_LOGICAL_MIN  0x1
+#define USBHID_ITEM_GLOBAL_TAG_LOGICAL_MAX  0x2
+#define USBHID_ITEM_GLOBAL_TAG_REPORT_SIZE  0x7
+#define USBHID_ITEM_GLOBAL_TAG_REPORT_COUNT 0x9
+
+/* Local items tags */
+#define USBHID_ITEM_LOCAL_TAG_USAGE         0x0
+
+/* Collection items */
+#define USBHID_COLL_ITEM_APPLICATION        0x1
+
+/* Input/Output/Feature items flags */
+#define USBHID_IOF_ITEM_DATA     0x0
+#define USBHID_IOF_ITEM_CONST    0x1
+#define USBHID_IOF_ITEM_VARIABLE 0x2
+#define USBHID_IOF_ITEM_RELATIVE 0x4
+
+typedef struct {
+    uint8_t type;
+    uint8_t tag;
+    uint8_t size;
+    uint8_t data1;
+    uint8_t data2;
+} usbhid_item_info_t;
+
+typedef struct {
+    uint8_t             num_items;
+    uint8_t             report_id;
+    usbhid_item_info_t *items;
+} usbhid_report_infos_t;
+
+typedef usbhid_report_infos_t *(*usbhid_get_report_t)(uint8_t hid_handler, uint8_t index);
+typedef mbed_error_t (*usbhid_set_report_t)(uint8_t hid_handler, uint8_t index);
+typedef mbed_error_t (*usbhid_set_protocol_t)(uint8_t hid_handler, uint8_t proto);
+typedef mbed_error_t (*usbhid_set_idle_t)(uint8_t hid_handler, uint8_t idle);
+
+mbed_error_t usbhid_declare(uint32_t usbxdci_handler,
+                            usbhid_subclass_t hid_subclass,
+                            usbhid_protocol_t hid_protocol,
+                            uint8_t num_descriptor,
+                            uint8_t poller_ms,
+                            bool dedicated_out_ep,
+                            uint16_t ep_mpsize,
+                            uint8_t *hid_handler,
+                            uint8_t *in_buf,
+                            uint16_t in_buf_len);
+
+mbed_error_t usbhid_configure(uint8_t hid_handler,
+                              usbhid_get_report_t get_report,
+                              usbhid_set_report_t set_report,
+                              usbhid_set_protocol_t set_proto,
+                              usbhid_set_idle_t set_idle);
+
+mbed_error_t usbhid_recv_report(uint8_t hid_handler, uint8_t *buf, uint16_t size);
+
+mbed_error_t usbhid_send_response(uint8_t hid_handler, uint8_t *response, uint8_t response_len);
+
+mbed_error_t usbhid_response_done(uint8_t hid_handler);
+
+/* triggers, implemented by the upper stack */
+mbed_error_t usbhid_report_received_trigger(uint8_t hid_handler, uint16_t size);
+
+void usbhid_report_sent_trigger(uint8_t hid_handler, uint8_t index);
+
+#endif/*!LIBUSBHID_H_*/
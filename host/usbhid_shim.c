@@ -0,0 +1,296 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "libusbhid.h"
+#include "ctap_sim.h"
+
+/*
+ * libusbhid emulation: a single HID interface whose OUT endpoint is fed
+ * from the simulated host OUT queue, and whose IN endpoint pushes into the
+ * host IN queue.
+ *
+ * As with the real stack, an OUT frame is only delivered when the upper
+ * layer has armed the endpoint with usbhid_recv_report(), and each frame
+ * pushed with usbhid_send_response() is acknowledged later on through
+ * usbhid_report_sent_trigger().
+ *
+ * The host polls both endpoints every interval_us: an OUT frame is
+ * transferred at the first poll following the EP arming (the EP is NAK
+ * before), and IN frames are transferred one per poll. An OUT frame may
+ * also be scheduled, not being transferred before a given virtual time.
+ */
+
+typedef struct {
+    uint8_t  frames[SIM_QUEUE_DEPTH][SIM_FRAME_LEN];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t wire;  /* IN queue only: frames in [tail, wire[ reached the host */
+    uint64_t at_us[SIM_QUEUE_DEPTH]; /* OUT queue only: earliest transfer time */
+} sim_queue_t;
+
+static sim_queue_t out_q;
+static sim_queue_t in_q;
+
+static struct {
+    bool      declared;
+    uint8_t  *out_buf;
+    uint16_t  out_len;
+    uint32_t  interval_us;
+    uint64_t  next_out_us;
+    uint64_t  next_in_us;
+    uint64_t  out_delivered;
+    uint64_t  in_sent;
+    sim_usb_sink_t in_sink;
+} usb = { 0 };
+
+static inline uint32_t sim_queue_count(const sim_queue_t *q)
+{
+    return q->head - q->tail;
+}
+
+/* first host poll at or after t */
+static inline uint64_t sim_usb_next_poll(uint64_t t)
+{
+    if (usb.interval_us == 0) {
+        return t;
+    }
+    return ((t + usb.interval_us - 1) / usb.interval_us) * usb.interval_us;
+}
+
+static bool sim_queue_push(sim_queue_t *q, const uint8_t *frame, uint16_t len)
+{
+    if (sim_queue_count(q) >= SIM_QUEUE_DEPTH) {
+        return false;
+    }
+    uint8_t *slot = q->frames[q->head % SIM_QUEUE_DEPTH];
+    memset(slot, 0, SIM_FRAME_LEN);
+    memcpy(slot, frame, (len > SIM_FRAME_LEN) ? SIM_FRAME_LEN : len);
+    q->head++;
+    return true;
+}
+
+static bool sim_queue_pop(sim_queue_t *q, uint8_t *frame)
+{
+    if (sim_queue_count(q) == 0) {
+        return false;
+    }
+    if (frame != NULL) {
+        memcpy(frame, q->frames[q->tail % SIM_QUEUE_DEPTH], SIM_FRAME_LEN);
+    }
+    q->tail++;
+    return true;
+}
+
+/***********************************************************************
+ * simulator side
+ */
+
+void sim_usb_set_in_sink(sim_usb_sink_t sink)
+{
+    usb.in_sink = sink;
+}
+
+void sim_usb_set_interval(uint32_t interval_us)
+{
+    usb.interval_us = interval_us;
+}
+
+bool sim_usb_out_push(const uint8_t *frame)
+{
+    return sim_usb_out_push_at(frame, 0);
+}
+
+bool sim_usb_out_push_at(const uint8_t *frame, uint64_t at_us)
+{
+    uint32_t slot = out_q.head % SIM_QUEUE_DEPTH;
+
+    if (!sim_queue_push(&out_q, frame, SIM_FRAME_LEN)) {
+        return false;
+    }
+    out_q.at_us[slot] = at_us;
+    return true;
+}
+
+/* next OUT transfer time, the EP being armed and a frame pending */
+static inline uint64_t sim_usb_next_out_us(void)
+{
+    uint64_t at = out_q.at_us[out_q.tail % SIM_QUEUE_DEPTH];
+    return (at > usb.next_out_us) ? sim_usb_next_poll(at) : usb.next_out_us;
+}
+
+bool sim_usb_in_pop(uint8_t *frame)
+{
+    if (in_q.wire == in_q.tail) {
+        return false;
+    }
+    return sim_queue_pop(&in_q, frame);
+}
+
+uint32_t sim_usb_out_pending(void)
+{
+    return sim_queue_count(&out_q);
+}
+
+uint32_t sim_usb_in_pending(void)
+{
+    return in_q.wire - in_q.tail;
+}
+
+uint64_t sim_usb_out_delivered(void)
+{
+    return usb.out_delivered;
+}
+
+uint64_t sim_usb_in_sent(void)
+{
+    return usb.in_sent;
+}
+
+uint64_t sim_usb_next_event_us(void)
+{
+    uint64_t next = UINT64_MAX;
+    if (in_q.head != in_q.wire) {
+        next = usb.next_in_us;
+    }
+    if (usb.out_buf != NULL && sim_queue_count(&out_q) != 0 && sim_usb_next_out_us() < next) {
+        next = sim_usb_next_out_us();
+    }
+    return next;
+}
+
+void sim_usb_step(void)
+{
+    uint64_t now = sim_clock_us();
+
+    /* IN transfer completion */
+    if (in_q.head != in_q.wire && now >= usb.next_in_us) {
+        in_q.wire++;
+        usb.next_in_us = sim_usb_next_poll(now + 1);
+        usbhid_report_sent_trigger(0, 0);
+    }
+    /* OUT transfer, only when the endpoint is armed */
+    if (usb.out_buf != NULL && sim_queue_count(&out_q) != 0 && now >= sim_usb_next_out_us()) {
+        uint8_t *buf = usb.out_buf;
+        uint16_t len = (usb.out_len > SIM_FRAME_LEN) ? SIM_FRAME_LEN : usb.out_len;
+        memcpy(buf, out_q.frames[out_q.tail % SIM_QUEUE_DEPTH], len);
+        out_q.tail++;
+        /* the endpoint is NAK until rearmed */
+        usb.out_buf = NULL;
+        usb.out_delivered++;
+        usb.next_out_us = sim_usb_next_poll(now + 1);
+        usbhid_report_received_trigger(0, len);
+    }
+}
+
+/***********************************************************************
+ * libusbhid API
+ */
+
+mbed_error_t usbhid_declare(uint32_t usbxdci_handler,
+                            usbhid_subclass_t hid_subclass,
+                            usbhid_protocol_t hid_protocol,
+                            uint8_t num_descriptor,
+                            uint8_t poller_ms,
+                            bool dedicated_out_ep,
+                            uint16_t ep_mpsize,
+                            uint8_t *hid_handler,
+                            uint8_t *in_buf,
+                            uint16_t in_buf_len)
+{
+    (void)usbxdci_handler;
+    (void)hid_subclass;
+    (void)hid_protocol;
+    (void)num_descriptor;
+    (void)poller_ms;
+    (void)dedicated_out_ep;
+    (void)in_buf;
+    (void)in_buf_len;
+    if (hid_handler == NULL || ep_mpsize != SIM_FRAME_LEN) {
+        return MBED_ERROR_INVPARAM;
+    }
+    *hid_handler = 0;
+    usb.declared = true;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbhid_configure(uint8_t hid_handler,
+                              usbhid_get_report_t get_report,
+                              usbhid_set_report_t set_report,
+                              usbhid_set_protocol_t set_proto,
+                              usbhid_set_idle_t set_idle)
+{
+    (void)hid_handler;
+    (void)set_report;
+    (void)set_proto;
+    (void)set_idle;
+    if (!usb.declared || get_report == NULL) {
+        return MBED_ERROR_INVSTATE;
+    }
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbhid_recv_report(uint8_t hid_handler, uint8_t *buf, uint16_t size)
+{
+    (void)hid_handler;
+    if (buf == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    usb.out_buf = buf;
+    usb.out_len = size;
+    if (usb.next_out_us < sim_clock_us()) {
+        usb.next_out_us = sim_usb_next_poll(sim_clock_us());
+    }
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbhid_send_response(uint8_t hid_handler, uint8_t *response, uint8_t response_len)
+{
+    (void)hid_handler;
+    if (response == NULL) {
+        return MBED_ERROR_INVPARAM;
+    }
+    if (usb.in_sink != NULL) {
+        /* the sink consumes the frame at once */
+        usb.in_sink(response, response_len);
+        usb.in_sent++;
+        usbhid_report_sent_trigger(0, 0);
+        return MBED_ERROR_NONE;
+    }
+    if (in_q.head == in_q.wire && usb.next_in_us < sim_clock_us()) {
+        usb.next_in_us = sim_usb_next_poll(sim_clock_us());
+    }
+    if (!sim_queue_push(&in_q, response, response_len)) {
+        return MBED_ERROR_BUSY;
+    }
+    usb.in_sent++;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbhid_response_done(uint8_t hid_handler)
+{
+    (void)hid_handler;
+    return MBED_ERROR_NONE;
+}